@@ -0,0 +1,524 @@
+#include <iostream>
+#include <fstream>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <functional>
+#include <array>
+#include <memory>
+#include <cstring>
+#include <cstdlib>
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/perf_event.h>
+#endif
+#include "surge.h"
+#include "evaluate.h"
+
+//Microbenchmarks for the core primitives of the move generator. Each benchmark is timed on its own, and where
+//perf_event_open() is available (Linux, with a low enough perf_event_paranoid setting), the hardware counters below
+//are read as well. Results are written as CSV, one row per benchmark with every value given per operation, so
+//that the output of two builds can be compared with diff or a spreadsheet.
+//
+//Usage:
+//	bench [filter] [output.csv]
+//Only benchmarks whose names contain <filter> are run. Results go to stdout unless a file is given.
+
+const size_t NEVENTS = 6;
+
+const char* EVENT_STR[NEVENTS] = {
+	"cycles", "instructions", "branch_misses", "l1d_misses", "llc_misses", "dtlb_misses"
+};
+
+//Reads hardware performance counters around a benchmark. Counters which cannot be opened are reported as
+//missing, and the wall-clock time is always measured
+class Counters {
+public:
+	Counters() {
+		for (size_t i = 0; i < NEVENTS; i++) fds[i] = -1;
+#ifdef __linux__
+		const uint32_t types[NEVENTS] = {
+			PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HARDWARE, PERF_TYPE_HW_CACHE, PERF_TYPE_HARDWARE,
+			PERF_TYPE_HW_CACHE
+		};
+		const uint64_t configs[NEVENTS] = {
+			PERF_COUNT_HW_CPU_CYCLES, PERF_COUNT_HW_INSTRUCTIONS, PERF_COUNT_HW_BRANCH_MISSES,
+			PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16),
+			PERF_COUNT_HW_CACHE_MISSES,
+			PERF_COUNT_HW_CACHE_DTLB | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)
+		};
+
+		for (size_t i = 0; i < NEVENTS; i++) {
+			perf_event_attr attr;
+			memset(&attr, 0, sizeof(attr));
+			attr.type = types[i];
+			attr.size = sizeof(attr);
+			attr.config = configs[i];
+			attr.disabled = 1;
+			attr.exclude_kernel = 1;
+			attr.exclude_hv = 1;
+			fds[i] = int(syscall(__NR_perf_event_open, &attr, 0, -1, -1, 0));
+		}
+#endif
+	}
+
+	~Counters() {
+#ifdef __linux__
+		for (size_t i = 0; i < NEVENTS; i++) if (fds[i] >= 0) close(fds[i]);
+#endif
+	}
+
+	bool available() const {
+		for (size_t i = 0; i < NEVENTS; i++) if (fds[i] >= 0) return true;
+		return false;
+	}
+
+	void start() {
+#ifdef __linux__
+		for (size_t i = 0; i < NEVENTS; i++)
+			if (fds[i] >= 0) {
+				ioctl(fds[i], PERF_EVENT_IOC_RESET, 0);
+				ioctl(fds[i], PERF_EVENT_IOC_ENABLE, 0);
+			}
+#endif
+		begin = std::chrono::steady_clock::now();
+	}
+
+	void stop() {
+		end = std::chrono::steady_clock::now();
+#ifdef __linux__
+		for (size_t i = 0; i < NEVENTS; i++)
+			if (fds[i] >= 0) {
+				ioctl(fds[i], PERF_EVENT_IOC_DISABLE, 0);
+				if (read(fds[i], &values[i], sizeof(values[i])) != sizeof(values[i])) values[i] = 0;
+			}
+#endif
+	}
+
+	double nanoseconds() const {
+		return double(std::chrono::duration_cast<std::chrono::nanoseconds>(end - begin).count());
+	}
+
+	//Returns the value of an event, or -1 if it could not be counted
+	double value(size_t i) const { return fds[i] >= 0 ? double(values[i]) : -1; }
+private:
+	int fds[NEVENTS];
+	uint64_t values[NEVENTS] = {};
+	std::chrono::steady_clock::time_point begin, end;
+};
+
+//A benchmark does its setup, then measures its work between c.start() and c.stop(), and returns the number of 
+//operations it performed. The checksum is printed so that the compiler cannot discard the work being measured
+struct Benchmark {
+	std::string name;
+	std::function<uint64_t(Counters& c, uint64_t& checksum)> run;
+};
+
+//Positions grouped by the kind of work they give the move generator
+const std::vector<std::string> OPENING_FENS = {
+	DEFAULT_FEN,
+	"r1bqkbnr/pppp1ppp/2n5/4p3/4P3/5N2/PPPP1PPP/RNBQKB1R w KQkq - 2 3",
+	"rnbqkb1r/pp2pppp/3p1n2/8/3NP3/8/PPP2PPP/RNBQKB1R w KQkq - 1 5",
+	"rnbqk2r/ppp1bppp/4pn2/3p4/2PP4/2N2N2/PP2PPPP/R1BQKB1R w KQkq - 4 5",
+};
+
+const std::vector<std::string> MIDDLEGAME_FENS = {
+	KIWIPETE,
+	"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+	"r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1",
+	"r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP3PPP/R2QKB1R w KQ - 0 8",
+};
+
+//Middlegames where each side still has its queen, both rooks and both bishops
+const std::vector<std::string> SLIDER_FENS = {
+	"2r2rk1/pb1qbppp/1p2pn2/3p4/2PP4/1P1BPN2/PB1Q1PPP/2RR2K1 w - - 0 16",
+	"r1b2rk1/2q1bppp/p2ppn2/1p6/3BPP2/2NB1Q2/PPP3PP/R4R1K w - - 0 14",
+	"r4rk1/1bqnbppp/p2ppn2/1p6/3BPP2/P1NB1Q2/1PP3PP/R4R1K b - - 0 13",
+	"2rr2k1/pb2qppp/1p2pb2/8/2P5/1P2PB2/PB1Q1PPP/2RR2K1 b - - 0 19",
+};
+
+const std::vector<std::string> IN_CHECK_FENS = {
+	"rnbqk1nr/pppp1ppp/8/4p3/1b1P4/8/PPP1PPPP/RNBQKBNR w KQkq - 1 3",
+	"r1bqkbnr/pppp1Qpp/2n5/4p3/2B1P3/8/PPPP1PPP/RNB1K1NR b KQkq - 0 4",
+	"8/8/8/8/8/3k4/2n5/r3K3 w - - 0 1",
+	"r3k2r/p1pp1pb1/bn2Qnp1/2qPN3/1p2P3/2N5/PPPBBPPP/R3K2R b KQkq - 3 2",
+};
+
+const std::vector<std::string> ENDGAME_FENS = {
+	"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+	"8/8/4k3/8/2p5/8/B2P4/4K3 w - - 0 1",
+	"8/5pk1/6p1/8/8/6P1/5PK1/3R4 w - - 0 40",
+	"4k3/8/8/8/8/8/8/R3K2R w KQ - 0 1",
+};
+
+//Returns random (square, occupancy) pairs with sparse occupancies, like those seen in real positions
+std::vector<std::pair<Square, Bitboard>> random_occupancies(size_t n) {
+	PRNG rng(1070372);
+	std::vector<std::pair<Square, Bitboard>> v(n);
+	for (auto& x : v) x = { Square(rng.rand<uint64_t>() & 63), rng.rand<uint64_t>() & rng.rand<uint64_t>() };
+	return v;
+}
+
+//Runs generate_legals() on each position until at least <n> calls have been made
+Benchmark generate_benchmark(const std::string& name, const std::vector<std::string>& fens, uint64_t n) {
+	return { name, [fens, n](Counters& c, uint64_t& checksum) {
+		std::vector<Position> positions(fens.begin(), fens.end());
+		uint64_t ops = 0;
+		c.start();
+		while (ops < n) {
+			for (Position& p : positions) {
+				if (p.turn() == WHITE) {
+					MoveList<WHITE> list(p);
+					checksum += list.size();
+				} else {
+					MoveList<BLACK> list(p);
+					checksum += list.size();
+				}
+				ops++;
+			}
+		}
+		c.stop();
+		return ops;
+	} };
+}
+
+//Returns the FENs of positions reached by random moves from the starting position, either midgame positions after
+//20 to 60 plies, or positions where the side to move has no legal moves
+std::vector<std::string> random_game_fens(size_t n, bool terminal) {
+	PRNG rng(19450508);
+	std::vector<std::string> fens;
+	Move list[218];
+	while (fens.size() < n) {
+		Position p(DEFAULT_FEN);
+		const int plies = terminal ? MAX_GAME_PLY - 1 : 20 + int(rng.rand<uint64_t>() % 41);
+		for (int i = 0; i <= plies; i++) {
+			Move* last = p.turn() == WHITE ? p.generate_legals<WHITE>(list) : p.generate_legals<BLACK>(list);
+			if (last == list) {
+				if (terminal) fens.push_back(p.fen());
+				break;
+			}
+			if (i == plies) {
+				if (!terminal) fens.push_back(p.fen());
+				break;
+			}
+
+			const Move m = list[rng.rand<uint64_t>() % (last - list)];
+			if (p.turn() == WHITE) p.play<WHITE>(m);
+			else p.play<BLACK>(m);
+		}
+	}
+	return fens;
+}
+
+//Tests whether the side to move has a legal move on each position until at least <n> tests have been made, either
+//with has_legal_move() or by generating the full move list
+Benchmark has_legal_move_benchmark(const std::string& name, const std::vector<std::string>& fens, bool early_exit,
+	uint64_t n) {
+	return { name, [fens, early_exit, n](Counters& c, uint64_t& checksum) {
+		std::vector<Position> positions(fens.begin(), fens.end());
+		uint64_t ops = 0;
+		c.start();
+		while (ops < n) {
+			for (Position& p : positions) {
+				if (early_exit) checksum += p.turn() == WHITE ? p.has_legal_move<WHITE>() : p.has_legal_move<BLACK>();
+				else if (p.turn() == WHITE) checksum += MoveList<WHITE>(p).size() != 0;
+				else checksum += MoveList<BLACK>(p).size() != 0;
+				ops++;
+			}
+		}
+		c.stop();
+		return ops;
+	} };
+}
+
+//Encodes the positions as network inputs, with the input planes and the legal move masks, until at least <n>
+//positions have been written
+Benchmark encode_benchmark(const std::string& name, const std::vector<std::string>& fens, uint64_t n) {
+	return { name, [fens, n](Counters& c, uint64_t& checksum) {
+		std::vector<Position> positions(fens.begin(), fens.end());
+		std::vector<float> planes(positions.size() * INPUT_PLANES * NSQUARES);
+		std::vector<Bitboard> masks(positions.size() * POLICY_PLANES * NSQUARES);
+		uint64_t ops = 0;
+		c.start();
+		while (ops < n) {
+			write_batch(positions.data(), positions.size(), planes.data(), masks.data());
+			checksum += masks[ops % masks.size()] + (uint64_t) planes[ops % planes.size()];
+			ops += positions.size();
+		}
+		c.stop();
+		return ops;
+	} };
+}
+
+//Computes the danger map of enemy sliders on each position until at least <n> maps have been computed
+Benchmark slider_danger_benchmark(const std::string& name, Bitboard (*f)(Bitboard, Bitboard, Bitboard),
+	const std::vector<std::string>& fens, uint64_t n) {
+	return { name, [f, fens, n](Counters& c, uint64_t& checksum) {
+		std::vector<std::array<Bitboard, 3>> inputs;
+		for (const std::string& fen : fens) {
+			Position p(fen);
+			const Color them = ~p.turn();
+			inputs.push_back({ p.bitboard_of(them, BISHOP) | p.bitboard_of(them, QUEEN),
+				p.bitboard_of(them, ROOK) | p.bitboard_of(them, QUEEN),
+				(p.all_pieces<WHITE>() | p.all_pieces<BLACK>()) ^ p.bitboard_of(p.turn(), KING) });
+		}
+		uint64_t ops = 0;
+		c.start();
+		while (ops < n) {
+			for (const std::array<Bitboard, 3>& in : inputs) checksum += f(in[0], in[1], in[2]);
+			ops += inputs.size();
+		}
+		c.stop();
+		return ops;
+	} };
+}
+
+//Evaluates every position of the tree below a position, in the order a depth-first search visits them, so that
+//neighbouring positions share their pawn structure and material as they do in a search
+template<Color Us>
+void evaluate_tree(Position& p, unsigned int depth, eval::EvalTables* tables, uint64_t& checksum, uint64_t& ops) {
+	checksum += eval::evaluate(p, tables);
+	ops++;
+	if (depth == 0) return;
+	MoveList<Us> list(p);
+	for (Move m : list) {
+		p.play<Us>(m);
+		evaluate_tree<~Us>(p, depth - 1, tables, checksum, ops);
+		p.undo<Us>(m);
+	}
+}
+
+//Evaluates the trees below the positions, with or without the pawn and material tables. The time includes move
+//generation and play/undo, which are the same for both
+Benchmark evaluate_benchmark(const std::string& name, const std::vector<std::string>& fens, unsigned int depth,
+	bool use_tables) {
+	return { name, [fens, depth, use_tables](Counters& c, uint64_t& checksum) {
+		std::vector<Position> positions(fens.begin(), fens.end());
+		std::unique_ptr<eval::EvalTables> tables(new eval::EvalTables());
+		eval::EvalTables* t = use_tables ? tables.get() : nullptr;
+		uint64_t ops = 0;
+		c.start();
+		for (Position& p : positions) {
+			if (p.turn() == WHITE) evaluate_tree<WHITE>(p, depth, t, checksum, ops);
+			else evaluate_tree<BLACK>(p, depth, t, checksum, ops);
+		}
+		c.stop();
+
+		if (use_tables)
+			std::cerr << "Hit rates: pawn table " << tables->pawns.hit_rate() * 100 << "%, material table "
+				<< tables->material.hit_rate() * 100 << "%\n";
+		return ops;
+	} };
+}
+
+//Collects (position, move) pairs for one move type from the trees below the middlegame and opening positions
+template<Color Us>
+void collect_moves(Position& p, unsigned int depth, int flags, std::vector<std::pair<Position, Move>>& out) {
+	MoveList<Us> list(p);
+	for (Move m : list) {
+		//Castling and promotion flags are grouped, so that each group has a useful number of moves. Only a few
+		//positions are kept, so that they stay in cache as they would during a search
+		int group = m.flags() == OOO ? OO : m.is_promotion() ? (m.flags() & ~0b0011) : m.flags();
+		if (Us == WHITE && group == flags && out.size() < 64) out.emplace_back(p, m);
+		if (depth > 1) {
+			p.play<Us>(m);
+			collect_moves<~Us>(p, depth - 1, flags, out);
+			p.undo<Us>(m);
+		}
+	}
+}
+
+//Runs play() followed by undo() for a single move type until at least <n> moves have been played
+Benchmark play_undo_benchmark(const std::string& name, int flags, uint64_t n) {
+	return { name, [flags, n](Counters& c, uint64_t& checksum) {
+		std::vector<std::pair<Position, Move>> moves;
+		for (const std::vector<std::string>* fens : { &MIDDLEGAME_FENS, &OPENING_FENS, &ENDGAME_FENS })
+			for (const std::string& fen : *fens) {
+				Position p(fen);
+				if (p.turn() == WHITE) collect_moves<WHITE>(p, 3, flags, moves);
+				else collect_moves<BLACK>(p, 3, flags, moves);
+			}
+
+		if (moves.empty()) return uint64_t(0);
+
+		uint64_t ops = 0;
+		c.start();
+		while (ops < n) {
+			for (auto& x : moves) {
+				x.first.play<WHITE>(x.second);
+				checksum += x.first.get_hash();
+				x.first.undo<WHITE>(x.second);
+			}
+			ops += moves.size();
+		}
+		c.stop();
+		return ops;
+	} };
+}
+
+//Allocates memory in 4 KB pages, even where transparent huge pages are enabled for all memory
+void* allocate_small_pages(size_t size) {
+#ifdef __linux__
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (p == MAP_FAILED) return nullptr;
+	madvise(p, size, MADV_NOHUGEPAGE);
+	return p;
+#else
+	return malloc(size);
+#endif
+}
+
+void free_small_pages(void* p, size_t size) {
+#ifdef __linux__
+	munmap(p, size);
+#else
+	(void) size;
+	free(p);
+#endif
+}
+
+//Runs perft with the lookup tables copied into 4 KB or 2 MB pages, to show the effect of the page size on dTLB 
+//misses. The tables in use before the benchmark are restored afterwards
+Benchmark perft_benchmark(const std::string& name, bool large_pages) {
+	return { name, [large_pages](Counters& c, uint64_t& checksum) {
+		const Databases& original = databases();
+		void* copy = large_pages ? allocate_large_pages(sizeof(Databases)) : allocate_small_pages(sizeof(Databases));
+		if (!copy) return uint64_t(0);
+		memcpy(copy, &original, sizeof(Databases));
+		use_databases(*(const Databases*) copy);
+
+		Position p(KIWIPETE);
+		uint64_t ops = 0;
+		c.start();
+		for (int i = 0; i < 3; i++) ops += perft<WHITE>(p, 4);
+		c.stop();
+		checksum += ops;
+
+		use_databases(original);
+		if (large_pages) free_large_pages(copy, sizeof(Databases));
+		else free_small_pages(copy, sizeof(Databases));
+		return ops;
+	} };
+}
+
+std::vector<Benchmark> benchmarks() {
+	std::vector<Benchmark> b;
+
+	b.push_back({ "get_rook_attacks", [](Counters& c, uint64_t& checksum) {
+		const auto occs = random_occupancies(1 << 16);
+		uint64_t ops = 0;
+		c.start();
+		for (int i = 0; i < 200; i++, ops += occs.size())
+			for (const auto& x : occs) checksum += get_rook_attacks(x.first, x.second);
+		c.stop();
+		return ops;
+	} });
+
+	b.push_back({ "get_bishop_attacks", [](Counters& c, uint64_t& checksum) {
+		const auto occs = random_occupancies(1 << 16);
+		uint64_t ops = 0;
+		c.start();
+		for (int i = 0; i < 200; i++, ops += occs.size())
+			for (const auto& x : occs) checksum += get_bishop_attacks(x.first, x.second);
+		c.stop();
+		return ops;
+	} });
+
+	b.push_back({ "pop_lsb", [](Counters& c, uint64_t& checksum) {
+		const auto occs = random_occupancies(1 << 16);
+		uint64_t ops = 0;
+		c.start();
+		for (int i = 0; i < 100; i++)
+			for (const auto& x : occs) {
+				Bitboard bb = x.second;
+				while (bb) {
+					checksum += pop_lsb(&bb);
+					ops++;
+				}
+			}
+		c.stop();
+		return ops;
+	} });
+
+	b.push_back(play_undo_benchmark("play_undo_quiet", QUIET, 20000000));
+	b.push_back(play_undo_benchmark("play_undo_double_push", DOUBLE_PUSH, 20000000));
+	b.push_back(play_undo_benchmark("play_undo_castling", OO, 20000000));
+	b.push_back(play_undo_benchmark("play_undo_capture", CAPTURE, 20000000));
+	b.push_back(play_undo_benchmark("play_undo_en_passant", EN_PASSANT, 20000000));
+	b.push_back(play_undo_benchmark("play_undo_promotion", PR_KNIGHT, 20000000));
+	b.push_back(play_undo_benchmark("play_undo_promotion_capture", PC_KNIGHT, 20000000));
+
+	b.push_back(generate_benchmark("generate_legals_opening", OPENING_FENS, 10000000));
+	b.push_back(generate_benchmark("generate_legals_middlegame", MIDDLEGAME_FENS, 10000000));
+	b.push_back(generate_benchmark("generate_legals_in_check", IN_CHECK_FENS, 10000000));
+	b.push_back(generate_benchmark("generate_legals_endgame", ENDGAME_FENS, 10000000));
+	b.push_back(generate_benchmark("generate_legals_sliders", SLIDER_FENS, 10000000));
+
+	//Positions without legal moves are the worst case for has_legal_move(), which has to try every candidate
+	const std::vector<std::string> random_midgame = random_game_fens(256, false);
+	const std::vector<std::string> random_terminal = random_game_fens(256, true);
+	b.push_back(has_legal_move_benchmark("has_legal_move_random_midgame", random_midgame, true, 20000000));
+	b.push_back(has_legal_move_benchmark("move_list_random_midgame", random_midgame, false, 10000000));
+	b.push_back(has_legal_move_benchmark("has_legal_move_no_moves", random_terminal, true, 20000000));
+	b.push_back(has_legal_move_benchmark("move_list_no_moves", random_terminal, false, 10000000));
+
+	//Compare the builds with and without SURGE_AVX2 on generate_legals_sliders for the effect on the generator
+	b.push_back(slider_danger_benchmark("slider_danger_magic", slider_danger_magic, SLIDER_FENS, 50000000));
+#ifdef SURGE_AVX2
+	b.push_back(slider_danger_benchmark("slider_danger_avx2", slider_danger_avx2, SLIDER_FENS, 50000000));
+#endif
+
+	b.push_back(encode_benchmark("encode_middlegame", MIDDLEGAME_FENS, 5000000));
+
+	b.push_back(evaluate_benchmark("evaluate_middlegame_no_tables", MIDDLEGAME_FENS, 3, false));
+	b.push_back(evaluate_benchmark("evaluate_middlegame_tables", MIDDLEGAME_FENS, 3, true));
+	b.push_back(evaluate_benchmark("evaluate_endgame_no_tables", ENDGAME_FENS, 5, false));
+	b.push_back(evaluate_benchmark("evaluate_endgame_tables", ENDGAME_FENS, 5, true));
+
+	b.push_back(perft_benchmark("perft_small_pages", false));
+	b.push_back(perft_benchmark("perft_large_pages", true));
+
+	return b;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	const std::string filter = argc > 1 ? argv[1] : "";
+	std::ofstream file;
+	if (argc > 2) file.open(argv[2]);
+	std::ostream& out = argc > 2 ? file : std::cout;
+
+	Counters counters;
+	if (!counters.available())
+		std::cerr << "Hardware performance counters are not available, only timing benchmarks\n";
+
+	out << "benchmark,operations,ns_per_op";
+	for (size_t i = 0; i < NEVENTS; i++) out << "," << EVENT_STR[i] << "_per_op";
+	out << "\n";
+
+	for (Benchmark& b : benchmarks()) {
+		if (b.name.find(filter) == std::string::npos) continue;
+
+		uint64_t checksum = 0;
+		uint64_t ops = b.run(counters, checksum);
+
+		if (ops == 0) continue;
+
+		out << b.name << "," << ops << "," << counters.nanoseconds() / ops;
+		for (size_t i = 0; i < NEVENTS; i++) {
+			out << ",";
+			if (counters.value(i) >= 0) out << counters.value(i) / ops;
+		}
+		out << std::endl;
+
+		std::cerr << b.name << ": " << counters.nanoseconds() / ops << " ns/op (checksum " << checksum << ")\n";
+	}
+
+	return 0;
+}
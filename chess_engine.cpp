@@ -1,75 +1,748 @@
 #include <iostream>
+#include <iomanip>
+#include <atomic>
 #include <chrono>
-#include "surge.h"
+#include <condition_variable>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "evaluate.h"
 
+//A UCI chess engine. Commands are read on the main thread, which stays responsive while a search runs on worker
+//threads, so that stop, ponderhit and isready are handled at once. The search is an alpha-beta search with
+//iterative deepening, a shared transposition table and lazy SMP: every worker searches the same position and they
+//share results through the table. Workers check the stop flag at every node, so a search stops well within a
+//millisecond of stop.
+//
+//Besides the UCI commands, the engine understands:
+//	perft <depth>    - counts the leaf nodes below the current position, with the count for each move
+//	bench [depth]    - searches a set of positions to a fixed depth and reports the nodes searched and the speed
+//	d                - prints the current position
+//
+//Built with -DSURGE_STATS, perft and bench also print the move generator counters for the command
 
-//Computes the perft of the position for a given depth, using bulk-counting
-//According to the https://www.chessprogramming.org/Perft site:
-//Perft is a debugging function to walk the move generation tree of strictly legal moves to count 
-//all the leaf nodes of a certain depth, which can be compared to predetermined values and used to isolate bugs
-template<Color Us>
-unsigned long long perft(Position& p, unsigned int depth) {
-	//gk int nmoves;
-	unsigned long long nodes = 0;
+typedef std::chrono::steady_clock Clock;
+
+const int MAX_PLY = 128;
+const int INFINITE_SCORE = 32001;
+const int MATE = 32000;
+//Scores above MATE_BOUND are mates, with the distance to mate in plies taken off MATE
+const int MATE_BOUND = MATE - MAX_PLY;
+
+//All output goes through send(), so that lines from the search and the input thread do not interleave
+std::mutex output_mutex;
+
+void send(const std::string& line) {
+	std::lock_guard<std::mutex> lock(output_mutex);
+	std::cout << line << std::endl;
+}
+
+//Built with SURGE_STATS, perft and bench report the move generator counters for the command. These do nothing
+//otherwise
+void reset_stats() {
+#ifdef SURGE_STATS
+	stats::reset();
+#endif
+}
+
+void send_stats() {
+#ifdef SURGE_STATS
+	std::ostringstream os;
+	os << "\n" << stats::merged();
+	std::string text = os.str();
+	if (!text.empty() && text.back() == '\n') text.pop_back();
+	send(text);
+#endif
+}
 
+//Finds the legal move with the given UCI notation, so that it gets the right flags. Returns a null move if there
+//is none
+template<Color Us>
+Move parse_move(Position& p, const std::string& uci) {
 	MoveList<Us> list(p);
+	for (Move m : list)
+		if (uci_move(m) == uci) return m;
+	return Move();
+}
+
+enum Bound : int {
+	NO_BOUND, UPPER_BOUND, LOWER_BOUND, EXACT_BOUND
+};
 
-	if (depth == 1) return (unsigned long long) list.size();
+//A transposition table shared by all search threads without locks. Each entry stores its key XORed with its data,
+//so an entry torn by two threads writing at once does not match any position, and is treated as a miss
+class TranspositionTable {
+	struct Entry {
+		uint64_t key;
+		uint64_t data;
+	};
 
-	for (Move move : list) {
-		p.play<Us>(move);
-		nodes += perft<~Us>(p, depth - 1);
-		p.undo<Us>(move);
+	LargePageArray<Entry> entries;
+	uint8_t age = 0;
+
+public:
+	struct Data {
+		Move move;
+		int score, depth;
+		Bound bound;
+	};
+
+	void resize(size_t mb) {
+		size_t n = 1;
+		while (n * 2 * sizeof(Entry) <= (mb << 20)) n *= 2;
+		entries.resize(n);
 	}
 
-	return nodes;
+	void clear() { entries.clear(); age = 0; }
+	void new_search() { age = (age + 1) & 0x3f; }
+
+	inline void prefetch(uint64_t key) const {
+		__builtin_prefetch(&entries[key & (entries.size() - 1)]);
+	}
+
+	inline bool probe(uint64_t key, Data& d) const {
+		const Entry& e = entries[key & (entries.size() - 1)];
+		const uint64_t data = e.data;
+		if ((e.key ^ data) != key || !data) return false;
+		d.move = Move(uint16_t(data));
+		d.score = int16_t(data >> 16);
+		d.depth = uint8_t(data >> 32);
+		d.bound = Bound((data >> 40) & 3);
+		return true;
+	}
+
+	inline void store(uint64_t key, Move m, int score, int depth, Bound bound) {
+		Entry& e = entries[key & (entries.size() - 1)];
+		const uint64_t old = e.data;
+		const bool same = (e.key ^ old) == key;
+		//Entries of the current search are only replaced by searches at least as deep
+		if (!same && ((old >> 42) & 0x3f) == age && int(uint8_t(old >> 32)) > depth && bound != EXACT_BOUND) return;
+		if (same && m.to_from() == 0) m = Move(uint16_t(old));
+
+		const uint64_t data = uint64_t(m.to_from()) | uint64_t(uint16_t(score)) << 16 |
+			uint64_t(uint8_t(depth)) << 32 | uint64_t(bound) << 40 | uint64_t(age) << 42;
+		e.key = key ^ data;
+		e.data = data;
+	}
+
+	//Returns how full the table is, in permille, from the entries written by the current search
+	int hashfull() const {
+		int used = 0;
+		for (size_t i = 0; i < 1000 && i < entries.size(); i++)
+			used += entries[i].data && ((entries[i].data >> 42) & 0x3f) == age;
+		return used;
+	}
+};
+
+//Mate scores are stored relative to the node rather than the root, so that they stay correct when the position
+//is reached at a different ply
+inline int score_to_tt(int score, int ply) {
+	return score >= MATE_BOUND ? score + ply : score <= -MATE_BOUND ? score - ply : score;
 }
 
-//A variant of perft, listing all moves and for each move, the perft of the decremented depth
-//It is used solely for debugging
-template<Color Us>
-void perftdiv(Position& p, unsigned int depth) {
-	unsigned long long nodes = 0, pf;
+inline int score_from_tt(int score, int ply) {
+	return score >= MATE_BOUND ? score - ply : score <= -MATE_BOUND ? score + ply : score;
+}
 
-	MoveList<Us> list(p);
+std::string score_string(int score) {
+	if (score >= MATE_BOUND) return "mate " + std::to_string((MATE - score + 1) / 2);
+	if (score <= -MATE_BOUND) return "mate " + std::to_string(-(MATE + score) / 2);
+	return "cp " + std::to_string(score);
+}
+
+struct Limits {
+	int64_t time[NCOLORS] = {}, inc[NCOLORS] = {};
+	int movestogo = 0, depth = MAX_PLY - 1;
+	uint64_t nodes = 0;
+	int64_t movetime = 0;
+	bool infinite = false, ponder = false;
+};
+
+//The state of the current search, shared by all workers
+struct SearchState {
+	std::atomic<bool> stop{ false };
+	std::atomic<bool> pondering{ false };
+	bool infinite = false;
+	Limits limits;
+
+	//Times are in milliseconds since start, which is reset by ponderhit
+	std::atomic<int64_t> start{ 0 };
+	int64_t soft_limit = 0, hard_limit = 0;
+
+	//The search waits here after it has finished while pondering or searching infinitely, until stop or ponderhit
+	std::mutex mutex;
+	std::condition_variable finished;
+};
+
+int64_t now_ms() {
+	return std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now().time_since_epoch()).count();
+}
+
+TranspositionTable tt;
+SearchState state;
+int move_overhead = 30;
+
+struct Worker;
+std::vector<std::unique_ptr<Worker>> workers;
+
+uint64_t total_nodes();
+
+//The data of one search thread. Positions are copied into each worker, which also keeps its own evaluation tables
+//and move ordering heuristics
+struct Worker {
+	int id;
+	std::unique_ptr<Position> p;
+	eval::EvalTables tables;
+
+	int history[NSQUARES][NSQUARES];
+	Move killers[MAX_PLY + 1][2];
+	Move pv[MAX_PLY + 1][MAX_PLY + 1];
+	int pv_length[MAX_PLY + 1];
+
+	//Only written by the worker itself, and read by the others to report and limit the nodes searched
+	std::atomic<uint64_t> nodes{ 0 };
+	int seldepth = 0;
+
+	Move best_move, ponder_move;
+	int best_score = 0, completed_depth = 0;
+
+	explicit Worker(int id) : id(id), p(new Position()) { clear(); }
+
+	void clear() {
+		memset(history, 0, sizeof(history));
+		memset(killers, 0, sizeof(killers));
+	}
+
+	inline void count_node() {
+		nodes.store(nodes.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		//The main worker checks the clock and node limit every 1024 nodes
+		if (id == 0 && (nodes.load(std::memory_order_relaxed) & 1023) == 0) check_limits();
+	}
+
+	void check_limits() {
+		if (state.pondering || state.infinite) return;
+		if ((state.hard_limit && now_ms() - state.start >= state.hard_limit) ||
+			(state.limits.nodes && total_nodes() >= state.limits.nodes))
+			state.stop = true;
+	}
+
+	inline void update_pv(int ply, Move m) {
+		pv[ply][ply] = m;
+		for (int i = ply + 1; i < pv_length[ply + 1]; i++) pv[ply][i] = pv[ply + 1][i];
+		pv_length[ply] = std::max(pv_length[ply + 1], ply + 1);
+	}
+
+	template<Color Us>
+	int quiescence(int alpha, int beta, int ply) {
+		count_node();
+		pv_length[ply] = ply;
+		seldepth = std::max(seldepth, ply);
+		if (state.stop.load(std::memory_order_relaxed)) return 0;
+
+		ScoredMoveList<Us> list(*p);
+		const bool in_check = p->checkers != 0;
+		if (list.size() == 0) return in_check ? -MATE + ply : 0;
+		if (ply >= MAX_PLY) return eval::evaluate(*p, &tables);
+
+		//Unless in check, the side to move can stand pat instead of capturing
+		int best = -INFINITE_SCORE;
+		if (!in_check) {
+			best = eval::evaluate(*p, &tables);
+			if (best >= beta) return best;
+			alpha = std::max(alpha, best);
+		}
+
+		list.score_mvv_lva(*p);
+		for (Move m : list) {
+			//Captures and promotions are ordered before quiet moves, so the rest can be skipped
+			if (!in_check && !m.is_capture() && !m.is_promotion()) break;
+			if (!in_check && m.is_promotion() && m.promotion_type() != QUEEN) continue;
+
+			p->play<Us>(m);
+			const int score = -quiescence<~Us>(-beta, -alpha, ply + 1);
+			p->undo<Us>(m);
+			if (state.stop.load(std::memory_order_relaxed)) return 0;
+
+			if (score > best) {
+				best = score;
+				if (score > alpha) {
+					alpha = score;
+					update_pv(ply, m);
+					if (alpha >= beta) break;
+				}
+			}
+		}
+		return best;
+	}
+
+	template<Color Us>
+	int search(int alpha, int beta, int depth, int ply, bool pv_node) {
+		if (depth <= 0) return quiescence<Us>(alpha, beta, ply);
+
+		count_node();
+		pv_length[ply] = ply;
+		seldepth = std::max(seldepth, ply);
+		if (state.stop.load(std::memory_order_relaxed)) return 0;
+
+		if (ply > 0) {
+			if (p->is_fifty_move_draw() || p->is_repetition()) return 0;
+
+			//A move which repeats an earlier position is available, so the side to move can at least draw
+			if (alpha < 0 && p->has_game_cycle(ply)) {
+				alpha = 0;
+				if (alpha >= beta) return alpha;
+			}
 
-	for (Move move : list) {
-		std::cout << move;
+			//Mate distance pruning
+			alpha = std::max(alpha, -MATE + ply);
+			beta = std::min(beta, MATE - ply - 1);
+			if (alpha >= beta) return alpha;
+		}
 
-		p.play<Us>(move);
-		pf = perft<~Us>(p, depth - 1);
-		std::cout << ": " << pf << " moves\n";
-		nodes += pf;
-		p.undo<Us>(move);
+		const uint64_t key = p->get_hash();
+		TranspositionTable::Data entry;
+		Move tt_move;
+		if (tt.probe(key, entry)) {
+			tt_move = entry.move;
+			const int score = score_from_tt(entry.score, ply);
+			if (!pv_node && entry.depth >= depth && (entry.bound == EXACT_BOUND ||
+				(entry.bound == LOWER_BOUND && score >= beta) || (entry.bound == UPPER_BOUND && score <= alpha)))
+				return score;
+		}
+
+		ScoredMoveList<Us> list(*p);
+		const bool in_check = p->checkers != 0;
+		if (list.size() == 0) return in_check ? -MATE + ply : 0;
+		if (ply >= MAX_PLY) return eval::evaluate(*p, &tables);
+
+		//Checks are searched one ply deeper, so that forced sequences of checks are seen to the end
+		if (in_check) depth++;
+
+		//Reverse futility pruning: close to the leaves, a position far above beta will fail high anyway
+		if (!pv_node && !in_check && depth <= 3 && std::abs(beta) < MATE_BOUND) {
+			const int static_eval = eval::evaluate(*p, &tables);
+			if (static_eval - 120 * depth >= beta) return static_eval;
+		}
+
+		list.score_mvv_lva(*p);
+		list.score_history(history);
+		const Move killer0 = killers[ply][0], killer1 = killers[ply][1];
+		list.score([&](Move m) {
+			return m == tt_move ? 1 << 30 : m.is_capture() ? 0 : m == killer0 ? PROMOTION_SCORE / 2 :
+				m == killer1 ? PROMOTION_SCORE / 4 : 0;
+		});
+
+		int best = -INFINITE_SCORE, i = 0;
+		Move best_move;
+		const int original_alpha = alpha;
+
+		for (Move m : list) {
+			tt.prefetch(p->hash_after(m));
+			p->play<Us>(m);
+
+			int score;
+			if (i == 0) {
+				score = -search<~Us>(-beta, -alpha, depth - 1, ply + 1, pv_node);
+			} else {
+				//Late quiet moves are searched with a reduced depth first, and searched again if they turn out
+				//to be better than expected
+				const bool quiet = !m.is_capture() && !m.is_promotion();
+				const int reduction = depth >= 3 && i >= 3 && quiet && !in_check ? 1 + (i >= 8) + (depth >= 8) : 0;
+				score = -search<~Us>(-alpha - 1, -alpha, depth - 1 - reduction, ply + 1, false);
+				if (score > alpha && reduction)
+					score = -search<~Us>(-alpha - 1, -alpha, depth - 1, ply + 1, false);
+				if (score > alpha && score < beta)
+					score = -search<~Us>(-beta, -alpha, depth - 1, ply + 1, true);
+			}
+
+			p->undo<Us>(m);
+			if (state.stop.load(std::memory_order_relaxed)) return 0;
+			i++;
+
+			if (score > best) {
+				best = score;
+				best_move = m;
+				if (score > alpha) {
+					alpha = score;
+					update_pv(ply, m);
+					if (alpha >= beta) {
+						if (!m.is_capture()) {
+							if (m != killers[ply][0]) {
+								killers[ply][1] = killers[ply][0];
+								killers[ply][0] = m;
+							}
+							//History scores stay below the killer scores
+							int& h = history[m.from()][m.to()];
+							h = std::min(h + depth * depth, PROMOTION_SCORE / 8);
+						}
+						break;
+					}
+				}
+			}
+		}
+
+		tt.store(key, best_move, score_to_tt(best, ply), depth,
+			best >= beta ? LOWER_BOUND : alpha > original_alpha ? EXACT_BOUND : UPPER_BOUND);
+		return best;
+	}
+
+	//Runs iterative deepening until the depth limit is reached or the search is stopped. Only the main worker
+	//reports and decides when to stop
+	template<Color Us>
+	void iterative_deepening() {
+		for (int depth = 1 + (id & 1); depth <= state.limits.depth; depth++) {
+			seldepth = 0;
+			const int score = search<Us>(-INFINITE_SCORE, INFINITE_SCORE, depth, 0, true);
+
+			//A move that was searched completely before the search stopped is still the best one so far
+			if (pv_length[0] > 0) {
+				best_move = pv[0][0];
+				ponder_move = pv_length[0] > 1 ? pv[0][1] : Move();
+				if (!state.stop) best_score = score;
+			}
+			if (state.stop) break;
+			completed_depth = depth;
+			if (id == 0) report(depth);
+
+			//A mate shorter than the depth searched cannot be improved on by searching deeper
+			if (std::abs(score) >= MATE_BOUND && MATE - std::abs(score) < depth) break;
+			if (id != 0) continue;
+
+			//Another iteration takes longer than all the previous ones together, so it is not started unless it is
+			//likely to finish
+			if (!state.pondering && !state.infinite && state.soft_limit &&
+				now_ms() - state.start >= state.soft_limit / 2)
+				break;
+		}
 	}
 
-	std::cout << "\nTotal: " << nodes << " moves\n";
+	void report(int depth) {
+		const int64_t elapsed = std::max<int64_t>(now_ms() - state.start, 1);
+		const uint64_t n = total_nodes();
+		std::ostringstream ss;
+		ss << "info depth " << depth << " seldepth " << seldepth << " score " << score_string(best_score)
+			<< " nodes " << n << " nps " << n * 1000 / elapsed << " hashfull " << tt.hashfull()
+			<< " time " << elapsed << " pv";
+		for (int i = 0; i < pv_length[0]; i++) ss << " " << uci_move(pv[0][i]);
+		send(ss.str());
+	}
+
+	void think() {
+		nodes = 0;
+		best_move = Move();
+		ponder_move = Move();
+		best_score = completed_depth = 0;
+		if (p->turn() == WHITE) iterative_deepening<WHITE>();
+		else iterative_deepening<BLACK>();
+	}
+};
+
+uint64_t total_nodes() {
+	uint64_t n = 0;
+	for (const std::unique_ptr<Worker>& w : workers) n += w->nodes.load(std::memory_order_relaxed);
+	return n;
 }
 
-void test_perft() {
-	Position p("rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq -");
-	std::cout << p;
-
-	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
-	auto n = perft<WHITE>(p, 6);
-	std::chrono::steady_clock::time_point end = std::chrono::steady_clock::now();
-	auto diff = end - begin;
-
-	std::cout << "Nodes: " << n << "\n";
-	std::cout << "NPS: "
-		<< int(n * 1000000.0 / std::chrono::duration_cast<std::chrono::microseconds>(diff).count())
-		<< "\n";
-	std::cout << "Time difference = "
-		<< std::chrono::duration_cast<std::chrono::microseconds>(diff).count() << " [microseconds]\n";
+//Sets the time limits for a search. The soft limit is the time the search aims to use, and the hard limit is
+//the time at which it is stopped, even in the middle of an iteration
+void allocate_time(const Limits& limits, Color us) {
+	state.soft_limit = state.hard_limit = 0;
+	if (limits.movetime) {
+		//A fixed time per move is used in full, so there is only a hard limit
+		state.hard_limit = std::max<int64_t>(limits.movetime - move_overhead, 1);
+	} else if (limits.time[us]) {
+		const int64_t left = std::max<int64_t>(limits.time[us] - move_overhead, 1);
+		const int moves = limits.movestogo ? std::min(limits.movestogo, 40) : 30;
+		state.soft_limit = left / moves + limits.inc[us] * 3 / 4;
+		state.hard_limit = std::min(left / 2, state.soft_limit * 4);
+		state.soft_limit = std::max<int64_t>(std::min(state.soft_limit, state.hard_limit), 1);
+		state.hard_limit = std::max<int64_t>(state.hard_limit, 1);
+	}
 }
 
+//Runs a search on all workers and sends the best move. This runs on its own thread, and the helpers on theirs
+void run_search(const Position& root) {
+	for (std::unique_ptr<Worker>& w : workers) *w->p = root;
+
+	std::vector<std::thread> helpers;
+	for (size_t i = 1; i < workers.size(); i++) helpers.emplace_back(&Worker::think, workers[i].get());
+	workers[0]->think();
+
+	//bestmove may not be sent while pondering or searching infinitely until the GUI says so
+	{
+		std::unique_lock<std::mutex> lock(state.mutex);
+		state.finished.wait(lock, [] { return state.stop || (!state.pondering && !state.infinite); });
+	}
+	state.stop = true;
+	for (std::thread& t : helpers) t.join();
+
+	Worker& main = *workers[0];
+	Move best = main.best_move;
+	//If the search stopped before depth 1 finished, any legal move is better than none
+	if (best.to_from() == 0) {
+		Position& p = *main.p;
+		Move list[218];
+		Move* last = p.turn() == WHITE ? p.generate_legals<WHITE>(list) : p.generate_legals<BLACK>(list);
+		if (last != list) best = list[0];
+	}
+
+	std::string line = "bestmove " + uci_move(best);
+	if (main.ponder_move.to_from() != 0) line += " ponder " + uci_move(main.ponder_move);
+	send(line);
+}
+
+class Engine {
+	std::unique_ptr<Position> root;
+	std::thread search_thread;
+	int threads = 1;
+
+public:
+	Engine() : root(new Position(DEFAULT_FEN)) {
+		tt.resize(16);
+		set_threads(1);
+	}
+
+	~Engine() { stop(); }
+
+	void set_threads(int n) {
+		stop();
+		threads = std::max(1, std::min(n, 256));
+		workers.clear();
+		for (int i = 0; i < threads; i++) workers.emplace_back(new Worker(i));
+	}
+
+	void stop() {
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.stop = true;
+		}
+		state.finished.notify_all();
+		if (search_thread.joinable()) search_thread.join();
+	}
+
+	void ponderhit() {
+		{
+			std::lock_guard<std::mutex> lock(state.mutex);
+			state.start = now_ms();
+			state.pondering = false;
+		}
+		state.finished.notify_all();
+	}
+
+	void new_game() {
+		stop();
+		tt.clear();
+		for (std::unique_ptr<Worker>& w : workers) w->clear();
+	}
+
+	void set_position(std::istringstream& is) {
+		std::string token, fen;
+		is >> token;
+		if (token == "startpos") {
+			fen = DEFAULT_FEN;
+			is >> token;
+		} else if (token == "fen") {
+			while (is >> token && token != "moves") fen += token + " ";
+		} else {
+			return;
+		}
+
+		stop();
+		root.reset(new Position(fen));
+		while (is >> token) {
+			Move m = root->turn() == WHITE ? parse_move<WHITE>(*root, token) : parse_move<BLACK>(*root, token);
+			if (m.to_from() == 0) {
+				send("info string illegal move " + token);
+				break;
+			}
+			if (root->turn() == WHITE) root->play<WHITE>(m);
+			else root->play<BLACK>(m);
+
+			//The search needs MAX_PLY plies of history. Very long games start over from the current position, at
+			//the cost of forgetting earlier positions for repetitions
+			if (root->ply() >= MAX_GAME_PLY - MAX_PLY - 2) root.reset(new Position(root->fen()));
+		}
+	}
+
+	void go(std::istringstream& is) {
+		Limits limits;
+		std::string token;
+		while (is >> token) {
+			if (token == "wtime") is >> limits.time[WHITE];
+			else if (token == "btime") is >> limits.time[BLACK];
+			else if (token == "winc") is >> limits.inc[WHITE];
+			else if (token == "binc") is >> limits.inc[BLACK];
+			else if (token == "movestogo") is >> limits.movestogo;
+			else if (token == "depth") is >> limits.depth;
+			else if (token == "nodes") is >> limits.nodes;
+			else if (token == "movetime") is >> limits.movetime;
+			else if (token == "infinite") limits.infinite = true;
+			else if (token == "ponder") limits.ponder = true;
+		}
+		limits.depth = std::max(1, std::min(limits.depth, MAX_PLY - 1));
+
+		stop();
+		state.stop = false;
+		state.pondering = limits.ponder;
+		state.infinite = limits.infinite;
+		state.limits = limits;
+		state.start = now_ms();
+		allocate_time(limits, root->turn());
+		tt.new_search();
+		for (std::unique_ptr<Worker>& w : workers)
+			for (auto& row : w->history)
+				for (int& h : row) h /= 2;
+
+		search_thread = std::thread(run_search, std::cref(*root));
+	}
+
+	void perft(int depth) {
+		stop();
+		reset_stats();
+		Position& p = *root;
+		const auto begin = Clock::now();
+		unsigned long long total = 0;
+
+		Move list[218];
+		Move* last = p.turn() == WHITE ? p.generate_legals<WHITE>(list) : p.generate_legals<BLACK>(list);
+		for (Move* m = list; m != last && depth > 0; m++) {
+			unsigned long long n = 1;
+			if (p.turn() == WHITE) {
+				p.play<WHITE>(*m);
+				if (depth > 1) n = ::perft<BLACK>(p, depth - 1);
+				p.undo<WHITE>(*m);
+			} else {
+				p.play<BLACK>(*m);
+				if (depth > 1) n = ::perft<WHITE>(p, depth - 1);
+				p.undo<BLACK>(*m);
+			}
+			send(uci_move(*m) + ": " + std::to_string(n));
+			total += n;
+		}
+
+		const double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+		send("\nNodes: " + std::to_string(total) + "\nTime: " + std::to_string(int64_t(seconds * 1000)) +
+			" ms\nNPS: " + std::to_string(uint64_t(total / std::max(seconds, 1e-9))));
+		send_stats();
+	}
+
+	//Searches each position to a fixed depth on one thread with cleared tables, so that the node count identifies
+	//the search and the speed can be compared between builds
+	void bench(int depth) {
+		static const char* BENCH_FENS[] = {
+			DEFAULT_FEN.c_str(),
+			KIWIPETE.c_str(),
+			"r4rk1/1pp1qppp/p1np1n2/2b1p1B1/2B1P1b1/P1NP1N2/1PP1QPPP/R4RK1 w - - 0 10",
+			"r1bq1rk1/pp2bppp/2n1pn2/3p4/2PP4/2N1PN2/PP3PPP/R2QKB1R w KQ - 0 8",
+			"2r2rk1/pb1qbppp/1p2pn2/3p4/2PP4/1P1BPN2/PB1Q1PPP/2RR2K1 w - - 0 16",
+			"8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1",
+			"8/5pk1/6p1/8/8/6P1/5PK1/3R4 w - - 0 40",
+			"4k3/8/8/8/8/8/8/R3K2R w KQ - 0 1",
+		};
+
+		const int saved_threads = threads;
+		set_threads(1);
+		reset_stats();
+		uint64_t nodes = 0;
+		const auto begin = Clock::now();
+		for (const char* fen : BENCH_FENS) {
+			new_game();
+			std::unique_ptr<Position> p(new Position(fen));
+			Limits limits;
+			limits.depth = depth;
+			state.stop = false;
+			state.pondering = false;
+			state.infinite = false;
+			state.limits = limits;
+			state.start = now_ms();
+			allocate_time(limits, p->turn());
+			run_search(*p);
+			nodes += workers[0]->nodes;
+		}
+		const double seconds = std::chrono::duration<double>(Clock::now() - begin).count();
+		send("\nNodes: " + std::to_string(nodes) + "\nTime: " + std::to_string(int64_t(seconds * 1000)) +
+			" ms\nNPS: " + std::to_string(uint64_t(nodes / std::max(seconds, 1e-9))));
+		send_stats();
+		set_threads(saved_threads);
+	}
+
+	void set_option(std::istringstream& is) {
+		std::string token, name, value;
+		is >> token;
+		while (is >> token && token != "value") name += (name.empty() ? "" : " ") + token;
+		while (is >> token) value += (value.empty() ? "" : " ") + token;
+
+		if (name == "Hash") {
+			stop();
+			tt.resize(std::max(1, std::min(std::stoi(value), 65536)));
+		} else if (name == "Threads") {
+			set_threads(std::stoi(value));
+		} else if (name == "Move Overhead") {
+			move_overhead = std::max(0, std::stoi(value));
+		} else if (name == "Clear Hash") {
+			new_game();
+		}
+	}
+
+	void loop() {
+		std::string line, token;
+		while (std::getline(std::cin, line)) {
+			std::istringstream is(line);
+			token.clear();
+			is >> token;
+
+			if (token == "uci") {
+				send("id name surge\nid author the surge authors\n"
+					"option name Hash type spin default 16 min 1 max 65536\n"
+					"option name Threads type spin default 1 min 1 max 256\n"
+					"option name Move Overhead type spin default 30 min 0 max 5000\n"
+					"option name Ponder type check default false\n"
+					"option name Clear Hash type button\n"
+					"uciok");
+			} else if (token == "isready") {
+				send("readyok");
+			} else if (token == "ucinewgame") {
+				new_game();
+			} else if (token == "setoption") {
+				set_option(is);
+			} else if (token == "position") {
+				set_position(is);
+			} else if (token == "go") {
+				go(is);
+			} else if (token == "stop") {
+				stop();
+			} else if (token == "ponderhit") {
+				ponderhit();
+			} else if (token == "quit") {
+				break;
+			} else if (token == "perft") {
+				int depth = 1;
+				is >> depth;
+				perft(depth);
+			} else if (token == "bench") {
+				int depth = 10;
+				is >> depth;
+				bench(depth);
+			} else if (token == "d") {
+				std::ostringstream ss;
+				ss << *root << "\nFen: " << root->fen();
+				send(ss.str());
+			} else if (!token.empty()) {
+				send("info string unknown command " + token);
+			}
+		}
+		stop();
+	}
+};
+
 int main() {
 	//Make sure to initialise all databases before using the library!
 	initialise_all_databases();
 	zobrist::initialise_zobrist_keys();
 
-	//gk call test_perft()
-	test_perft();
-	
+	std::unique_ptr<Engine> engine(new Engine());
+	engine->loop();
 	return 0;
 }
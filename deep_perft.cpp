@@ -0,0 +1,312 @@
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <signal.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include "surge.h"
+
+//Deep perft splits perft(depth) into work units, one for each line of <split> moves from the root, and
+//records the count of every finished unit in a checkpoint file. A run that is killed can be restarted and
+//only loses the units that were in progress.
+//
+//All state lives in a job directory:
+//	job         - the FEN, depth, split depth and number of units. Written once, and checked on resume
+//	checkpoint  - one line "<unit> <nodes>" per finished unit, appended with a single write()
+//	claims/<n>  - created with O_EXCL by the worker that takes unit n, containing "<host> <pid>"
+//
+//Workers pull units by claiming them, so any number of worker processes can share a job, including
+//processes on other machines that mount the same directory.
+//
+//Usage:
+//	deep_perft <dir> <depth> <split depth> [workers] [fen]   Starts or resumes a job with local workers
+//	deep_perft --worker <dir>                                 Works on an existing job
+//	deep_perft --status <dir>                                 Prints the progress of a job
+
+struct Job {
+	std::string fen;
+	unsigned int depth;
+	unsigned int split;
+	size_t units;
+};
+
+//Plays a move for whichever side is to move
+void play_move(Position& p, Move m) {
+	if (p.turn() == WHITE) p.play<WHITE>(m);
+	else p.play<BLACK>(m);
+}
+
+//Appends every line of <depth> moves from the position to <units>, in move generation order. Lines that
+//end in mate or stalemate before <depth> contribute no leaf nodes, so they are not work units
+template<Color Us>
+void enumerate_units(Position& p, unsigned int depth, std::vector<Move>& line, std::vector<Move>& units) {
+	if (depth == 0) {
+		units.insert(units.end(), line.begin(), line.end());
+		return;
+	}
+
+	MoveList<Us> list(p);
+	for (Move move : list) {
+		line.push_back(move);
+		p.play<Us>(move);
+		enumerate_units<~Us>(p, depth - 1, line, units);
+		p.undo<Us>(move);
+		line.pop_back();
+	}
+}
+
+//Returns the moves of all work units, <split> moves per unit
+std::vector<Move> enumerate_units(const Job& job) {
+	Position p(job.fen);
+	std::vector<Move> line, units;
+
+	if (p.turn() == WHITE) enumerate_units<WHITE>(p, job.split, line, units);
+	else enumerate_units<BLACK>(p, job.split, line, units);
+	return units;
+}
+
+//Computes the number of leaf nodes below a work unit
+unsigned long long run_unit(const Job& job, const Move* moves) {
+	Position p(job.fen);
+	for (unsigned int i = 0; i < job.split; i++) play_move(p, moves[i]);
+
+	unsigned int depth = job.depth - job.split;
+	if (depth == 0) return 1;
+	return p.turn() == WHITE ? perft<WHITE>(p, depth) : perft<BLACK>(p, depth);
+}
+
+std::string hostname() {
+	char name[256] = {};
+	gethostname(name, sizeof(name) - 1);
+	return name;
+}
+
+//Reads the checkpoint file. Returns the node count of each finished unit, or -1 for units that are not finished.
+//A line that was only partially written when a worker died is ignored, so its unit is run again
+std::vector<long long> read_checkpoint(const std::string& dir, size_t units) {
+	std::vector<long long> done(units, -1);
+	std::ifstream in(dir + "/checkpoint");
+	std::string line;
+
+	while (std::getline(in, line)) {
+		std::istringstream ss(line);
+		size_t unit;
+		long long nodes;
+		std::string rest;
+		if (ss >> unit >> nodes && !(ss >> rest) && unit < units && in.good()) done[unit] = nodes;
+	}
+	return done;
+}
+
+bool read_job(const std::string& dir, Job& job) {
+	std::ifstream in(dir + "/job");
+	return std::getline(in, job.fen) && in >> job.depth >> job.split >> job.units;
+}
+
+//Creates the job file, or checks that an existing job matches the parameters. The file is written under a
+//temporary name and renamed, so a reader never sees a partially written job
+bool create_job(const std::string& dir, Job& job) {
+	Job existing;
+	if (read_job(dir, existing)) {
+		if (existing.fen != job.fen || existing.depth != job.depth || existing.split != job.split) {
+			std::cerr << "The job in " << dir << " is for a different position or depth:\n"
+				<< existing.fen << "\ndepth " << existing.depth << " split " << existing.split << "\n";
+			return false;
+		}
+		job.units = existing.units;
+		return true;
+	}
+
+	mkdir(dir.c_str(), 0755);
+	mkdir((dir + "/claims").c_str(), 0755);
+
+	job.units = enumerate_units(job).size() / job.split;
+
+	std::string tmp = dir + "/job." + hostname() + "." + std::to_string(getpid());
+	{
+		std::ofstream out(tmp);
+		out << job.fen << "\n" << job.depth << "\n" << job.split << "\n" << job.units << "\n";
+		if (!out) return false;
+	}
+	return rename(tmp.c_str(), (dir + "/job").c_str()) == 0;
+}
+
+//Removes claims on unfinished units that were made by processes on this host which no longer exist, so that the
+//units are run again. Files that are not claims are ignored. Returns the number of claims removed
+int release_stale_claims(const std::string& dir, const std::vector<long long>& done) {
+	const std::string host = hostname();
+	DIR* d = opendir((dir + "/claims").c_str());
+	if (!d) return 0;
+
+	int released = 0;
+	while (dirent* e = readdir(d)) {
+		const std::string name = e->d_name;
+		if (name.empty() || name.size() > 18 || name.find_first_not_of("0123456789") != std::string::npos) continue;
+		size_t unit = std::stoul(name);
+		if (unit < done.size() && done[unit] >= 0) continue;
+
+		std::string path = dir + "/claims/" + e->d_name;
+		std::ifstream in(path);
+		std::string claim_host;
+		pid_t pid = 0;
+		in >> claim_host >> pid;
+		if (claim_host == host && kill(pid, 0) == -1 && errno == ESRCH && unlink(path.c_str()) == 0) released++;
+	}
+	closedir(d);
+	return released;
+}
+
+//Runs unclaimed units until there are none left
+void worker(const std::string& dir) {
+	Job job;
+	if (!read_job(dir, job)) {
+		std::cerr << "No job in " << dir << "\n";
+		return;
+	}
+
+	const std::vector<Move> units = enumerate_units(job);
+	const std::vector<long long> done = read_checkpoint(dir, job.units);
+	const std::string claim = hostname() + " " + std::to_string(getpid()) + "\n";
+
+	for (size_t unit = 0; unit < job.units; unit++) {
+		if (done[unit] >= 0) continue;
+
+		//Claims are never removed once a unit is finished, so a unit that another worker has claimed
+		//is either in progress or done
+		std::string path = dir + "/claims/" + std::to_string(unit);
+		int fd = open(path.c_str(), O_WRONLY | O_CREAT | O_EXCL, 0644);
+		if (fd < 0) continue;
+		if (write(fd, claim.data(), claim.size()) < 0) {}
+		close(fd);
+
+		unsigned long long nodes = run_unit(job, &units[unit * job.split]);
+
+		//A single write to a file opened with O_APPEND cannot interleave with the writes of other workers
+		std::string line = std::to_string(unit) + " " + std::to_string(nodes) + "\n";
+		fd = open((dir + "/checkpoint").c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd < 0 || write(fd, line.data(), line.size()) != (ssize_t) line.size()) {
+			std::cerr << "Failed to write checkpoint: " << strerror(errno) << "\n";
+			exit(1);
+		}
+		fsync(fd);
+		close(fd);
+	}
+}
+
+//Prints the progress of the job. Returns true if every unit is finished
+bool print_status(const std::string& dir, const Job& job, double seconds, unsigned long long resumed_nodes) {
+	const std::vector<long long> done = read_checkpoint(dir, job.units);
+	size_t finished = 0;
+	unsigned long long nodes = 0;
+
+	for (long long n : done)
+		if (n >= 0) {
+			finished++;
+			nodes += n;
+		}
+
+	std::cout << "Units: " << finished << "/" << job.units << "  Nodes: " << nodes;
+	if (seconds > 0)
+		std::cout << "  NPS: " << (unsigned long long) ((nodes - resumed_nodes) / seconds);
+	std::cout << std::endl;
+
+	if (finished == job.units) {
+		std::cout << "\nperft(" << job.depth << ") = " << nodes << "\n";
+		return true;
+	}
+	return false;
+}
+
+//Forks local worker processes. Returns the number started
+int start_workers(const std::string& dir, int workers) {
+	for (int i = 0; i < workers; i++) {
+		if (fork() == 0) {
+			worker(dir);
+			_exit(0);
+		}
+	}
+	return workers;
+}
+
+//Returns true if every unit is finished
+bool finished(const std::string& dir, const Job& job) {
+	for (long long n : read_checkpoint(dir, job.units))
+		if (n < 0) return false;
+	return true;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	if (argc == 3 && std::string(argv[1]) == "--worker") {
+		worker(argv[2]);
+		return 0;
+	}
+
+	if (argc == 3 && std::string(argv[1]) == "--status") {
+		Job job;
+		if (!read_job(argv[2], job)) return 1;
+		print_status(argv[2], job, 0, 0);
+		return 0;
+	}
+
+	if (argc < 4) {
+		std::cerr << "Usage: deep_perft <dir> <depth> <split depth> [workers] [fen]\n"
+			<< "       deep_perft --worker <dir>\n"
+			<< "       deep_perft --status <dir>\n";
+		return 1;
+	}
+
+	const std::string dir = argv[1];
+	Job job;
+	job.depth = std::stoi(argv[2]);
+	job.split = std::stoi(argv[3]);
+	const int workers = argc > 4 ? std::stoi(argv[4]) : int(std::thread::hardware_concurrency());
+	job.fen = argc > 5 ? argv[5] : DEFAULT_FEN;
+
+	if (job.split == 0 || job.split > job.depth) {
+		std::cerr << "The split depth must be between 1 and the depth\n";
+		return 1;
+	}
+
+	if (!create_job(dir, job)) return 1;
+
+	std::vector<long long> done = read_checkpoint(dir, job.units);
+	release_stale_claims(dir, done);
+
+	unsigned long long resumed_nodes = 0;
+	for (long long n : done) if (n >= 0) resumed_nodes += n;
+
+	std::chrono::steady_clock::time_point begin = std::chrono::steady_clock::now();
+	int running = start_workers(dir, std::max(workers, 1));
+
+	//Report progress until every unit is finished. Units claimed by workers on other machines may still be
+	//running after our own workers have exited. Units left behind by our own workers which died are released
+	//and run by new workers
+	for (int tick = 1; ; tick++) {
+		std::this_thread::sleep_for(std::chrono::seconds(1));
+		while (running && waitpid(-1, nullptr, WNOHANG) > 0) running--;
+
+		bool complete = !running && finished(dir, job);
+		if (!running && !complete && release_stale_claims(dir, read_checkpoint(dir, job.units)) > 0)
+			running = start_workers(dir, std::max(workers, 1));
+		if (complete || tick % 10 == 0) {
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			if (print_status(dir, job, seconds, resumed_nodes)) break;
+			if (!running && tick % 60 == 0) std::cout << "Waiting for units claimed by other workers\n";
+		}
+	}
+
+	while (waitpid(-1, nullptr, 0) > 0) {}
+	return 0;
+}
@@ -0,0 +1,294 @@
+#pragma once
+
+#include <cstdlib>
+#include "surge.h"
+
+//A small hand-written evaluation for search: material, piece-square terms and pawn structure, tapered between the
+//middlegame and the endgame by the non-pawn material left on the board. Scores are in centipawns.
+//
+//Pawn structure only depends on the pawns, which rarely change between neighbouring positions of a search, so its
+//terms are cached in a PawnTable keyed by Position::get_pawn_hash(). Likewise, everything that only depends on the
+//material (the game phase, scale factors for drawish material and specialised endgame evaluators) is cached in a
+//MaterialTable keyed by Position::get_material_hash(). Each search thread keeps its own tables, so entries are
+//read and written without synchronisation.
+namespace eval {
+
+//A pair of middlegame and endgame values
+struct Score {
+	int mg, eg;
+
+	constexpr Score(int mg = 0, int eg = 0) : mg(mg), eg(eg) {}
+	constexpr Score operator+(Score s) const { return Score(mg + s.mg, eg + s.eg); }
+	constexpr Score operator-(Score s) const { return Score(mg - s.mg, eg - s.eg); }
+	constexpr Score operator-() const { return Score(-mg, -eg); }
+	constexpr Score operator*(int n) const { return Score(mg * n, eg * n); }
+	inline Score& operator+=(Score s) { mg += s.mg; eg += s.eg; return *this; }
+	inline Score& operator-=(Score s) { mg -= s.mg; eg -= s.eg; return *this; }
+};
+
+const Score PIECE_VALUES[NPIECE_TYPES] = {
+	Score(82, 94), Score(337, 281), Score(365, 297), Score(477, 512), Score(1025, 936), Score(0, 0)
+};
+
+//The weight of each piece type in the game phase. A position with all pieces on the board has MAX_PHASE
+const int PHASE_WEIGHTS[NPIECE_TYPES] = { 0, 1, 1, 2, 4, 0 };
+const int MAX_PHASE = 24;
+
+const Score DOUBLED_PAWN(-10, -25);
+const Score ISOLATED_PAWN(-8, -15);
+const Score CONNECTED_PAWN(6, 8);
+const Score PASSED_PAWN[8] = {
+	Score(0, 0), Score(5, 10), Score(8, 15), Score(15, 30), Score(30, 55), Score(50, 95), Score(80, 145), Score(0, 0)
+};
+//A passed pawn whose square in front is empty
+const Score FREE_PASSED_PAWN(0, 12);
+
+//Piece-square values from White's point of view, including the value of the piece. Black's are mirrored and
+//negated, so that a position is scored by adding the values of all pieces
+struct PieceSquareTable {
+	Score values[NPIECES][NSQUARES];
+
+	PieceSquareTable() {
+		for (int pt = PAWN; pt <= KING; pt++)
+			for (size_t s = 0; s < NSQUARES; s++) {
+				//The distance of the square from the centre of the board, from 0 to 3
+				const int file = file_of(Square(s)), rank = rank_of(Square(s));
+				const int centre = std::max(std::abs(2 * file - 7), std::abs(2 * rank - 7)) / 2;
+				Score v;
+				switch (pt) {
+				case PAWN: v = Score(rank * 4 + (3 - std::abs(2 * file - 7) / 2) * 3 * (rank >= 3), rank * 6); break;
+				case KNIGHT: v = Score(24 - centre * 12, 18 - centre * 9); break;
+				case BISHOP: v = Score(12 - centre * 6, 9 - centre * 4); break;
+				case ROOK: v = Score(rank == RANK7 ? 20 : 0, 0); break;
+				case QUEEN: v = Score(0, 12 - centre * 6); break;
+				//The king shelters in a corner in the middlegame and comes to the centre in the endgame
+				case KING: v = Score(rank == RANK1 ? 10 * (centre - 1) : -20 * rank, 30 - centre * 15); break;
+				}
+				values[make_piece(WHITE, PieceType(pt))][s] = PIECE_VALUES[pt] + v;
+				values[make_piece(BLACK, PieceType(pt))][s ^ 56] = -(PIECE_VALUES[pt] + v);
+			}
+	}
+};
+
+static const PieceSquareTable PST;
+
+//Fills a bitboard towards the eighth rank (NORTH) or the first rank (SOUTH), not including the original squares
+template<Direction D>
+constexpr Bitboard fill(Bitboard b) {
+	b |= D == NORTH ? b << 8 : b >> 8;
+	b |= D == NORTH ? b << 16 : b >> 16;
+	b |= D == NORTH ? b << 32 : b >> 32;
+	return D == NORTH ? b << 8 : b >> 8;
+}
+
+//The pawn structure of a position, as cached in a PawnTable
+struct PawnEntry {
+	uint64_t key;
+	//The pawn structure score from White's point of view
+	Score score;
+	Bitboard passed[NCOLORS];
+};
+
+template<Color C>
+Score evaluate_pawns(Bitboard ours, Bitboard theirs, Bitboard& passed) {
+	constexpr Direction Up = relative_dir<C>(NORTH), Down = relative_dir<C>(SOUTH);
+
+	//A pawn is passed if no enemy pawn is in front of it on its own or an adjacent file
+	const Bitboard blocked = fill<Down>(theirs);
+	passed = ours & ~(blocked | shift<EAST>(blocked) | shift<WEST>(blocked));
+
+	const Bitboard files = fill<NORTH>(ours) | fill<SOUTH>(ours) | ours;
+	const Bitboard isolated = ours & ~(shift<EAST>(files) | shift<WEST>(files));
+	const Bitboard doubled = ours & fill<Up>(ours);
+	const Bitboard connected = ours & (pawn_attacks<C>(ours) | shift<EAST>(ours) | shift<WEST>(ours));
+
+	Score s = DOUBLED_PAWN * pop_count(doubled) + ISOLATED_PAWN * pop_count(isolated) +
+		CONNECTED_PAWN * pop_count(connected);
+	for (Bitboard b = passed; b; )
+		s += PASSED_PAWN[relative_rank<C>(rank_of(pop_lsb(&b)))];
+	return s;
+}
+
+inline void evaluate_pawns(const Position& p, PawnEntry& e) {
+	const Bitboard white = p.bitboard_of(WHITE_PAWN), black = p.bitboard_of(BLACK_PAWN);
+	e.key = p.get_pawn_hash();
+	e.score = evaluate_pawns<WHITE>(white, black, e.passed[WHITE]) - evaluate_pawns<BLACK>(black, white, e.passed[BLACK]);
+}
+
+//A fixed-size cache of pawn structure evaluations, indexed by the low bits of the pawn hash
+class PawnTable {
+	LargePageArray<PawnEntry> entries;
+
+public:
+	uint64_t probes = 0, hits = 0;
+
+	//The number of entries must be a power of two
+	explicit PawnTable(size_t n = 1 << 14) : entries(n) {}
+
+	const PawnEntry& probe(const Position& p) {
+		probes++;
+		PawnEntry& e = entries[p.get_pawn_hash() & (entries.size() - 1)];
+		//Positions without pawns have a key of 0, which an empty entry already scores correctly
+		if (e.key == p.get_pawn_hash()) hits++;
+		else evaluate_pawns(p, e);
+		return e;
+	}
+
+	void clear() { entries.clear(); probes = hits = 0; }
+	double hit_rate() const { return probes ? double(hits) / probes : 0; }
+	size_t size() const { return entries.size(); }
+};
+
+//Scale factors apply to the endgame score of the stronger side, out of NORMAL_SCALE
+const int NORMAL_SCALE = 64;
+
+//A score for a won endgame, which is above any score the general evaluation gives
+const int KNOWN_WIN = 10000;
+
+//An evaluator for a specific material combination, which returns the score from the point of view of the side to 
+//move. strong is the side with more material
+typedef int (*EndgameEvaluator)(const Position& p, Color strong);
+
+inline int distance(Square a, Square b) {
+	return std::max(std::abs(file_of(a) - file_of(b)), std::abs(rank_of(a) - rank_of(b)));
+}
+
+//The distance of a square from the edge of the board, from 0 to 3
+inline int edge_distance(Square s) {
+	return std::min(std::min(int(file_of(s)), 7 - file_of(s)), std::min(int(rank_of(s)), 7 - rank_of(s)));
+}
+
+inline int endgame_score(const Position& p, Color strong, int v) {
+	return p.turn() == strong ? v : -v;
+}
+
+//Positions where neither side can mate
+inline int evaluate_draw(const Position&, Color) {
+	return 0;
+}
+
+//A bare king against pieces which mate by themselves (at least a rook, or two bishops), without pawns. The weak
+//king is driven to the edge and the strong king brought closer
+inline int evaluate_kxk(const Position& p, Color strong) {
+	const Square strong_king = bsf(p.bitboard_of(strong, KING)), weak_king = bsf(p.bitboard_of(~strong, KING));
+	int v = KNOWN_WIN + 20 * (3 - edge_distance(weak_king)) + 10 * (7 - distance(strong_king, weak_king));
+	for (int pt = KNIGHT; pt <= QUEEN; pt++) v += PIECE_VALUES[pt].eg * p.count(strong, PieceType(pt));
+	return endgame_score(p, strong, v);
+}
+
+//King, bishop and knight against king. Mate is only possible in a corner of the bishop's colour, so the weak
+//king is driven towards one of those
+inline int evaluate_kbnk(const Position& p, Color strong) {
+	const Square strong_king = bsf(p.bitboard_of(strong, KING)), weak_king = bsf(p.bitboard_of(~strong, KING));
+	const bool dark = p.bitboard_of(strong, BISHOP) & 0xaa55aa55aa55aa55;
+	const int corner = dark ? std::min(distance(weak_king, a1), distance(weak_king, h8)) :
+		std::min(distance(weak_king, h1), distance(weak_king, a8));
+	return endgame_score(p, strong, KNOWN_WIN + 20 * (7 - corner) + 10 * (7 - distance(strong_king, weak_king)));
+}
+
+//What the material of a position says about it, as cached in a MaterialTable
+struct MaterialEntry {
+	uint64_t key;
+	//If set, the position is evaluated by this function instead of the general evaluation
+	EndgameEvaluator evaluator;
+	int16_t phase;
+	uint8_t scale[NCOLORS];
+	uint8_t strong;
+};
+
+inline void evaluate_material(const Position& p, MaterialEntry& e) {
+	e.key = p.get_material_hash();
+	e.evaluator = nullptr;
+
+	int npm[NCOLORS] = {}, phase = 0;
+	for (Color c : { WHITE, BLACK })
+		for (int pt = KNIGHT; pt <= QUEEN; pt++) {
+			npm[c] += PIECE_VALUES[pt].mg * p.count(c, PieceType(pt));
+			phase += PHASE_WEIGHTS[pt] * p.count(c, PieceType(pt));
+		}
+	e.phase = std::min(phase, MAX_PHASE);
+	e.strong = npm[BLACK] > npm[WHITE] || (npm[BLACK] == npm[WHITE] && p.count(BLACK_PAWN) > p.count(WHITE_PAWN));
+
+	const Color strong = Color(e.strong), weak = ~strong;
+	const bool pawns = p.count(WHITE_PAWN) + p.count(BLACK_PAWN) > 0;
+	if (!pawns && p.insufficient_material()) {
+		e.evaluator = evaluate_draw;
+	} else if (!pawns && npm[weak] == 0 && p.count(strong, KNIGHT) == 1 && p.count(strong, BISHOP) == 1 &&
+		npm[strong] == PIECE_VALUES[KNIGHT].mg + PIECE_VALUES[BISHOP].mg) {
+		e.evaluator = evaluate_kbnk;
+	} else if (!pawns && npm[weak] == 0 && (p.count(strong, QUEEN) || p.count(strong, ROOK) ||
+		p.count(strong, BISHOP) >= 2)) {
+		e.evaluator = evaluate_kxk;
+	}
+
+	//A side without pawns needs at least a rook more to win; with only a minor piece more, it usually cannot
+	for (Color c : { WHITE, BLACK }) {
+		e.scale[c] = NORMAL_SCALE;
+		if (p.count(c, PAWN) == 0 && npm[c] - npm[~c] <= PIECE_VALUES[BISHOP].mg)
+			e.scale[c] = npm[c] < PIECE_VALUES[ROOK].mg ? 0 : NORMAL_SCALE / 4;
+	}
+}
+
+//A fixed-size cache of material entries, indexed by the low bits of the material hash
+class MaterialTable {
+	LargePageArray<MaterialEntry> entries;
+
+public:
+	uint64_t probes = 0, hits = 0;
+
+	//The number of entries must be a power of two
+	explicit MaterialTable(size_t n = 1 << 13) : entries(n) {}
+
+	const MaterialEntry& probe(const Position& p) {
+		probes++;
+		MaterialEntry& e = entries[p.get_material_hash() & (entries.size() - 1)];
+		//Every position has two kings, so no material hash is 0 and empty entries never match
+		if (e.key == p.get_material_hash()) hits++;
+		else evaluate_material(p, e);
+		return e;
+	}
+
+	void clear() { entries.clear(); probes = hits = 0; }
+	double hit_rate() const { return probes ? double(hits) / probes : 0; }
+	size_t size() const { return entries.size(); }
+};
+
+//The tables of one search thread
+struct EvalTables {
+	PawnTable pawns;
+	MaterialTable material;
+};
+
+//Returns the static evaluation of a position from the point of view of the side to move. Without tables, the 
+//pawn structure and material are evaluated every time
+inline int evaluate(const Position& p, EvalTables* tables = nullptr) {
+	MaterialEntry local_material;
+	const MaterialEntry* m = &local_material;
+	if (tables) m = &tables->material.probe(p);
+	else evaluate_material(p, local_material);
+
+	if (m->evaluator) return m->evaluator(p, Color(m->strong));
+
+	Score s;
+	for (Bitboard b = p.all_pieces<WHITE>() | p.all_pieces<BLACK>(); b; ) {
+		const Square sq = pop_lsb(&b);
+		s += PST.values[p.at(sq)][sq];
+	}
+
+	PawnEntry local;
+	const PawnEntry* e = &local;
+	if (tables) e = &tables->pawns.probe(p);
+	else evaluate_pawns(p, local);
+	s += e->score;
+
+	const Bitboard empty = ~(p.all_pieces<WHITE>() | p.all_pieces<BLACK>());
+	s += FREE_PASSED_PAWN * (pop_count(shift<NORTH>(e->passed[WHITE]) & empty) -
+		pop_count(shift<SOUTH>(e->passed[BLACK]) & empty));
+
+	const int phase = m->phase;
+	const int eg = s.eg * m->scale[s.eg > 0 ? WHITE : BLACK] / NORMAL_SCALE;
+	const int v = (s.mg * phase + eg * (MAX_PHASE - phase)) / MAX_PHASE;
+	return p.turn() == WHITE ? v : -v;
+}
+
+}
@@ -0,0 +1,481 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <csignal>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+//Games between engines can be longer than 256 plies, so the history has room for a full game
+#define SURGE_MAX_GAME_PLY 1024
+#include "surge.h"
+
+//Plays a match between two UCI engines to test changes. Several games run at once, each worker thread driving its
+//own pair of engine processes over pipes, which are reused from game to game. The runner keeps the clocks and
+//adjudicates every game itself with has_legal_move(): checkmate, stalemate, threefold repetition, the 50-move rule
+//and insufficient material end a game, and an illegal move, a crash or a loss on time lose it. Each opening is
+//played twice with colors swapped. Openings are sampled from an EPD or FEN file, or made of random moves.
+//
+//The match reports the score, the Elo difference with its 95% error bars and games/hour, and, with -sprt, the
+//log-likelihood ratio of the sequential probability ratio test, stopping as soon as it accepts either hypothesis.
+//
+//Usage:
+//	match <engine A> <engine B> [-games n] [-concurrency n] [-tc seconds+increment] [-openings file]
+//	      [-plies n] [-option name=value] [-sprt elo0 elo1 alpha beta] [-seed n]
+//
+//An engine is a command line, such as "./chess_engine" or "./engine --flag". Options are set on both engines.
+
+typedef std::chrono::steady_clock Clock;
+
+//A UCI engine running as a child process
+class Engine {
+	pid_t pid = -1;
+	int to_engine = -1, from_engine = -1;
+	std::string buffer;
+
+public:
+	std::string name;
+
+	~Engine() { stop(); }
+
+	bool start(const std::string& command) {
+		//The arguments are built before forking, since the child of a threaded process must not allocate
+		std::istringstream ss(command);
+		std::vector<std::string> args;
+		std::string arg;
+		while (ss >> arg) args.push_back(arg);
+		if (args.empty()) return false;
+		std::vector<char*> argv;
+		for (std::string& a : args) argv.push_back(&a[0]);
+		argv.push_back(nullptr);
+
+		//The pipes are closed on exec, so that engines started by other workers do not hold their ends open and
+		//hide a crash. dup2() clears the flag on the child's stdin and stdout
+		int in[2], out[2];
+		if (pipe2(in, O_CLOEXEC) != 0) return false;
+		if (pipe2(out, O_CLOEXEC) != 0) {
+			close(in[0]); close(in[1]);
+			return false;
+		}
+
+		pid = fork();
+		if (pid == 0) {
+			dup2(in[0], STDIN_FILENO);
+			dup2(out[1], STDOUT_FILENO);
+			execvp(argv[0], argv.data());
+			_exit(127);
+		}
+
+		close(in[0]);
+		close(out[1]);
+		if (pid < 0) {
+			close(in[1]); close(out[0]);
+			return false;
+		}
+		to_engine = in[1];
+		from_engine = out[0];
+
+		name = command;
+		send("uci");
+		std::string line;
+		while (read_line(line, 10000)) {
+			if (line.compare(0, 8, "id name ") == 0) name = line.substr(8);
+			if (line == "uciok") return true;
+		}
+		return false;
+	}
+
+	void stop() {
+		if (pid <= 0) return;
+		send("quit");
+		close(to_engine);
+		close(from_engine);
+
+		//Engines get a moment to quit before they are killed
+		for (int i = 0; i < 100; i++) {
+			if (waitpid(pid, nullptr, WNOHANG) == pid) {
+				pid = -1;
+				return;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(10));
+		}
+		kill(pid, SIGKILL);
+		waitpid(pid, nullptr, 0);
+		pid = -1;
+	}
+
+	bool running() const { return pid > 0; }
+
+	//Returns true if the engine process has exited, and reaps it
+	bool exited() {
+		if (pid <= 0) return true;
+		if (waitpid(pid, nullptr, WNOHANG) != pid) return false;
+		close(to_engine);
+		close(from_engine);
+		pid = -1;
+		return true;
+	}
+
+	void send(const std::string& line) {
+		const std::string s = line + "\n";
+		if (write(to_engine, s.data(), s.size()) != ssize_t(s.size())) {}
+	}
+
+	//Reads one line, waiting at most timeout_ms milliseconds. Returns false on a timeout or if the engine exited
+	bool read_line(std::string& line, int64_t timeout_ms) {
+		const auto deadline = Clock::now() + std::chrono::milliseconds(timeout_ms);
+		while (true) {
+			const size_t eol = buffer.find('\n');
+			if (eol != std::string::npos) {
+				line = buffer.substr(0, eol);
+				if (!line.empty() && line.back() == '\r') line.pop_back();
+				buffer.erase(0, eol + 1);
+				return true;
+			}
+
+			const int64_t left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - Clock::now()).count();
+			if (left <= 0) return false;
+			pollfd fd = { from_engine, POLLIN, 0 };
+			if (poll(&fd, 1, int(left)) <= 0) continue;
+
+			char chunk[4096];
+			const ssize_t n = read(from_engine, chunk, sizeof(chunk));
+			if (n <= 0) return false;
+			buffer.append(chunk, n);
+		}
+	}
+
+	bool is_ready(int64_t timeout_ms = 10000) {
+		send("isready");
+		std::string line;
+		while (read_line(line, timeout_ms))
+			if (line == "readyok") return true;
+		return false;
+	}
+};
+
+//Finds the legal move with the given UCI notation, or returns a null move
+template<Color Us>
+Move parse_move(Position& p, const std::string& uci) {
+	MoveList<Us> list(p);
+	for (Move m : list)
+		if (uci_move(m) == uci) return m;
+	return Move();
+}
+
+enum Adjudication : int {
+	NOT_OVER, ADJ_CHECKMATE, ADJ_STALEMATE, ADJ_REPETITION, ADJ_FIFTY_MOVES, ADJ_INSUFFICIENT_MATERIAL, ADJ_PLY_LIMIT,
+	ADJ_ILLEGAL_MOVE, ADJ_TIME_FORFEIT, ADJ_CRASH, NADJUDICATIONS
+};
+
+const char* ADJUDICATION_STR[NADJUDICATIONS] = {
+	"", "Checkmate", "Stalemate", "Threefold repetition", "50-move rule", "Insufficient material", "Ply limit",
+	"Illegal move", "Loss on time", "Engine crash"
+};
+
+//Decides whether the game is over after a move. Draws by the ply limit keep the history within MAX_GAME_PLY
+template<Color Us>
+Adjudication adjudicate(Position& p, int plies) {
+	if (!p.has_legal_move<Us>()) return p.checkers ? ADJ_CHECKMATE : ADJ_STALEMATE;
+	if (p.is_fifty_move_draw()) return ADJ_FIFTY_MOVES;
+	if (p.is_repetition(2)) return ADJ_REPETITION;
+	if (p.insufficient_material()) return ADJ_INSUFFICIENT_MATERIAL;
+	if (plies >= MAX_GAME_PLY - 8) return ADJ_PLY_LIMIT;
+	return NOT_OVER;
+}
+
+struct Settings {
+	std::string engines[2];
+	int games = 100, concurrency = 1, random_plies = 8;
+	int64_t base_ms = 10000, inc_ms = 100, margin_ms = 100;
+	std::vector<std::string> options;
+	std::vector<std::string> openings;
+	bool sprt = false;
+	double elo0 = 0, elo1 = 5, alpha = 0.05, beta = 0.05;
+	uint64_t seed = 1;
+};
+
+//The results of the match so far, from the point of view of engine A, and the names the engines gave. Everything
+//but the counters of pairs and the stop flag is guarded by the mutex
+struct MatchState {
+	std::mutex mutex;
+	std::string names[2];
+	int wins = 0, losses = 0, draws = 0;
+	int adjudications[NADJUDICATIONS] = {};
+	std::atomic<int> next_pair{ 0 };
+	std::atomic<bool> stop{ false };
+	Clock::time_point begin = Clock::now();
+};
+
+inline double expected_score(double elo) {
+	return 1 / (1 + std::pow(10, -elo / 400));
+}
+
+inline double elo_of(double score) {
+	return -400 * std::log10(1 / score - 1);
+}
+
+//Returns the log-likelihood ratio of elo1 against elo0, using the normal approximation of the trinomial results
+double llr(int w, int l, int d, double elo0, double elo1) {
+	const double n = w + l + d;
+	if (w == 0 || l == 0 || n == 0) return 0;
+	const double s = (w + d / 2.0) / n;
+	const double var = (w * (1 - s) * (1 - s) + l * s * s + d * (0.5 - s) * (0.5 - s)) / n;
+	const double s0 = expected_score(elo0), s1 = expected_score(elo1);
+	return (s1 - s0) * (2 * s - s0 - s1) / (2 * var / n);
+}
+
+void report(MatchState& m, const Settings& s, bool final) {
+	const int n = m.wins + m.losses + m.draws;
+	const double score = (m.wins + m.draws / 2.0) / std::max(n, 1);
+	const double var = n ? (m.wins * (1 - score) * (1 - score) + m.losses * score * score +
+		m.draws * (0.5 - score) * (0.5 - score)) / n : 0;
+	const double error = 1.96 * std::sqrt(var / std::max(n, 1));
+	const double hours = std::chrono::duration<double>(Clock::now() - m.begin).count() / 3600;
+
+	std::ostringstream ss;
+	ss << std::fixed << std::setprecision(1) << "Score of " << m.names[0] << " vs " << m.names[1] << ": " << m.wins
+		<< " - " << m.losses << " - " << m.draws << " [" << std::setprecision(3) << score << "] " << n;
+	if (n && score > 0 && score < 1) {
+		ss << std::setprecision(1) << "  Elo " << elo_of(score);
+		if (score - error > 0 && score + error < 1)
+			ss << " +/- " << (elo_of(std::min(score + error, 0.999)) - elo_of(std::max(score - error, 0.001))) / 2;
+	}
+	ss << std::setprecision(0) << "  " << n / std::max(hours, 1e-9) << " games/hour";
+
+	if (s.sprt) {
+		const double lower = std::log(s.beta / (1 - s.alpha)), upper = std::log((1 - s.beta) / s.alpha);
+		const double ratio = llr(m.wins, m.losses, m.draws, s.elo0, s.elo1);
+		ss << std::setprecision(2) << "  LLR " << ratio << " (" << lower << ", " << upper << ")";
+		if (ratio >= upper) {
+			ss << " H1 accepted";
+			m.stop = true;
+		} else if (ratio <= lower) {
+			ss << " H0 accepted";
+			m.stop = true;
+		}
+	}
+	std::cout << ss.str() << std::endl;
+
+	if (final) {
+		std::cout << "\n";
+		for (int i = 1; i < NADJUDICATIONS; i++)
+			if (m.adjudications[i]) std::cout << std::left << std::setw(24) << ADJUDICATION_STR[i] << std::right
+				<< m.adjudications[i] << "\n";
+	}
+}
+
+//Plays one game from an opening, engine <white> having White. Returns 1 if White won, 0 if Black won and 0.5 for a
+//draw
+double play_game(Engine* engines[2], int white, const std::string& fen, const Settings& s, Adjudication& how) {
+	std::unique_ptr<Position> p(new Position(fen));
+	std::string moves;
+	int64_t clock[2] = { s.base_ms, s.base_ms };
+
+	for (Engine* e : { engines[0], engines[1] }) {
+		e->send("ucinewgame");
+		if (!e->is_ready()) {
+			how = ADJ_CRASH;
+			return e == engines[white] ? 0 : 1;
+		}
+	}
+
+	for (int plies = 0; ; plies++) {
+		const Color us = p->turn();
+		Engine& e = *engines[us == WHITE ? white : 1 - white];
+		//The side which loses by a forfeit, as the game result
+		const double forfeit = us == WHITE ? 0 : 1;
+
+		e.send("position fen " + fen + (moves.empty() ? "" : " moves" + moves));
+		e.send("go wtime " + std::to_string(clock[WHITE]) + " btime " + std::to_string(clock[BLACK]) +
+			" winc " + std::to_string(s.inc_ms) + " binc " + std::to_string(s.inc_ms));
+
+		const auto start = Clock::now();
+		std::string line, best;
+		while (e.read_line(line, clock[us] + s.margin_ms -
+			std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count())) {
+			if (line.compare(0, 9, "bestmove ") == 0) {
+				std::istringstream ls(line.substr(9));
+				ls >> best;
+				break;
+			}
+		}
+		const int64_t used = std::chrono::duration_cast<std::chrono::milliseconds>(Clock::now() - start).count();
+
+		if (best.empty()) {
+			//An engine which did not answer in time may be stuck, so it is restarted unless it recovers
+			if (e.exited()) how = ADJ_CRASH;
+			else {
+				how = ADJ_TIME_FORFEIT;
+				e.send("stop");
+				if (!e.is_ready(1000)) e.stop();
+			}
+			return forfeit;
+		}
+		if (used > clock[us] + s.margin_ms) {
+			how = ADJ_TIME_FORFEIT;
+			return forfeit;
+		}
+		clock[us] += s.inc_ms - used;
+
+		const Move m = us == WHITE ? parse_move<WHITE>(*p, best) : parse_move<BLACK>(*p, best);
+		if (m.to_from() == 0) {
+			how = ADJ_ILLEGAL_MOVE;
+			return forfeit;
+		}
+		moves += " " + best;
+		if (us == WHITE) p->play<WHITE>(m);
+		else p->play<BLACK>(m);
+
+		how = p->turn() == WHITE ? adjudicate<WHITE>(*p, plies + 1) : adjudicate<BLACK>(*p, plies + 1);
+		if (how == ADJ_CHECKMATE) return 1 - forfeit;
+		if (how != NOT_OVER) return 0.5;
+	}
+}
+
+//Plays pairs of games until the match is over, restarting engines which crashed
+void worker(const Settings& s, MatchState& m) {
+	Engine engines[2];
+	Engine* order[2] = { &engines[0], &engines[1] };
+
+	for (int pair; !m.stop && (pair = m.next_pair++) * 2 < s.games; ) {
+		const std::string& fen = s.openings[pair % s.openings.size()];
+
+		for (int game = 0; game < 2 && pair * 2 + game < s.games && !m.stop; game++) {
+			for (int i = 0; i < 2; i++) {
+				if (engines[i].running()) continue;
+				if (!engines[i].start(s.engines[i])) {
+					std::cerr << "Failed to start " << s.engines[i] << "\n";
+					exit(1);
+				}
+				for (const std::string& option : s.options) {
+					const size_t eq = option.find('=');
+					engines[i].send("setoption name " + option.substr(0, eq) + " value " + option.substr(eq + 1));
+				}
+				std::lock_guard<std::mutex> lock(m.mutex);
+				m.names[i] = engines[i].name;
+			}
+
+			//Engine A has White in the first game of the pair, and Black in the second
+			Adjudication how = NOT_OVER;
+			const int white = game;
+			const double result = play_game(order, white, fen, s, how);
+			const double score_a = white == 0 ? result : 1 - result;
+
+			std::lock_guard<std::mutex> lock(m.mutex);
+			if (score_a == 1) m.wins++;
+			else if (score_a == 0) m.losses++;
+			else m.draws++;
+			m.adjudications[how]++;
+			report(m, s, false);
+		}
+	}
+}
+
+//Plays random legal moves from the start position, avoiding positions where the game is already over
+std::string random_opening(int plies, std::mt19937_64& rng) {
+	std::unique_ptr<Position> p(new Position(DEFAULT_FEN));
+	for (int i = 0; i < plies; i++) {
+		Move list[218];
+		Move* last = p->turn() == WHITE ? p->generate_legals<WHITE>(list) : p->generate_legals<BLACK>(list);
+		if (last == list) return random_opening(plies, rng);
+		const Move m = list[rng() % (last - list)];
+		if (p->turn() == WHITE) p->play<WHITE>(m);
+		else p->play<BLACK>(m);
+	}
+
+	Move list[218];
+	Move* last = p->turn() == WHITE ? p->generate_legals<WHITE>(list) : p->generate_legals<BLACK>(list);
+	return last == list ? random_opening(plies, rng) : p->fen();
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	signal(SIGPIPE, SIG_IGN);
+
+	Settings s;
+	std::string openings_file;
+	int engines = 0;
+	for (int i = 1; i < argc; i++) {
+		const std::string arg = argv[i];
+		const bool more = i + 1 < argc;
+		if (arg == "-games" && more) s.games = std::stoi(argv[++i]);
+		else if (arg == "-concurrency" && more) s.concurrency = std::max(std::stoi(argv[++i]), 1);
+		else if (arg == "-tc" && more) {
+			const std::string tc = argv[++i];
+			const size_t plus = tc.find('+');
+			s.base_ms = int64_t(std::stod(tc.substr(0, plus)) * 1000);
+			s.inc_ms = plus == std::string::npos ? 0 : int64_t(std::stod(tc.substr(plus + 1)) * 1000);
+		}
+		else if (arg == "-openings" && more) openings_file = argv[++i];
+		else if (arg == "-plies" && more) s.random_plies = std::stoi(argv[++i]);
+		else if (arg == "-option" && more) s.options.push_back(argv[++i]);
+		else if (arg == "-seed" && more) s.seed = std::stoull(argv[++i]);
+		else if (arg == "-sprt" && i + 4 < argc) {
+			s.sprt = true;
+			s.elo0 = std::stod(argv[++i]);
+			s.elo1 = std::stod(argv[++i]);
+			s.alpha = std::stod(argv[++i]);
+			s.beta = std::stod(argv[++i]);
+		}
+		else if (arg[0] != '-' && engines < 2) s.engines[engines++] = arg;
+		else {
+			engines = 0;
+			break;
+		}
+	}
+	if (engines < 2) {
+		std::cerr << "Usage: match <engine A> <engine B> [-games n] [-concurrency n] [-tc seconds+increment]\n"
+			<< "             [-openings file] [-plies n] [-option name=value] [-sprt elo0 elo1 alpha beta] [-seed n]\n";
+		return 1;
+	}
+
+	std::mt19937_64 rng(s.seed);
+	if (!openings_file.empty()) {
+		std::ifstream in(openings_file);
+		std::string line;
+		while (std::getline(in, line)) {
+			//The first four fields of an EPD or FEN line
+			std::istringstream ss(line);
+			std::string field, fen;
+			for (int i = 0; i < 4 && ss >> field; i++) fen += (i ? " " : "") + field;
+			if (fen.empty() || fen[0] == '#') continue;
+
+			//Openings where the game is already over are skipped
+			std::unique_ptr<Position> p(new Position(fen));
+			if ((p->turn() == WHITE ? adjudicate<WHITE>(*p, 0) : adjudicate<BLACK>(*p, 0)) == NOT_OVER)
+				s.openings.push_back(fen);
+		}
+		if (s.openings.empty()) {
+			std::cerr << "No openings in " << openings_file << "\n";
+			return 1;
+		}
+		std::shuffle(s.openings.begin(), s.openings.end(), rng);
+	} else {
+		for (int i = 0; i < (s.games + 1) / 2; i++) s.openings.push_back(random_opening(s.random_plies, rng));
+	}
+
+	MatchState m;
+	m.names[0] = s.engines[0];
+	m.names[1] = s.engines[1];
+	std::vector<std::thread> workers;
+	for (int i = 0; i < s.concurrency; i++) workers.emplace_back(worker, std::cref(s), std::ref(m));
+	for (std::thread& t : workers) t.join();
+
+	std::lock_guard<std::mutex> lock(m.mutex);
+	std::cout << "\nFinished match\n";
+	report(m, s, true);
+	return 0;
+}
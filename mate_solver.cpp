@@ -0,0 +1,413 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <fstream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <vector>
+#include "surge.h"
+
+//Finds forced mates with a depth-first proof-number (df-pn) search. The side to move at the root is the attacker:
+//at OR nodes the attacker needs one move that mates, at AND nodes every defence must be mated. Draws of any kind
+//count as a failure of the attacker. Nodes are expanded with generate_legals(), so a side in check only ever sees
+//its evasions, and children are looked up in the proof table by hash_after() without playing the moves.
+//
+//The search is written in negamax form: each node stores (phi, delta), its proof and disproof numbers from the
+//point of view of the side to move, so phi = min(delta of children) and delta = sum(phi of children). Thresholds
+//for the chosen child use the 1 + epsilon trick, which keeps the search from switching back and forth between
+//siblings. Positions found again by repetition are stored as draws, which can hide some mates (the graph history
+//interaction problem) but can never prove a mate that does not exist, and every mating line is checked by playing it.
+//
+//Positions are read from an EPD file, and solved in parallel, one position per thread with its own proof table.
+//An EPD "id" is used to name the position, and "dm" (direct mate) is compared with the length found.
+//
+//Usage:
+//	mate_solver <epd file> [threads] [memory in MB] [max nodes per position] [--checks]
+//
+//With --checks, the attacker only plays checking moves, which finds most puzzle mates much faster, but "no mate" then
+//only means that there is no mate by checks alone. The mate found is not always the shortest one
+
+const uint32_t INF = UINT32_MAX;
+const int MAX_SOLVE_PLY = 256;
+const double EPSILON = 0.25;
+
+//An entry of the proof table. <dist> is the number of plies to mate once a node is solved, and <work> is the log2 of
+//the nodes searched below the entry, so that cheap entries are replaced first
+struct ProofEntry {
+	uint32_t lock;
+	uint32_t phi, delta;
+	uint16_t dist;
+	uint8_t generation, work;
+};
+
+static_assert(sizeof(ProofEntry) == 16, "Four entries fill a cache line");
+
+class ProofTable {
+	static const size_t BUCKET = 4;
+
+	LargePageArray<ProofEntry> entries;
+	size_t buckets;
+	uint8_t generation = 0;
+
+	inline ProofEntry* bucket(uint64_t key) { return &entries[(key & (buckets - 1)) * BUCKET]; }
+
+public:
+	explicit ProofTable(size_t bytes) {
+		buckets = 1;
+		while (buckets * 2 * BUCKET * sizeof(ProofEntry) <= bytes) buckets *= 2;
+		entries.resize(buckets * BUCKET);
+		//Touches every page now, so that page faults are not counted in the time of the first positions
+		entries.clear();
+	}
+
+	//Entries of earlier positions are ignored rather than cleared. Generation 0 marks an empty entry
+	void new_search() {
+		if (++generation == 0) {
+			entries.clear();
+			generation = 1;
+		}
+	}
+
+	inline bool probe(uint64_t key, ProofEntry& e) {
+		ProofEntry* b = bucket(key);
+		for (size_t i = 0; i < BUCKET; i++) {
+			if (b[i].generation == generation && b[i].lock == uint32_t(key >> 32)) {
+				e = b[i];
+				return true;
+			}
+		}
+		return false;
+	}
+
+	inline void store(uint64_t key, uint32_t phi, uint32_t delta, int dist, uint64_t nodes) {
+		ProofEntry* b = bucket(key), *replace = b;
+		int replace_value = INT32_MAX;
+		for (size_t i = 0; i < BUCKET; i++) {
+			if (b[i].generation == generation && b[i].lock == uint32_t(key >> 32)) {
+				replace = &b[i];
+				break;
+			}
+			//Empty and stale entries go first, then unsolved entries with little work behind them
+			const bool solved = b[i].phi == 0 || b[i].delta == 0;
+			const int value = b[i].generation != generation ? -1 : b[i].work + (solved ? 64 : 0);
+			if (value < replace_value) {
+				replace_value = value;
+				replace = &b[i];
+			}
+		}
+
+		int work = 0;
+		while (nodes >>= 1) work++;
+		*replace = { uint32_t(key >> 32), phi, delta, uint16_t(dist), generation, uint8_t(work) };
+	}
+};
+
+//Sums stop just short of INF, which is reserved for solved nodes
+inline uint32_t saturating_add(uint32_t a, uint32_t b) {
+	return a == INF || b == INF ? INF : uint32_t(std::min<uint64_t>(uint64_t(a) + b, INF - 1));
+}
+
+enum Status {
+	MATE_FOUND, NO_MATE, UNKNOWN
+};
+
+const char* STATUS_STR[] = { "mate", "no mate", "unknown" };
+
+struct Result {
+	std::string id;
+	Status status = UNKNOWN;
+	int direct_mate = 0;
+	std::vector<Move> line;
+	bool verified = false;
+	uint64_t nodes = 0;
+	double seconds = 0;
+};
+
+class Solver {
+	Position& p;
+	ProofTable& table;
+	const Color attacker;
+	const bool checks_only;
+	const uint64_t max_nodes;
+
+public:
+	uint64_t nodes = 0;
+	bool aborted = false;
+
+	Solver(Position& p, ProofTable& table, bool checks_only, uint64_t max_nodes) :
+		p(p), table(table), attacker(p.turn()), checks_only(checks_only), max_nodes(max_nodes) {}
+
+	//Returns the moves to search. With checks_only, the attacker's quiet moves that do not give check are dropped
+	template<Color Us>
+	size_t candidates(Move* list) {
+		const size_t n = p.generate_legals<Us>(list) - list;
+		if (!checks_only || Us != attacker) return n;
+
+		size_t checks = 0;
+		for (size_t i = 0; i < n; i++) {
+			p.play<Us>(list[i]);
+			if (p.in_check<~Us>()) list[checks++] = list[i];
+			p.undo<Us>(list[i]);
+		}
+		return checks;
+	}
+
+	//A draw is a loss for the attacker and a win for the defender
+	template<Color Us>
+	inline void store_draw(uint64_t key) {
+		if (Us == attacker) table.store(key, INF, 0, 0, 1);
+		else table.store(key, 0, INF, 0, 1);
+	}
+
+	//Searches the current position until its phi reaches th_phi or its delta reaches th_delta
+	template<Color Us>
+	void mid(uint32_t th_phi, uint32_t th_delta, int ply) {
+		const uint64_t key = p.get_hash(), start = nodes;
+		if (++nodes >= max_nodes) {
+			aborted = true;
+			return;
+		}
+
+		if ((ply > 0 && (p.is_repetition() || p.is_fifty_move_draw())) || p.insufficient_material() ||
+			ply >= MAX_SOLVE_PLY) {
+			store_draw<Us>(key);
+			return;
+		}
+
+		Move list[218];
+		const size_t n = candidates<Us>(list);
+		if (n == 0) {
+			if (p.in_check<Us>()) table.store(key, INF, 0, 0, 1);
+			else store_draw<Us>(key);
+			return;
+		}
+
+		uint64_t keys[218];
+		for (size_t i = 0; i < n; i++) keys[i] = p.hash_after(list[i]);
+
+		while (true) {
+			uint32_t phi = INF, delta = 0, second = INF, best_phi = 1;
+			size_t best = 0;
+			int win_dist = INT32_MAX, loss_dist = 0;
+
+			for (size_t i = 0; i < n; i++) {
+				ProofEntry e;
+				uint32_t child_phi = 1, child_delta = 1;
+				if (table.probe(keys[i], e)) {
+					child_phi = e.phi;
+					child_delta = e.delta;
+					if (child_delta == 0) win_dist = std::min<int>(win_dist, e.dist);
+					loss_dist = std::max<int>(loss_dist, e.dist);
+				}
+
+				delta = saturating_add(delta, child_phi);
+				if (child_delta < phi) {
+					second = phi;
+					phi = child_delta;
+					best = i;
+					best_phi = child_phi;
+				} else if (child_delta < second) {
+					second = child_delta;
+				}
+			}
+
+			const int dist = phi == 0 ? win_dist + 1 : delta == 0 ? loss_dist + 1 : 0;
+			table.store(key, phi, delta, dist, nodes - start);
+			if (phi >= th_phi || delta >= th_delta || aborted) return;
+
+			const uint32_t child_th_delta = std::min<uint64_t>(th_phi,
+				std::max<uint64_t>(uint64_t(second) + 1, uint64_t(second * (1 + EPSILON))));
+			const uint32_t child_th_phi = th_delta == INF ? INF :
+				std::min<uint64_t>(INF, uint64_t(th_delta) - delta + best_phi);
+
+			p.play<Us>(list[best]);
+			mid<~Us>(child_th_phi, child_th_delta, ply + 1);
+			p.undo<Us>(list[best]);
+		}
+	}
+
+	//Follows the solved entries from the current position: the attacker picks the quickest mate, and the defender
+	//the longest resistance
+	template<Color Us>
+	void mating_line(std::vector<Move>& line) {
+		ProofEntry e;
+		if (line.size() >= MAX_SOLVE_PLY || !table.probe(p.get_hash(), e) || (e.phi != 0 && e.delta != 0)) return;
+
+		MoveList<Us> list(p);
+		Move choice;
+		int choice_dist = -1;
+		for (Move m : list) {
+			ProofEntry child;
+			if (!table.probe(p.hash_after(m), child)) continue;
+			if (Us == attacker && child.delta == 0 && (choice_dist < 0 || child.dist < choice_dist)) {
+				choice = m;
+				choice_dist = child.dist;
+			} else if (Us != attacker && child.phi == 0 && child.dist > choice_dist) {
+				choice = m;
+				choice_dist = child.dist;
+			}
+		}
+		if (choice_dist < 0) return;
+
+		line.push_back(choice);
+		p.play<Us>(choice);
+		mating_line<~Us>(line);
+		p.undo<Us>(choice);
+	}
+
+	template<Color Us>
+	void solve(Result& r) {
+		mid<Us>(INF, INF, 0);
+		ProofEntry e;
+		if (!aborted && table.probe(p.get_hash(), e))
+			r.status = e.phi == 0 ? MATE_FOUND : e.delta == 0 ? NO_MATE : UNKNOWN;
+		if (r.status == MATE_FOUND) mating_line<Us>(r.line);
+		r.nodes = nodes;
+	}
+};
+
+//Plays a line and checks that it ends in checkmate of the defender
+template<Color Us>
+bool is_mating_line(Position& p, const std::vector<Move>& line, size_t i = 0) {
+	if (i == line.size()) return line.size() % 2 == 1 && !p.has_legal_move<Us>() && p.checkers;
+
+	MoveList<Us> list(p);
+	bool legal = false;
+	for (Move m : list) legal |= m == line[i];
+	if (!legal) return false;
+
+	p.play<Us>(line[i]);
+	const bool mate = is_mating_line<~Us>(p, line, i + 1);
+	p.undo<Us>(line[i]);
+	return mate;
+}
+
+struct Problem {
+	std::string fen, id;
+	int direct_mate = 0;
+};
+
+//Reads the board, side to move, castling and en passant fields of each line, and the "id" and "dm" operations
+std::vector<Problem> read_epd(const std::string& path) {
+	std::ifstream in(path);
+	if (!in) {
+		std::cerr << "Failed to open " << path << "\n";
+		exit(1);
+	}
+
+	std::vector<Problem> problems;
+	std::string line;
+	while (std::getline(in, line)) {
+		std::istringstream ss(line);
+		std::string field;
+		Problem pr;
+		for (int i = 0; i < 4 && ss >> field; i++) pr.fen += (i ? " " : "") + field;
+		if (pr.fen.empty() || pr.fen[0] == '#') continue;
+
+		std::string ops;
+		std::getline(ss, ops);
+		std::istringstream os(ops);
+		std::string op;
+		while (std::getline(os, op, ';')) {
+			std::istringstream o(op);
+			std::string name;
+			o >> name;
+			if (name == "dm") o >> pr.direct_mate;
+			else if (name == "id") {
+				std::getline(o >> std::ws, pr.id);
+				if (pr.id.size() >= 2 && pr.id.front() == '"') pr.id = pr.id.substr(1, pr.id.size() - 2);
+			}
+		}
+		if (pr.id.empty()) pr.id = std::to_string(problems.size() + 1);
+		problems.push_back(pr);
+	}
+	return problems;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	bool checks_only = false;
+	std::vector<std::string> args;
+	for (int i = 1; i < argc; i++) {
+		if (std::string(argv[i]) == "--checks") checks_only = true;
+		else args.push_back(argv[i]);
+	}
+	if (args.empty()) {
+		std::cerr << "Usage: mate_solver <epd file> [threads] [memory in MB] [max nodes per position] [--checks]\n";
+		return 1;
+	}
+
+	const std::vector<Problem> problems = read_epd(args[0]);
+	const int threads = std::max(args.size() > 1 ? std::stoi(args[1]) : int(std::thread::hardware_concurrency()), 1);
+	const size_t memory = (args.size() > 2 ? std::stoull(args[2]) : 256) << 20;
+	const uint64_t max_nodes = args.size() > 3 ? std::stoull(args[3]) : 10000000;
+
+	std::vector<Result> results(problems.size());
+	std::atomic<size_t> next{ 0 };
+	std::mutex output;
+	auto begin = std::chrono::steady_clock::now();
+
+	auto work = [&] {
+		std::unique_ptr<Position> p(new Position());
+		ProofTable table(memory / threads);
+		for (size_t i; (i = next++) < problems.size(); ) {
+			const Problem& pr = problems[i];
+			Result& r = results[i];
+			r.id = pr.id;
+			r.direct_mate = pr.direct_mate;
+
+			*p = Position(pr.fen);
+			table.new_search();
+			Solver solver(*p, table, checks_only, max_nodes);
+			auto start = std::chrono::steady_clock::now();
+			if (p->turn() == WHITE) solver.solve<WHITE>(r);
+			else solver.solve<BLACK>(r);
+			r.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+			r.verified = r.status == MATE_FOUND &&
+				(p->turn() == WHITE ? is_mating_line<WHITE>(*p, r.line) : is_mating_line<BLACK>(*p, r.line));
+
+			std::ostringstream ss;
+			ss << r.id << ": " << STATUS_STR[r.status];
+			if (r.status == MATE_FOUND) {
+				ss << " in " << (r.line.size() + 1) / 2;
+				if (r.direct_mate) ss << " (dm " << r.direct_mate << ")";
+				ss << (r.verified ? "" : " NOT VERIFIED") << ":";
+				for (Move m : r.line) ss << " " << uci_move(m);
+			}
+			ss << " [" << r.nodes << " nodes, " << std::fixed << std::setprecision(3) << r.seconds << "s]";
+
+			std::lock_guard<std::mutex> lock(output);
+			std::cout << ss.str() << std::endl;
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++) workers.emplace_back(work);
+	for (std::thread& t : workers) t.join();
+
+	const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	size_t counts[3] = {}, verified = 0, longer = 0;
+	uint64_t nodes = 0;
+	for (const Result& r : results) {
+		counts[r.status]++;
+		verified += r.verified;
+		longer += r.verified && r.direct_mate && int(r.line.size() + 1) / 2 > r.direct_mate;
+		nodes += r.nodes;
+	}
+
+	std::cout << "\nPositions:         " << problems.size()
+		<< "\nMates found:       " << counts[MATE_FOUND] << " (" << verified << " verified, " << longer
+		<< " longer than dm)"
+		<< "\nNo mate:           " << counts[NO_MATE]
+		<< "\nUnknown:           " << counts[UNKNOWN]
+		<< "\nTime:              " << std::fixed << std::setprecision(2) << seconds << "s"
+		<< "\nSolved per minute: " << std::setprecision(0) << counts[MATE_FOUND] * 60 / seconds
+		<< "\nNodes per second:  " << nodes / seconds << "\n";
+	return 0;
+}
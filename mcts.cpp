@@ -0,0 +1,361 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include <vector>
+#include <cmath>
+#include "surge.h"
+
+//Monte Carlo tree search with PUCT selection. The tool plays a game against itself, reusing the subtree of each
+//move that is played, and reports playouts/s and the memory used per node.
+//
+//Nodes are never allocated individually. The children of a node are allocated as one contiguous block from an
+//arena when the node is expanded, so a node only needs the index of its first child. Each search thread keeps
+//its own copy of the root position and walks the tree with play/undo. Threads spread out over the tree using
+//virtual loss: a node that another thread is searching below is temporarily scored as if it had lost.
+//
+//Usage:
+//	mcts [playouts per move] [threads] [moves] [fen]
+
+//Evaluates a position that has just been expanded. Returns a value in [-1, 1] for the side to move and writes
+//a prior probability for each legal move. A policy network plugs in here
+typedef float (*Evaluator)(Position& p, const Move* moves, size_t n, float* priors, PRNG& rng);
+
+//Uniform priors, and the result of a single random playout as the value
+float playout_evaluator(Position& p, const Move*, size_t n, float* priors, PRNG& rng) {
+	for (size_t i = 0; i < n; i++) priors[i] = 1.0f / n;
+
+	Playout r = playout(p, rng);
+	if (r.result == DRAW) return 0;
+	return (r.result == WHITE_WINS) == (p.turn() == WHITE) ? 1 : -1;
+}
+
+enum NodeState : uint8_t {
+	UNEXPANDED, EXPANDING, EXPANDED, TERMINAL
+};
+
+//A node holds the statistics of the move leading to it, from the point of view of the side that played it
+struct Node {
+	Move move;
+	uint16_t num_children;
+	float prior;
+	uint32_t first_child;
+	std::atomic<uint32_t> visits;
+	std::atomic<uint32_t> virtual_loss;
+	std::atomic<float> value_sum;
+	std::atomic<uint8_t> state;
+
+	//For terminal nodes, the value for the side to move
+	int8_t terminal_value;
+
+	void init(Move m, float p) {
+		move = m;
+		num_children = 0;
+		prior = p;
+		first_child = 0;
+		visits.store(0, std::memory_order_relaxed);
+		virtual_loss.store(0, std::memory_order_relaxed);
+		value_sum.store(0, std::memory_order_relaxed);
+		state.store(UNEXPANDED, std::memory_order_relaxed);
+		terminal_value = 0;
+	}
+
+	float q(float fpu) const {
+		uint32_t n = visits.load(std::memory_order_relaxed), vl = virtual_loss.load(std::memory_order_relaxed);
+		return n + vl ? (value_sum.load(std::memory_order_relaxed) - vl) / (n + vl) : fpu;
+	}
+};
+
+//A fixed block of nodes that are handed out by bumping an index. Nodes are only freed all at once
+class NodeArena {
+	std::unique_ptr<Node[]> nodes;
+	uint32_t capacity;
+	std::atomic<uint32_t> used;
+
+public:
+	static const uint32_t NONE = ~0u;
+
+	NodeArena(uint32_t capacity) : nodes(new Node[capacity]), capacity(capacity), used(0) {}
+
+	inline Node& operator[](uint32_t i) { return nodes[i]; }
+
+	//Returns the index of the first of n consecutive nodes, or NONE if the arena is full
+	inline uint32_t allocate(uint32_t n) {
+		uint32_t first = used.fetch_add(n, std::memory_order_relaxed);
+		return first + n <= capacity ? first : NONE;
+	}
+
+	inline uint32_t size() const { return std::min(used.load(std::memory_order_relaxed), capacity); }
+	inline void clear() { used.store(0, std::memory_order_relaxed); }
+};
+
+inline void add_value(std::atomic<float>& sum, float v) {
+	float old = sum.load(std::memory_order_relaxed);
+	while (!sum.compare_exchange_weak(old, old + v, std::memory_order_relaxed)) {}
+}
+
+class Search {
+	std::unique_ptr<NodeArena> arena, spare;
+	Position root_position;
+	Evaluator evaluator;
+	float c_puct;
+
+	std::atomic<uint64_t> playouts;
+	std::atomic<bool> stop;
+
+public:
+	//The root is always the first node of the arena
+	static const uint32_t ROOT = 0;
+
+	Search(const std::string& fen, uint32_t capacity, Evaluator evaluator = playout_evaluator, float c_puct = 1.5f) :
+		arena(new NodeArena(capacity)), spare(new NodeArena(capacity)), root_position(fen),
+		evaluator(evaluator), c_puct(c_puct), playouts(0), stop(false) {
+		(*arena)[arena->allocate(1)].init(Move(), 1);
+	}
+
+	inline Node& root() { return (*arena)[ROOT]; }
+	inline Position& position() { return root_position; }
+	inline uint32_t nodes() const { return arena->size(); }
+
+	void run(uint64_t limit, int threads);
+	Move best_move();
+	uint32_t advance(Move m);
+
+private:
+	void worker(uint64_t limit, uint64_t seed);
+	bool playout_once(Position& p, PRNG& rng, std::vector<uint32_t>& path, std::vector<Move>& moves);
+	uint32_t select(const Node& node);
+	template<Color Us> float expand(Position& p, Node& node, bool is_root, PRNG& rng);
+};
+
+//Returns the index of the child with the highest PUCT score
+uint32_t Search::select(const Node& node) {
+	const float sqrt_n = std::sqrt(float(node.visits.load(std::memory_order_relaxed) +
+		node.virtual_loss.load(std::memory_order_relaxed)));
+	uint32_t best = node.first_child;
+	float best_score = -1e9f;
+
+	for (uint32_t i = node.first_child; i < node.first_child + node.num_children; i++) {
+		const Node& c = (*arena)[i];
+		uint32_t n = c.visits.load(std::memory_order_relaxed) + c.virtual_loss.load(std::memory_order_relaxed);
+		float score = c.q(0) + c_puct * c.prior * sqrt_n / (1 + n);
+		if (score > best_score) {
+			best_score = score;
+			best = i;
+		}
+	}
+	return best;
+}
+
+//Generates the children of a node and evaluates it. Returns the value of the position for the side to move.
+//Positions that are drawn or have no legal moves become terminal nodes. Below the root, a single repetition
+//counts as a draw, since the side that repeated could have chosen to do so again
+template<Color Us>
+float Search::expand(Position& p, Node& node, bool is_root, PRNG& rng) {
+	MoveList<Us> list(p);
+
+	if (list.size() == 0 || p.is_fifty_move_draw() || p.insufficient_material() ||
+		p.is_repetition(is_root ? 2 : 1) || p.ply() >= MAX_GAME_PLY - 1) {
+		node.terminal_value = list.size() == 0 && p.checkers ? -1 : 0;
+		node.state.store(TERMINAL, std::memory_order_release);
+		return node.terminal_value;
+	}
+
+	float priors[218];
+	float v = evaluator(p, list.begin(), list.size(), priors, rng);
+
+	uint32_t first = arena->allocate(list.size());
+	if (first == NodeArena::NONE) {
+		stop = true;
+		node.state.store(UNEXPANDED, std::memory_order_release);
+		return v;
+	}
+
+	for (size_t i = 0; i < list.size(); i++)
+		(*arena)[first + i].init(list.begin()[i], priors[i]);
+	node.first_child = first;
+	node.num_children = list.size();
+	node.state.store(EXPANDED, std::memory_order_release);
+	return v;
+}
+
+//Walks from the root to a leaf, expands and evaluates it, and backs the value up the path. Returns false if
+//another thread was already expanding the leaf, in which case nothing is backed up
+bool Search::playout_once(Position& p, PRNG& rng, std::vector<uint32_t>& path, std::vector<Move>& moves) {
+	path.assign(1, ROOT);
+	moves.clear();
+	root().virtual_loss.fetch_add(1, std::memory_order_relaxed);
+
+	Node* node = &root();
+	uint8_t state;
+	while ((state = node->state.load(std::memory_order_acquire)) == EXPANDED) {
+		uint32_t child = select(*node);
+		node = &(*arena)[child];
+		node->virtual_loss.fetch_add(1, std::memory_order_relaxed);
+		path.push_back(child);
+		moves.push_back(node->move);
+
+		if (p.turn() == WHITE) p.play<WHITE>(node->move);
+		else p.play<BLACK>(node->move);
+	}
+
+	bool evaluated = true;
+	float v = 0;
+	if (state == TERMINAL) {
+		v = node->terminal_value;
+	} else if (state == UNEXPANDED && node->state.compare_exchange_strong(state, EXPANDING)) {
+		bool is_root = node == &root();
+		v = p.turn() == WHITE ? expand<WHITE>(p, *node, is_root, rng) : expand<BLACK>(p, *node, is_root, rng);
+	} else {
+		evaluated = false;
+	}
+
+	//The value is for the side to move at the leaf, and each node is scored for the side that moved into it
+	for (size_t i = path.size(); i-- > 0; ) {
+		Node& n = (*arena)[path[i]];
+		if (evaluated) {
+			v = -v;
+			add_value(n.value_sum, v);
+			n.visits.fetch_add(1, std::memory_order_relaxed);
+		}
+		n.virtual_loss.fetch_sub(1, std::memory_order_relaxed);
+	}
+
+	for (size_t i = moves.size(); i-- > 0; ) {
+		if (p.turn() == BLACK) p.undo<WHITE>(moves[i]);
+		else p.undo<BLACK>(moves[i]);
+	}
+	return evaluated;
+}
+
+void Search::worker(uint64_t limit, uint64_t seed) {
+	Position p = root_position;
+	PRNG rng(seed);
+	std::vector<uint32_t> path;
+	std::vector<Move> moves;
+
+	while (!stop.load(std::memory_order_relaxed) && root().state.load(std::memory_order_acquire) != TERMINAL) {
+		if (playout_once(p, rng, path, moves) && playouts.fetch_add(1, std::memory_order_relaxed) + 1 >= limit)
+			stop = true;
+	}
+}
+
+//Runs <limit> playouts from the root, spread over several threads
+void Search::run(uint64_t limit, int threads) {
+	static std::atomic<uint64_t> seed(0x9e3779b97f4a7c15ULL);
+	playouts = 0;
+	stop = false;
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(&Search::worker, this, limit, seed.fetch_add(0x2545f4914f6cdd1dULL));
+	for (std::thread& t : workers) t.join();
+}
+
+//Returns the most visited move at the root, or a null move if the game is over
+Move Search::best_move() {
+	if (root().state.load() != EXPANDED) return Move();
+
+	uint32_t best = root().first_child;
+	for (uint32_t i = best; i < root().first_child + root().num_children; i++)
+		if ((*arena)[i].visits > (*arena)[best].visits) best = i;
+	return (*arena)[best].move;
+}
+
+//Plays a move at the root. The subtree below the move is kept by copying it breadth-first into the spare
+//arena, which then becomes the arena of the search; the rest of the old tree is dropped. Returns the number
+//of nodes that were kept
+uint32_t Search::advance(Move m) {
+	uint32_t child = NodeArena::NONE;
+	if (root().state.load() == EXPANDED)
+		for (uint32_t i = root().first_child; i < root().first_child + root().num_children; i++)
+			if ((*arena)[i].move == m) child = i;
+
+	if (root_position.turn() == WHITE) root_position.play<WHITE>(m);
+	else root_position.play<BLACK>(m);
+
+	NodeArena& from = *arena;
+	NodeArena& to = *spare;
+	to.clear();
+	to.allocate(1);
+
+	if (child == NodeArena::NONE) {
+		to[ROOT].init(m, 1);
+	} else {
+		std::vector<std::pair<uint32_t, uint32_t>> queue(1, { child, ROOT });
+
+		for (size_t i = 0; i < queue.size(); i++) {
+			Node& src = from[queue[i].first];
+			Node& dst = to[queue[i].second];
+			dst.init(src.move, src.prior);
+			dst.visits.store(src.visits.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst.value_sum.store(src.value_sum.load(std::memory_order_relaxed), std::memory_order_relaxed);
+			dst.terminal_value = src.terminal_value;
+
+			uint8_t state = src.state.load(std::memory_order_relaxed);
+			//Terminal nodes are evaluated again, since whether a repetition ends the game depends on the root
+			dst.state.store(state == EXPANDED ? EXPANDED : UNEXPANDED, std::memory_order_relaxed);
+			if (state != EXPANDED) continue;
+
+			dst.num_children = src.num_children;
+			dst.first_child = to.allocate(src.num_children);
+			for (uint32_t c = 0; c < src.num_children; c++)
+				queue.push_back({ src.first_child + c, dst.first_child + c });
+		}
+	}
+
+	std::swap(arena, spare);
+	return nodes();
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	const uint64_t limit = argc > 1 ? std::stoull(argv[1]) : 10000;
+	const int threads = std::max(argc > 2 ? std::stoi(argv[2]) : int(std::thread::hardware_concurrency()), 1);
+	const int max_moves = argc > 3 ? std::stoi(argv[3]) : 20;
+	const std::string fen = argc > 4 ? argv[4] : DEFAULT_FEN;
+
+	//Each expansion allocates at most 218 nodes, so the arena never fills during a search of <limit> playouts
+	//when the tree is not reused. Reused nodes take up the rest
+	const uint32_t capacity = uint32_t(std::min<uint64_t>(2 * 218 * (limit + threads) + 1, 1u << 28));
+	Search search(fen, capacity);
+
+	uint64_t total_playouts = 0;
+	double total_seconds = 0;
+	uint32_t peak_nodes = 0;
+
+	std::cout << std::fixed << std::setprecision(3);
+	for (int i = 0; i < max_moves; i++) {
+		auto begin = std::chrono::steady_clock::now();
+		search.run(limit, threads);
+		double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+		Move m = search.best_move();
+		if (m == Move()) {
+			std::cout << "Game over\n";
+			break;
+		}
+
+		uint64_t n = search.root().visits.load();
+		total_playouts += limit;
+		total_seconds += seconds;
+		peak_nodes = std::max(peak_nodes, search.nodes());
+
+		std::cout << "Move " << std::setw(3) << i + 1 << ": " << m
+			<< "  root visits " << n << "  nodes " << search.nodes()
+			<< "  playouts/s " << (uint64_t) (limit / seconds);
+		uint32_t kept = search.advance(m);
+		std::cout << "  reused " << kept << "\n";
+	}
+
+	std::cout << "\nPlayouts/s: " << (uint64_t) (total_playouts / total_seconds)
+		<< "\nBytes per node: " << sizeof(Node)
+		<< "\nPeak nodes: " << peak_nodes << " (" << peak_nodes * sizeof(Node) / (1 << 20) << " MB)"
+		<< "\nArena capacity: " << capacity << " nodes x 2\n";
+	return 0;
+}
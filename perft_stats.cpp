@@ -0,0 +1,203 @@
+#include <iostream>
+#include <iomanip>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <string>
+#include <thread>
+#include <vector>
+#include "surge.h"
+
+//Runs perft with the full breakdown of the leaves (captures, en passant, castles, promotions, checks, discovered
+//and double checks, checkmates) on several threads, then a bulk-counted perft of the same tree for comparison. The
+//tree is split into the subtrees of the first two plies, which threads take one at a time, so that a few large
+//subtrees do not leave the other threads idle. Each thread keeps its own counters, which are merged at the end.
+//
+//Usage:
+//	perft_stats <depth> [threads] [fen]
+//	perft_stats --check
+//
+//The depth is at least 2. --check compares the statistics with a reference which plays every leaf move, on a few
+//positions which exercise the special moves
+
+//A subtree below the first two plies. <second> is a null move when the depth is too small to split twice, and the
+//depth is at least 2
+struct Subtree {
+	Move first, second;
+};
+
+template<Color Us>
+std::vector<Subtree> split(Position& p, unsigned int depth) {
+	std::vector<Subtree> subtrees;
+	MoveList<Us> list(p);
+	for (Move m : list) {
+		if (depth < 3) {
+			subtrees.push_back({ m, Move() });
+			continue;
+		}
+		p.play<Us>(m);
+		MoveList<~Us> replies(p);
+		for (Move r : replies) subtrees.push_back({ m, r });
+		p.undo<Us>(m);
+	}
+	return subtrees;
+}
+
+//Counts one subtree, either with statistics or bulk-counted
+template<Color Us>
+void count(Position& p, const Subtree& t, unsigned int depth, PerftStats& stats, bool bulk) {
+	p.play<Us>(t.first);
+	if (t.second.to_from() == 0) {
+		if (bulk) stats.nodes += perft<~Us>(p, depth - 1);
+		else perft_stats<~Us>(p, depth - 1, stats);
+	} else {
+		p.play<~Us>(t.second);
+		if (bulk) stats.nodes += perft<Us>(p, depth - 2);
+		else perft_stats<Us>(p, depth - 2, stats);
+		p.undo<~Us>(t.second);
+	}
+	p.undo<Us>(t.first);
+}
+
+//Computes the same statistics as perft_stats() by playing every leaf move and generating the replies
+template<Color Us>
+void reference_stats(Position& p, unsigned int depth, PerftStats& stats) {
+	constexpr Color Them = ~Us;
+	MoveList<Us> list(p);
+	for (Move m : list) {
+		p.play<Us>(m);
+		if (depth > 1) {
+			reference_stats<Them>(p, depth - 1, stats);
+			p.undo<Us>(m);
+			continue;
+		}
+
+		stats.nodes++;
+		stats.captures += m.is_capture();
+		stats.en_passants += m.flags() == EN_PASSANT;
+		stats.castles += m.flags() == OO || m.flags() == OOO;
+		stats.promotions += m.is_promotion();
+
+		const Square king = bsf(p.bitboard_of(Them, KING));
+		const Bitboard checkers = p.attackers_from<Us>(king, p.all_pieces<WHITE>() | p.all_pieces<BLACK>());
+		if (checkers) {
+			const Square moved = m.flags() == OO ? (Us == WHITE ? f1 : f8) :
+				m.flags() == OOO ? (Us == WHITE ? d1 : d8) : m.to();
+			const bool double_check = (checkers & (checkers - 1)) != 0;
+			stats.checks++;
+			stats.discovered_checks += !double_check && !(checkers & SQUARE_BB[moved]);
+			stats.double_checks += double_check;
+			stats.checkmates += MoveList<Them>(p).size() == 0;
+		}
+		p.undo<Us>(m);
+	}
+}
+
+bool same_stats(const PerftStats& a, const PerftStats& b) {
+	return a.nodes == b.nodes && a.captures == b.captures && a.en_passants == b.en_passants &&
+		a.castles == b.castles && a.promotions == b.promotions && a.checks == b.checks &&
+		a.discovered_checks == b.discovered_checks && a.double_checks == b.double_checks &&
+		a.checkmates == b.checkmates;
+}
+
+//Compares perft_stats() with reference_stats() on positions with castling, en passant, promotions and mates. The
+//first position has a checking double push which en passant gets out of, so it is not a mate
+struct CheckPosition {
+	std::string fen;
+	unsigned int depth;
+};
+
+int check() {
+	const CheckPosition positions[] = {
+		{ "8/3Q4/7R/k7/2p5/3N4/1P6/7K w - - 0 1", 2 },
+		{ DEFAULT_FEN, 5 },
+		{ "r3k2r/p1ppqpb1/bn2pnp1/3PN3/1p2P3/2N2Q1p/PPPBBPPP/R3K2R w KQkq - 0 1", 4 },
+		{ "8/2p5/3p4/KP5r/1R3p1k/8/4P1P1/8 w - - 0 1", 5 },
+		{ "r3k2r/Pppp1ppp/1b3nbN/nP6/BBP1P3/q4N2/Pp1P2PP/R2Q1RK1 w kq - 0 1", 4 },
+		{ "rnbq1k1r/pp1Pbppp/2p5/8/2B5/8/PPP1NnPP/RNBQK2R w KQ - 1 8", 4 },
+	};
+
+	int failures = 0;
+	for (const CheckPosition& position : positions) {
+		std::unique_ptr<Position> p(new Position(position.fen));
+		for (unsigned int depth = 1; depth <= position.depth; depth++) {
+			PerftStats stats, reference;
+			if (p->turn() == WHITE) {
+				perft_stats<WHITE>(*p, depth, stats);
+				reference_stats<WHITE>(*p, depth, reference);
+			} else {
+				perft_stats<BLACK>(*p, depth, stats);
+				reference_stats<BLACK>(*p, depth, reference);
+			}
+			if (same_stats(stats, reference)) continue;
+
+			std::cout << position.fen << ", depth " << depth << "\n\nperft_stats:\n" << stats
+				<< "\nReference:\n" << reference << "\n";
+			failures++;
+		}
+	}
+
+	std::cout << (failures ? "FAILED\n" : "All statistics match the reference\n");
+	return failures ? 1 : 0;
+}
+
+//Counts all subtrees on <threads> threads and returns the merged counters and the time taken
+PerftStats run(const Position& root, const std::vector<Subtree>& subtrees, unsigned int depth, int threads,
+	bool bulk, double& seconds) {
+	std::atomic<size_t> next{ 0 };
+	std::vector<PerftStats> stats(threads);
+	auto begin = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++) {
+		workers.emplace_back([&, i] {
+			std::unique_ptr<Position> p(new Position(root));
+			for (size_t t; (t = next++) < subtrees.size(); ) {
+				if (p->turn() == WHITE) count<WHITE>(*p, subtrees[t], depth, stats[i], bulk);
+				else count<BLACK>(*p, subtrees[t], depth, stats[i], bulk);
+			}
+		});
+	}
+	for (std::thread& t : workers) t.join();
+	seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	PerftStats total;
+	for (const PerftStats& s : stats) total += s;
+	return total;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	if (argc < 2) {
+		std::cerr << "Usage: perft_stats <depth> [threads] [fen]\n       perft_stats --check\n";
+		return 1;
+	}
+	if (std::string(argv[1]) == "--check") return check();
+
+	const unsigned int depth = std::max(std::stoi(argv[1]), 2);
+	const int threads = std::max(argc > 2 ? std::stoi(argv[2]) : int(std::thread::hardware_concurrency()), 1);
+	std::unique_ptr<Position> root(new Position(argc > 3 ? argv[3] : DEFAULT_FEN));
+
+	const std::vector<Subtree> subtrees = root->turn() == WHITE ? split<WHITE>(*root, depth) :
+		split<BLACK>(*root, depth);
+
+	double stats_time, bulk_time;
+	const PerftStats stats = run(*root, subtrees, depth, threads, false, stats_time);
+	const PerftStats bulk = run(*root, subtrees, depth, threads, true, bulk_time);
+
+	std::cout << *root << "\nperft(" << depth << ") on " << threads << " threads\n\n" << stats
+		<< std::fixed << std::setprecision(3)
+		<< "\nStatistics:          " << stats_time << "s, " << std::setprecision(0) << stats.nodes / stats_time
+		<< " NPS\nBulk count:          " << std::setprecision(3) << bulk_time << "s, " << std::setprecision(0)
+		<< bulk.nodes / bulk_time << " NPS\nSlowdown:            " << std::setprecision(2)
+		<< stats_time / bulk_time << "x\n";
+
+	if (bulk.nodes != stats.nodes) {
+		std::cerr << "Node counts differ: " << stats.nodes << " with statistics, " << bulk.nodes << " bulk-counted\n";
+		return 1;
+	}
+	return 0;
+}
@@ -0,0 +1,78 @@
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <thread>
+#include <vector>
+
+//Random games are often longer than 256 plies, so the history has room for a full game
+#define SURGE_MAX_GAME_PLY 1024
+#include "surge.h"
+
+//Plays random games from a position on several threads and reports the results and the throughput.
+//
+//Usage:
+//	playout [games] [threads] [fen]
+
+struct PlayoutStats {
+	unsigned long long games = 0;
+	unsigned long long plies = 0;
+	unsigned long long results[3] = {};
+	unsigned long long terminations[6] = {};
+};
+
+const char* TERMINATION_STR[] = {
+	"Checkmate", "Stalemate", "50-move rule", "Threefold repetition", "Insufficient material", "Ply limit"
+};
+
+//Plays <games> games from the position. Each thread has its own copy of the position and its own generator
+void run_playouts(const std::string& fen, unsigned long long games, uint64_t seed, PlayoutStats& stats) {
+	Position p(fen);
+	PRNG rng(seed);
+
+	for (unsigned long long i = 0; i < games; i++) {
+		Playout r = playout(p, rng);
+		stats.games++;
+		stats.plies += r.plies;
+		stats.results[r.result]++;
+		stats.terminations[r.termination]++;
+	}
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	const unsigned long long games = argc > 1 ? std::stoull(argv[1]) : 100000;
+	const int threads = std::max(argc > 2 ? std::stoi(argv[2]) : int(std::thread::hardware_concurrency()), 1);
+	const std::string fen = argc > 3 ? argv[3] : DEFAULT_FEN;
+
+	std::vector<PlayoutStats> stats(threads);
+	std::vector<std::thread> workers;
+
+	auto begin = std::chrono::steady_clock::now();
+	for (int i = 0; i < threads; i++)
+		workers.emplace_back(run_playouts, fen, games / threads + (i < int(games % threads)),
+			0x9e3779b97f4a7c15ULL * (i + 1), std::ref(stats[i]));
+	for (std::thread& t : workers) t.join();
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	PlayoutStats total;
+	for (const PlayoutStats& s : stats) {
+		total.games += s.games;
+		total.plies += s.plies;
+		for (int i = 0; i < 3; i++) total.results[i] += s.results[i];
+		for (int i = 0; i < 6; i++) total.terminations[i] += s.terminations[i];
+	}
+
+	std::cout << std::fixed << std::setprecision(1)
+		<< "Games: " << total.games << "  Plies: " << total.plies
+		<< "  Average length: " << double(total.plies) / std::max(total.games, 1ULL) << "\n"
+		<< "White wins: " << total.results[WHITE_WINS] << "  Black wins: " << total.results[BLACK_WINS]
+		<< "  Draws: " << total.results[DRAW] << "\n";
+	for (int i = 0; i < 6; i++)
+		std::cout << std::setw(24) << std::left << TERMINATION_STR[i] << total.terminations[i] << "\n";
+	std::cout << "\nTime: " << seconds << "s  Games/s: " << (unsigned long long) (total.games / seconds)
+		<< "  Plies/s: " << (unsigned long long) (total.plies / seconds) << "\n";
+	return 0;
+}
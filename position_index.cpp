@@ -0,0 +1,484 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <fstream>
+#include <memory>
+#include <queue>
+#include <random>
+#include <thread>
+#include "position_index.h"
+
+//Builds a position index from a PGN file, and queries and benchmarks it. Games are replayed with play<C>, moves
+//being matched against the legal moves from their SAN. The records of each position are collected in a buffer of
+//bounded size, which is sorted on a second thread while the next one is filled and written to disk as a sorted
+//run. The runs are then merged into the blocks of the index.
+//
+//Usage:
+//	position_index build <pgn> <index> [memory in MB] [temporary directory]
+//	position_index query <index> <fen>
+//	position_index bench <index> [queries]
+
+using namespace position_index;
+
+struct Record {
+	uint64_t hash;
+	uint32_t game;
+	uint16_t ply;
+	uint16_t move;
+};
+
+inline bool operator<(const Record& a, const Record& b) {
+	return a.hash != b.hash ? a.hash < b.hash : a.game != b.game ? a.game < b.game : a.ply < b.ply;
+}
+
+//Returns the legal move written in SAN, such as "Nbd7", "exd5", "e8=Q+" or "O-O", or a null move if there is none
+template<Color Us>
+Move parse_san(Position& p, const std::string& san) {
+	size_t end = san.size();
+	while (end > 0 && strchr("+#!?", san[end - 1])) end--;
+
+	MoveList<Us> list(p);
+	if (san[0] == 'O' || san[0] == '0') {
+		const MoveFlags f = end == 3 ? OO : OOO;
+		for (Move m : list)
+			if (m.flags() == f) return m;
+		return Move();
+	}
+
+	int promotion = -1;
+	if (end > 2 && strchr("NBRQ", san[end - 1])) {
+		promotion = int(PIECE_STR.find(san[--end]));
+		if (san[end - 1] == '=') end--;
+	}
+	if (end < 2 || san[end - 2] < 'a' || san[end - 2] > 'h' || san[end - 1] < '1' || san[end - 1] > '8')
+		return Move();
+
+	const PieceType pt = strchr("NBRQK", san[0]) ? PieceType(PIECE_STR.find(san[0])) : PAWN;
+	const Square to = create_square(File(san[end - 2] - 'a'), Rank(san[end - 1] - '1'));
+	int from_file = -1, from_rank = -1;
+	for (size_t i = pt == PAWN ? 0 : 1; i + 2 < end; i++) {
+		if (san[i] >= 'a' && san[i] <= 'h') from_file = san[i] - 'a';
+		else if (san[i] >= '1' && san[i] <= '8') from_rank = san[i] - '1';
+	}
+
+	for (Move m : list) {
+		if (m.to() != to || m.flags() == OO || m.flags() == OOO) continue;
+		if (type_of(p.at(m.from())) != pt) continue;
+		if (from_file >= 0 && file_of(m.from()) != from_file) continue;
+		if (from_rank >= 0 && rank_of(m.from()) != from_rank) continue;
+		if (m.is_promotion() ? m.promotion_type() != promotion : promotion >= 0) continue;
+		return m;
+	}
+	return Move();
+}
+
+//Reads the games of a PGN file one at a time. Tags, comments, variations, move numbers and NAGs are skipped
+class PgnReader {
+	std::ifstream in;
+	std::string pending;
+	uint64_t offset = 0, pending_offset = 0;
+
+public:
+	explicit PgnReader(const std::string& path) : in(path) {}
+
+	bool good() const { return bool(in); }
+
+	//Reads the next game into its FEN (the start position unless there is a FEN tag), moves and result. Returns
+	//false at the end of the file
+	bool next(std::string& fen, std::vector<std::string>& moves, uint8_t& result, uint64_t& game_offset) {
+		fen = DEFAULT_FEN;
+		moves.clear();
+		result = UNKNOWN_RESULT;
+		bool started = false, in_moves = false;
+		int depth = 0;
+
+		std::string line;
+		uint64_t line_offset;
+		while (true) {
+			if (!pending.empty()) {
+				line.swap(pending);
+				pending.clear();
+				line_offset = pending_offset;
+			} else {
+				line_offset = offset;
+				if (!std::getline(in, line)) return started;
+				offset += line.size() + 1;
+			}
+
+			if (!line.empty() && line.back() == '\r') line.pop_back();
+			if (line.empty() && depth == 0) continue;
+
+			if (line[0] == '[' && depth == 0) {
+				//A tag after the moves starts the next game
+				if (in_moves) {
+					pending = line;
+					pending_offset = line_offset;
+					return true;
+				}
+				if (!started) game_offset = line_offset;
+				started = true;
+				if (line.compare(0, 5, "[FEN ") == 0) {
+					const size_t a = line.find('"'), b = line.rfind('"');
+					if (a != std::string::npos && b > a) fen = line.substr(a + 1, b - a - 1);
+				} else if (line.compare(0, 8, "[Result ") == 0) {
+					result = line.find("\"1-0\"") != std::string::npos ? uint8_t(WHITE_WINS) :
+						line.find("\"0-1\"") != std::string::npos ? uint8_t(BLACK_WINS) :
+						line.find("\"1/2-1/2\"") != std::string::npos ? uint8_t(DRAW) : UNKNOWN_RESULT;
+				}
+				continue;
+			}
+
+			if (!started) game_offset = line_offset;
+			started = in_moves = true;
+			std::string token;
+			for (size_t i = 0; i <= line.size(); i++) {
+				const char c = i < line.size() ? line[i] : ' ';
+				if (c == '{' || c == '(') depth++;
+				else if (c == '}' || c == ')') depth = std::max(depth - 1, 0);
+				else if (depth > 0) continue;
+				else if (c == ';') break;
+				else if (!isspace((unsigned char) c)) token += c;
+				else if (!token.empty()) {
+					if (token == "1-0" || token == "0-1" || token == "1/2-1/2" || token == "*") {
+						//The result ends the movetext of the game
+						std::string rest;
+						if (i < line.size()) rest = line.substr(i);
+						if (rest.find_first_not_of(" \t") != std::string::npos) {
+							pending = rest;
+							pending_offset = line_offset + i;
+						}
+						return true;
+					}
+					//Move numbers such as "12." or "12...", possibly followed by the move
+					const size_t dots = token.find_last_of('.');
+					if (dots != std::string::npos) token = token.substr(dots + 1);
+					if (!token.empty() && token[0] != '$' && !isdigit((unsigned char) token[0])) moves.push_back(token);
+					token.clear();
+				}
+			}
+		}
+	}
+};
+
+//The state shared between the thread replaying games and the thread sorting and writing runs
+struct RunWriter {
+	std::string dir;
+	std::vector<std::string> runs;
+	std::thread sorter;
+
+	explicit RunWriter(const std::string& dir) : dir(dir) {}
+
+	void write(std::vector<Record>& buffer) {
+		if (sorter.joinable()) sorter.join();
+		const std::string path = dir + "/position_index.run" + std::to_string(runs.size());
+		runs.push_back(path);
+		sorter = std::thread([path](std::vector<Record> records) {
+			std::sort(records.begin(), records.end());
+			FILE* f = fopen(path.c_str(), "wb");
+			if (!f || fwrite(records.data(), sizeof(Record), records.size(), f) != records.size() || fclose(f) != 0) {
+				std::cerr << "Failed to write " << path << "\n";
+				exit(1);
+			}
+		}, std::move(buffer));
+		buffer.clear();
+	}
+
+	void finish() { if (sorter.joinable()) sorter.join(); }
+};
+
+//Reads a sorted run sequentially
+struct RunReader {
+	FILE* f;
+	std::vector<Record> buffer;
+	size_t pos = 0;
+
+	explicit RunReader(const std::string& path) : f(fopen(path.c_str(), "rb")), buffer(1 << 16) {
+		if (!f) {
+			std::cerr << "Failed to open " << path << "\n";
+			exit(1);
+		}
+		fill();
+	}
+
+	~RunReader() { fclose(f); }
+
+	void fill() {
+		buffer.resize(buffer.capacity());
+		buffer.resize(fread(buffer.data(), sizeof(Record), buffer.size(), f));
+		pos = 0;
+	}
+
+	inline bool empty() const { return buffer.empty(); }
+	inline const Record& top() const { return buffer[pos]; }
+	inline void pop() { if (++pos == buffer.size()) fill(); }
+};
+
+//Writes records in order as the blocks of an index, collecting the directory
+class BlockWriter {
+	FILE* f;
+	uint64_t offset;
+	std::vector<uint8_t> block;
+	uint8_t* p;
+	uint32_t count = 0;
+	uint64_t last_hash = 0;
+	uint32_t last_game = 0;
+
+public:
+	std::vector<DirectoryEntry> directory;
+	uint64_t records = 0;
+
+	BlockWriter(FILE* f, uint64_t offset) : f(f), offset(offset), block(BLOCK_RECORDS * 24) { p = block.data(); }
+
+	void add(const Record& r) {
+		if (count == 0) {
+			directory.push_back({ r.hash, offset });
+			last_hash = r.hash;
+		}
+
+		const uint64_t delta = r.hash - last_hash;
+		p = write_varint(p, delta);
+		p = write_varint(p, delta || count == 0 ? r.game : r.game - last_game);
+		p = write_varint(p, r.ply);
+		*p++ = uint8_t(r.move);
+		*p++ = uint8_t(r.move >> 8);
+		last_hash = r.hash;
+		last_game = r.game;
+		records++;
+		if (++count == BLOCK_RECORDS) flush();
+	}
+
+	void flush() {
+		if (count == 0) return;
+		const size_t n = p - block.data();
+		if (fwrite(block.data(), 1, n, f) != n) {
+			std::cerr << "Failed to write the index\n";
+			exit(1);
+		}
+		offset += n;
+		p = block.data();
+		count = 0;
+	}
+
+	//Writes the last block and the sentinel entry of the directory, and returns the end of the blocks
+	uint64_t finish() {
+		flush();
+		directory.push_back({ UINT64_MAX, offset });
+		return offset;
+	}
+};
+
+//Replays a game and appends a record for each of its positions. Stops at the first move that is not legal, and
+//returns false if there was one. Games longer than the history of a Position continue from the FEN of the current
+//position, since only the hashes are needed
+bool replay_game(const std::string& fen, const std::vector<std::string>& moves, uint32_t game,
+	std::unique_ptr<Position>& p, std::vector<Record>& out) {
+	*p = Position(fen);
+
+	const size_t n = std::min<size_t>(moves.size(), UINT16_MAX);
+	for (size_t i = 0; i <= n; i++) {
+		if (p->ply() >= MAX_GAME_PLY - 1) *p = Position(p->fen());
+		Move m;
+		if (i < n) m = p->turn() == WHITE ? parse_san<WHITE>(*p, moves[i]) : parse_san<BLACK>(*p, moves[i]);
+		out.push_back({ p->get_hash(), game, uint16_t(i), uint16_t(m.to_from()) });
+		if (i == n) break;
+		if (m.to_from() == 0) return false;
+		if (p->turn() == WHITE) p->play<WHITE>(m);
+		else p->play<BLACK>(m);
+	}
+	return true;
+}
+
+int build(const std::string& pgn, const std::string& path, size_t memory, const std::string& dir) {
+	using namespace std::chrono;
+	auto begin = steady_clock::now();
+
+	PgnReader reader(pgn);
+	if (!reader.good()) {
+		std::cerr << "Failed to open " << pgn << "\n";
+		return 1;
+	}
+
+	//Two buffers are in memory at once, one being filled and one being sorted
+	const size_t buffer_records = std::max<size_t>(memory / 2 / sizeof(Record), 1024);
+	std::vector<Record> buffer;
+	buffer.reserve(buffer_records + MAX_GAME_PLY);
+	RunWriter runs(dir);
+	std::vector<uint64_t> pgn_offsets;
+	std::vector<uint8_t> results;
+	std::unique_ptr<Position> p(new Position());
+
+	std::string fen;
+	std::vector<std::string> moves;
+	uint8_t result;
+	uint64_t offset = 0, illegal = 0;
+	while (reader.next(fen, moves, result, offset)) {
+		const uint32_t game = uint32_t(results.size());
+		if (!replay_game(fen, moves, game, p, buffer)) illegal++;
+		pgn_offsets.push_back(offset);
+		results.push_back(result);
+
+		if (buffer.size() >= buffer_records) {
+			runs.write(buffer);
+			buffer.reserve(buffer_records + MAX_GAME_PLY);
+		}
+	}
+	if (!buffer.empty()) runs.write(buffer);
+	runs.finish();
+	auto replayed = steady_clock::now();
+
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f) {
+		std::cerr << "Failed to write " << path << "\n";
+		return 1;
+	}
+	IndexHeader h = {};
+	memcpy(h.magic, "SURGEPI", 8);
+	h.version = FILE_VERSION;
+	h.block_records = BLOCK_RECORDS;
+	fwrite(&h, sizeof(h), 1, f);
+
+	//Merges the runs into blocks
+	std::vector<std::unique_ptr<RunReader>> readers;
+	for (const std::string& run : runs.runs) readers.emplace_back(new RunReader(run));
+	auto greater = [&](size_t a, size_t b) { return readers[b]->top() < readers[a]->top(); };
+	std::priority_queue<size_t, std::vector<size_t>, decltype(greater)> heads(greater);
+	for (size_t i = 0; i < readers.size(); i++)
+		if (!readers[i]->empty()) heads.push(i);
+
+	BlockWriter blocks(f, sizeof(h));
+	while (!heads.empty()) {
+		const size_t i = heads.top();
+		heads.pop();
+		blocks.add(readers[i]->top());
+		readers[i]->pop();
+		if (!readers[i]->empty()) heads.push(i);
+	}
+	readers.clear();
+	for (const std::string& run : runs.runs) unlink(run.c_str());
+
+	h.records = blocks.records;
+	h.directory_offset = blocks.finish();
+	h.blocks = blocks.directory.size() - 1;
+	h.games = results.size();
+	h.games_offset = h.directory_offset + blocks.directory.size() * sizeof(DirectoryEntry);
+	fwrite(blocks.directory.data(), sizeof(DirectoryEntry), blocks.directory.size(), f);
+	fwrite(pgn_offsets.data(), sizeof(uint64_t), pgn_offsets.size(), f);
+	fwrite(results.data(), 1, results.size(), f);
+	fseek(f, 0, SEEK_SET);
+	fwrite(&h, sizeof(h), 1, f);
+	if (ferror(f) || fclose(f) != 0) {
+		std::cerr << "Failed to write " << path << "\n";
+		return 1;
+	}
+
+	auto merged = steady_clock::now();
+	const double replay_time = duration<double>(replayed - begin).count();
+	const double merge_time = duration<double>(merged - replayed).count();
+	const uint64_t bytes = h.games_offset + h.games * (sizeof(uint64_t) + 1);
+	std::cout << "Games:              " << h.games << " (" << illegal << " stopped at an illegal move)"
+		<< "\nPositions:          " << h.records
+		<< "\nRuns:               " << runs.runs.size()
+		<< "\nIndex size:         " << bytes << " bytes, " << std::fixed << std::setprecision(2)
+		<< double(bytes) / std::max<uint64_t>(h.records, 1) << " bytes per position"
+		<< "\nReplay and sort:    " << replay_time << "s, " << std::setprecision(0) << h.games / replay_time
+		<< " games/s, " << h.records / replay_time << " positions/s"
+		<< "\nMerge:              " << std::setprecision(2) << merge_time << "s"
+		<< "\nTotal:              " << replay_time + merge_time << "s\n";
+	return 0;
+}
+
+const char* RESULT_STR[NRESULTS] = { "1-0", "0-1", "1/2-1/2", "*" };
+
+int query(const std::string& path, const std::string& fen) {
+	PositionIndex index;
+	if (!index.open(path)) {
+		std::cerr << "Failed to open " << path << "\n";
+		return 1;
+	}
+
+	std::unique_ptr<Position> p(new Position(fen));
+	QueryResult r;
+	auto begin = std::chrono::steady_clock::now();
+	index.query(*p, r);
+	const double us = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count();
+
+	std::cout << r.occurrences.size() << " occurrences, " << r.results[WHITE_WINS] << " " << RESULT_STR[WHITE_WINS]
+		<< ", " << r.results[DRAW] << " " << RESULT_STR[DRAW] << ", " << r.results[BLACK_WINS] << " "
+		<< RESULT_STR[BLACK_WINS] << ", " << r.results[UNKNOWN_RESULT] << " unknown (" << std::fixed
+		<< std::setprecision(1) << us << " us)\n\n";
+	for (const MoveStats& s : r.moves)
+		std::cout << std::setw(8) << (s.move.to_from() ? uci_move(s.move) : "(end)") << std::setw(10) << s.games << std::setw(10)
+			<< s.results[WHITE_WINS] << std::setw(10) << s.results[DRAW] << std::setw(10) << s.results[BLACK_WINS] << "\n";
+
+	std::cout << "\n    game  ply  result  pgn offset\n";
+	for (size_t i = 0; i < r.occurrences.size() && i < 20; i++) {
+		const Occurrence& o = r.occurrences[i];
+		std::cout << std::setw(8) << o.game << std::setw(5) << o.ply << std::setw(8)
+			<< RESULT_STR[index.result_of(o.game)] << std::setw(12) << index.pgn_offset_of(o.game) << "\n";
+	}
+	if (r.occurrences.size() > 20) std::cout << "     ...\n";
+	return 0;
+}
+
+//Measures the latency of queries for hashes sampled from the index, and for random hashes which are not in it
+int bench(const std::string& path, size_t queries) {
+	PositionIndex index;
+	if (!index.open(path) || index.blocks() == 0) {
+		std::cerr << "Failed to open " << path << "\n";
+		return 1;
+	}
+
+	std::mt19937_64 rng(1);
+	std::vector<uint64_t> hits, misses;
+	for (size_t i = 0; i < queries; i++) {
+		BlockReader r = index.block(rng() % index.blocks());
+		const size_t skip = rng() % BLOCK_RECORDS;
+		uint64_t h = 0, hash = 0;
+		Occurrence o;
+		for (size_t j = 0; j <= skip && r.next(h, o); j++) hash = h;
+		hits.push_back(hash);
+		misses.push_back(rng());
+	}
+
+	std::cout << "Index: " << index.games() << " games, " << index.records() << " positions, " << index.bytes()
+		<< " bytes\n";
+	for (int pass = 0; pass < 2; pass++) {
+		const std::vector<uint64_t>& keys = pass == 0 ? hits : misses;
+		std::vector<double> latency;
+		std::vector<Occurrence> out;
+		uint64_t found = 0;
+		for (uint64_t key : keys) {
+			out.clear();
+			auto begin = std::chrono::steady_clock::now();
+			found += index.find(key, out);
+			latency.push_back(std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - begin).count());
+		}
+		std::sort(latency.begin(), latency.end());
+		double total = 0;
+		for (double l : latency) total += l;
+		std::cout << (pass == 0 ? "Present: " : "Absent:  ") << std::fixed << std::setprecision(2)
+			<< "mean " << total / latency.size() << " us, median " << latency[latency.size() / 2]
+			<< " us, p99 " << latency[latency.size() * 99 / 100] << " us, max " << latency.back()
+			<< " us, " << found << " occurrences\n";
+	}
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	const std::string command = argc > 1 ? argv[1] : "";
+	if (command == "build" && argc > 3)
+		return build(argv[2], argv[3], (argc > 4 ? std::stoull(argv[4]) : 1024) << 20, argc > 5 ? argv[5] : ".");
+	if (command == "query" && argc > 3) return query(argv[2], argv[3]);
+	if (command == "bench" && argc > 2) return bench(argv[2], argc > 3 ? std::stoull(argv[3]) : 100000);
+
+	std::cerr << "Usage: position_index build <pgn> <index> [memory in MB] [temporary directory]\n"
+		<< "       position_index query <index> <fen>\n"
+		<< "       position_index bench <index> [queries]\n";
+	return 1;
+}
@@ -0,0 +1,220 @@
+#pragma once
+
+#include <string>
+#include <vector>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "surge.h"
+
+//An index of the positions reached in a collection of games, built by position_index.cpp, and a reader that maps
+//the index read-only to answer "which games reached this position, and what was played from it".
+//
+//The index holds one record for every position of every game: the Zobrist hash of the position, the game, the ply
+//and the move played from the position (a null move at the end of the game). Records are sorted by hash, game and
+//ply, and stored in blocks of BLOCK_RECORDS records. A sparse directory holds the first hash and the offset of
+//each block, so a query is a binary search of the directory followed by decoding one or two blocks. Within a
+//block, each record is the difference from the previous hash, the game (as a difference from the previous game
+//when the hash is the same) and the ply as little-endian base-128 varints, then the move as 2 bytes. The result
+//and the offset in the PGN file of every game follow the directory.
+namespace position_index {
+
+const uint32_t FILE_VERSION = 1;
+const uint32_t BLOCK_RECORDS = 64;
+
+//The result of a game with no result, such as "*", alongside the values of GameResult
+const uint8_t UNKNOWN_RESULT = 3;
+const int NRESULTS = 4;
+
+struct IndexHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t block_records;
+	uint64_t records, blocks, games;
+	uint64_t directory_offset, games_offset;
+};
+
+//One entry per block, and one more whose offset is the end of the last block
+struct DirectoryEntry {
+	uint64_t first_hash;
+	uint64_t offset;
+};
+
+//A position as it occurred in a game
+struct Occurrence {
+	uint32_t game;
+	uint16_t ply;
+	Move move;
+};
+
+//How often a move was played from a position, and the results of those games
+struct MoveStats {
+	Move move;
+	uint32_t games = 0;
+	uint32_t results[NRESULTS] = {};
+};
+
+//The occurrences of a position, the results of the games which reached it, and the moves played from it, most
+//frequent first
+struct QueryResult {
+	std::vector<Occurrence> occurrences;
+	std::vector<MoveStats> moves;
+	uint32_t results[NRESULTS] = {};
+};
+
+inline uint8_t* write_varint(uint8_t* p, uint64_t v) {
+	while (v >= 128) {
+		*p++ = uint8_t(v | 128);
+		v >>= 7;
+	}
+	*p++ = uint8_t(v);
+	return p;
+}
+
+inline uint64_t read_varint(const uint8_t*& p) {
+	uint64_t v = 0;
+	for (int shift = 0; ; shift += 7) {
+		const uint8_t b = *p++;
+		v |= uint64_t(b & 127) << shift;
+		if (!(b & 128)) return v;
+	}
+}
+
+//Reads the records of one block in order
+class BlockReader {
+	const uint8_t* p;
+	uint64_t hash;
+	uint32_t game = 0;
+	uint32_t left;
+
+public:
+	BlockReader(const uint8_t* block, uint64_t first_hash, uint32_t records) :
+		p(block), hash(first_hash), left(records) {}
+
+	inline bool next(uint64_t& h, Occurrence& o) {
+		if (left == 0) return false;
+		left--;
+
+		const uint64_t delta = read_varint(p);
+		hash += delta;
+		game = delta ? uint32_t(read_varint(p)) : game + uint32_t(read_varint(p));
+		h = hash;
+		o.game = game;
+		o.ply = uint16_t(read_varint(p));
+		o.move = Move(uint16_t(p[0] | p[1] << 8));
+		p += 2;
+		return true;
+	}
+};
+
+//An index file mapped read-only. Queries are thread-safe
+class PositionIndex {
+	const uint8_t* data = nullptr;
+	size_t size = 0;
+	const IndexHeader* header = nullptr;
+	const DirectoryEntry* directory = nullptr;
+	const uint64_t* pgn_offsets = nullptr;
+	const uint8_t* results = nullptr;
+
+public:
+	PositionIndex() {}
+	PositionIndex(const PositionIndex&) = delete;
+	PositionIndex& operator=(const PositionIndex&) = delete;
+
+	~PositionIndex() { if (data) munmap((void*) data, size); }
+
+	bool open(const std::string& path) {
+		int fd = ::open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		void* p = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(IndexHeader))
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return false;
+
+		const IndexHeader* h = (const IndexHeader*) p;
+		if (memcmp(h->magic, "SURGEPI", 8) != 0 || h->version != FILE_VERSION ||
+			h->games_offset + h->games * (sizeof(uint64_t) + 1) > size_t(st.st_size)) {
+			munmap(p, st.st_size);
+			return false;
+		}
+
+		madvise(p, st.st_size, MADV_RANDOM);
+		data = (const uint8_t*) p;
+		size = st.st_size;
+		header = h;
+		directory = (const DirectoryEntry*) (data + h->directory_offset);
+		pgn_offsets = (const uint64_t*) (data + h->games_offset);
+		results = (const uint8_t*) (pgn_offsets + h->games);
+		return true;
+	}
+
+	inline uint64_t games() const { return header->games; }
+	inline uint64_t records() const { return header->records; }
+	inline uint64_t blocks() const { return header->blocks; }
+	inline size_t bytes() const { return size; }
+	inline uint8_t result_of(uint32_t game) const { return results[game]; }
+	inline uint64_t pgn_offset_of(uint32_t game) const { return pgn_offsets[game]; }
+
+	//Returns the records of the n-th block, for sampling and checking
+	inline BlockReader block(uint64_t n) const {
+		const uint32_t records = uint32_t(std::min<uint64_t>(header->block_records,
+			header->records - n * header->block_records));
+		return BlockReader(data + directory[n].offset, directory[n].first_hash, records);
+	}
+
+	//Appends every occurrence of a hash to out, and returns how many there are
+	size_t find(uint64_t hash, std::vector<Occurrence>& out) const {
+		//The first block starting after the hash. The hash can only be in the blocks before it, and since a run of
+		//equal hashes can cross a block boundary, the search starts one block earlier
+		size_t lo = 0, hi = header->blocks;
+		while (lo < hi) {
+			const size_t mid = (lo + hi) / 2;
+			if (directory[mid].first_hash < hash) lo = mid + 1;
+			else hi = mid;
+		}
+
+		const size_t found = out.size();
+		for (size_t b = lo > 0 ? lo - 1 : 0; b < header->blocks && directory[b].first_hash <= hash; b++) {
+			BlockReader r = block(b);
+			uint64_t h;
+			Occurrence o;
+			while (r.next(h, o) && h <= hash)
+				if (h == hash) out.push_back(o);
+		}
+		return out.size() - found;
+	}
+
+	//Finds the games which reached a position, and sums the results of the games by the move played next
+	void query(const Position& p, QueryResult& r) const {
+		r = QueryResult();
+		find(p.get_hash(), r.occurrences);
+
+		for (size_t i = 0; i < r.occurrences.size(); i++) {
+			const Occurrence& o = r.occurrences[i];
+			const uint8_t result = results[o.game];
+			//A game which reaches the position again is only counted once in the results of the position
+			if (i == 0 || o.game != r.occurrences[i - 1].game) r.results[result]++;
+
+			auto it = std::find_if(r.moves.begin(), r.moves.end(),
+				[&](const MoveStats& s) { return s.move == o.move; });
+			if (it == r.moves.end()) {
+				r.moves.emplace_back();
+				it = r.moves.end() - 1;
+				it->move = o.move;
+			}
+			it->games++;
+			it->results[result]++;
+		}
+
+		std::sort(r.moves.begin(), r.moves.end(), [](const MoveStats& a, const MoveStats& b) {
+			return a.games > b.games;
+		});
+	}
+};
+
+}
@@ -1,3 +1,4 @@
+#pragma once
 
 
 #pragma warning(disable : 26812)
@@ -7,7 +8,11 @@
 #include <ostream>
 #include <sstream>
 #include <iostream>
+#include <iomanip>
 #include <vector>
+#include <algorithm>
+#include <cstring>
+#include <type_traits>
 
 const size_t NCOLORS = 2;
 enum Color : int {
@@ -188,7 +193,16 @@ public:
 	inline MoveFlags flags() const { return MoveFlags((move >> 12) & 0xf); }
 
 	inline bool is_capture() const {
-		return (move >> 12) & CAPTURES;
+		return (move >> 12) & CAPTURE;
+	}
+
+	inline bool is_promotion() const {
+		return (move >> 12) & PR_KNIGHT;
+	}
+
+	//The piece type that a pawn promotes to. Only valid for promotion moves
+	inline PieceType promotion_type() const {
+		return PieceType(KNIGHT + ((move >> 12) & 0b0011));
 	}
 
 	void operator=(Move m) { move = m.move; }
@@ -232,6 +246,72 @@ inline Move* make<PROMOTION_CAPTURES>(Square from, Bitboard to, Move* list) {
 }
 
 extern std::ostream& operator<<(std::ostream& os, const Move& m);
+extern std::string uci_move(Move m);
+
+//Move visitors consume legal moves as Position::generate_legals() produces them, without the moves having to be
+//written to an array and read back first. A visitor provides two member functions:
+//	bool visit(Move m)                                         - receives a single move
+//	template<MoveFlags F> bool visit(Square from, Bitboard to) - receives all moves (from, s) with flags F, where s
+//	                                                             is a square in the bitboard to, with F = PROMOTIONS
+//	                                                             or PROMOTION_CAPTURES standing for all 4 promotions
+//Returning false from either function stops move generation.
+
+//Passes each move in a batch to visit(Move), returning false as soon as the visitor does
+template<MoveFlags F, typename Visitor>
+inline bool visit_each(Visitor& v, Square from, Bitboard to) {
+	Square s;
+	while (to) {
+		s = pop_lsb(&to);
+		if (F == PROMOTIONS || F == PROMOTION_CAPTURES) {
+			//One move is visited for each promotion piece
+			const int first = F == PROMOTIONS ? PR_KNIGHT : PC_KNIGHT;
+			for (int i = 0; i < 4; i++)
+				if (!v.visit(Move(from, s, MoveFlags(first + i)))) return false;
+		}
+		else if (!v.visit(Move(from, s, F))) return false;
+	}
+	return true;
+}
+
+//Writes moves to a move array. This is the visitor used by MoveList
+struct MoveWriter {
+	Move* list;
+
+	explicit MoveWriter(Move* list) : list(list) {}
+
+	inline bool visit(Move m) { *list++ = m; return true; }
+
+	template<MoveFlags F>
+	inline bool visit(Square from, Bitboard to) { list = make<F>(from, to, list); return true; }
+};
+
+//Counts moves without storing them. Batches are counted with a single population count
+struct MoveCounter {
+	size_t count;
+
+	MoveCounter() : count(0) {}
+
+	inline bool visit(Move) { count++; return true; }
+
+	template<MoveFlags F>
+	inline bool visit(Square, Bitboard to) {
+		count += (F == PROMOTIONS || F == PROMOTION_CAPTURES ? 4 : 1) * pop_count(to);
+		return true;
+	}
+};
+
+//Adapts a function object of the form bool f(Move) into a move visitor
+template<typename F>
+struct MoveFunctionVisitor {
+	F f;
+
+	explicit MoveFunctionVisitor(F f) : f(f) {}
+
+	inline bool visit(Move m) { return f(m); }
+
+	template<MoveFlags Flags>
+	inline bool visit(Square from, Bitboard to) { return visit_each<Flags>(*this, from, to); }
+};
 
 //The white king and kingside rook
 const Bitboard WHITE_OO_MASK = 0x90;
@@ -285,9 +365,9 @@ extern Bitboard sliding_attacks(Square square, Bitboard occ, Bitboard mask);
 
 extern Bitboard get_rook_attacks_for_init(Square square, Bitboard occ);
 extern const Bitboard ROOK_MAGICS[NSQUARES];
-extern Bitboard ROOK_ATTACK_MASKS[NSQUARES];
-extern int ROOK_ATTACK_SHIFTS[NSQUARES];
-extern Bitboard ROOK_ATTACKS[NSQUARES][4096];
+extern const Bitboard* ROOK_ATTACK_MASKS;
+extern const int* ROOK_ATTACK_SHIFTS;
+extern const Bitboard (*ROOK_ATTACKS)[4096];
 extern void initialise_rook_attacks();
 
 //gk extern constexpr Bitboard get_rook_attacks(Square square, Bitboard occ);
@@ -296,19 +376,19 @@ extern Bitboard get_xray_rook_attacks(Square square, Bitboard occ, Bitboard bloc
 
 extern Bitboard get_bishop_attacks_for_init(Square square, Bitboard occ);
 extern const Bitboard BISHOP_MAGICS[NSQUARES];
-extern Bitboard BISHOP_ATTACK_MASKS[NSQUARES];
-extern int BISHOP_ATTACK_SHIFTS[NSQUARES];
-extern Bitboard BISHOP_ATTACKS[NSQUARES][512];
+extern const Bitboard* BISHOP_ATTACK_MASKS;
+extern const int* BISHOP_ATTACK_SHIFTS;
+extern const Bitboard (*BISHOP_ATTACKS)[512];
 extern void initialise_bishop_attacks();
 
 //gk extern constexpr Bitboard get_bishop_attacks(Square square, Bitboard occ);
 extern Bitboard get_bishop_attacks(Square square, Bitboard occ);
 extern Bitboard get_xray_bishop_attacks(Square square, Bitboard occ, Bitboard blockers);
 
-extern Bitboard SQUARES_BETWEEN_BB[NSQUARES][NSQUARES];
-extern Bitboard LINE[NSQUARES][NSQUARES];
-extern Bitboard PAWN_ATTACKS[NCOLORS][NSQUARES];
-extern Bitboard PSEUDO_LEGAL_ATTACKS[NPIECE_TYPES][NSQUARES];
+extern const Bitboard (*SQUARES_BETWEEN_BB)[NSQUARES];
+extern const Bitboard (*LINE)[NSQUARES];
+extern const Bitboard (*PAWN_ATTACKS)[NSQUARES];
+extern const Bitboard (*PSEUDO_LEGAL_ATTACKS)[NSQUARES];
 
 extern void initialise_squares_between();
 extern void initialise_line();
@@ -341,6 +421,59 @@ constexpr Bitboard attacks(PieceType pt, Square s, Bitboard occ) {
 	}
 }
 
+//Returns all squares attacked by a set of diagonal and a set of orthogonal sliders, with one magic lookup per piece
+inline Bitboard slider_danger_magic(Bitboard diag, Bitboard orth, Bitboard occ) {
+	Bitboard attacked = 0;
+	while (diag) attacked |= attacks<BISHOP>(pop_lsb(&diag), occ);
+	while (orth) attacked |= attacks<ROOK>(pop_lsb(&orth), occ);
+	return attacked;
+}
+
+//Compiling with SURGE_AVX2 defined (and -mavx2) computes slider attacks with Kogge-Stone occluded fills, which
+//cover every slider at once. Each register holds 4 directions: north, east, north-east and north-west are shifted
+//left, and south, west, south-west and south-east are shifted right by the same amounts
+#ifdef SURGE_AVX2
+#include <immintrin.h>
+
+inline Bitboard slider_danger_avx2(Bitboard diag, Bitboard orth, Bitboard occ) {
+	const Bitboard not_a = ~MASK_FILE[AFILE], not_h = ~MASK_FILE[HFILE], empty = ~occ;
+	const __m256i shifts = _mm256_setr_epi64x(8, 1, 9, 7);
+	const __m256i left_wrap = _mm256_setr_epi64x(-1, not_a, not_a, not_h);
+	const __m256i right_wrap = _mm256_setr_epi64x(-1, not_h, not_h, not_a);
+	const __m256i sliders = _mm256_setr_epi64x(orth, orth, diag, diag);
+	const __m256i e = _mm256_set1_epi64x(empty);
+
+	__m256i l_gen = sliders, r_gen = sliders;
+	__m256i l_pro = _mm256_and_si256(e, left_wrap), r_pro = _mm256_and_si256(e, right_wrap);
+	__m256i s = shifts;
+
+	//Doubling the shift each step fills rays of up to 7 squares in 3 steps
+	for (int i = 0; i < 3; i++) {
+		l_gen = _mm256_or_si256(l_gen, _mm256_and_si256(l_pro, _mm256_sllv_epi64(l_gen, s)));
+		r_gen = _mm256_or_si256(r_gen, _mm256_and_si256(r_pro, _mm256_srlv_epi64(r_gen, s)));
+		l_pro = _mm256_and_si256(l_pro, _mm256_sllv_epi64(l_pro, s));
+		r_pro = _mm256_and_si256(r_pro, _mm256_srlv_epi64(r_pro, s));
+		s = _mm256_add_epi64(s, s);
+	}
+
+	//The attacks are the filled rays shifted by one more step, which includes the first blocker
+	const __m256i attacked = _mm256_or_si256(
+		_mm256_and_si256(_mm256_sllv_epi64(l_gen, shifts), left_wrap),
+		_mm256_and_si256(_mm256_srlv_epi64(r_gen, shifts), right_wrap));
+	const __m128i half = _mm_or_si128(_mm256_castsi256_si128(attacked), _mm256_extracti128_si256(attacked, 1));
+	return Bitboard(_mm_cvtsi128_si64(half) | _mm_extract_epi64(half, 1));
+}
+#endif
+
+//Returns all squares attacked by a set of diagonal and a set of orthogonal sliders
+inline Bitboard slider_danger(Bitboard diag, Bitboard orth, Bitboard occ) {
+#ifdef SURGE_AVX2
+	return slider_danger_avx2(diag, orth, occ);
+#else
+	return slider_danger_magic(diag, orth, occ);
+#endif
+}
+
 //Returns a bitboard containing pawn attacks from all pawns in the given bitboard
 template<Color C>
 constexpr Bitboard pawn_attacks(Bitboard p) {
@@ -356,8 +489,7 @@ constexpr Bitboard pawn_attacks(Square s) {
 
 #include <utility>
 
-//A psuedorandom number generator
-//Source: Stockfish
+//A psuedorandom number generator: Marsaglia's xorshift, with the output multiplier of Vigna's xorshift64*
 class PRNG {
 	uint64_t s;
 
@@ -380,10 +512,206 @@ public:
 };
 
 namespace zobrist {
-	extern uint64_t zobrist_table[NPIECES][NSQUARES];
+	extern const uint64_t (*zobrist_table)[NSQUARES];
+	extern uint64_t side_key;
+	extern const uint64_t* castling_keys;
+	extern const uint64_t* en_passant_keys;
 	extern void initialise_zobrist_keys();
+
+	//Cuckoo tables of the hash differences made by reversible moves, used to detect upcoming repetitions. Each
+	//key lives in one of two slots, taken from the top 13 bits and from bits 32-44 of the key
+	extern const uint64_t* cuckoo_keys;
+	extern const Move* cuckoo_moves;
+	inline int cuckoo_h1(uint64_t key) { return int(key >> 51); }
+	inline int cuckoo_h2(uint64_t key) { return int((key >> 32) & 0x1fff); }
+	extern void initialise_cuckoo_tables();
+
+	//Finds the reversible move whose hash difference is key. Returns false if there is none
+	inline bool cuckoo_lookup(uint64_t key, Move& m) {
+		for (int i : { cuckoo_h1(key), cuckoo_h2(key) })
+			if (cuckoo_keys[i] == key) {
+				m = cuckoo_moves[i];
+				return true;
+			}
+		return false;
+	}
+}
+
+//Storage for every table computed by initialise_all_databases() and zobrist::initialise_zobrist_keys(). The
+//tables are used through pointers which point into a static instance by default, or into a database file
+//mapped with map_databases(), so that processes on one host can share a single read-only copy. The file is
+//this struct written as is, and DATABASE_VERSION must be increased whenever its layout or contents change
+struct Databases {
+	//The rook table comes first, so that it fills exactly one 2 MB page when the tables are in large pages
+	Bitboard rook_attacks[NSQUARES][4096];
+	Bitboard bishop_attacks[NSQUARES][512];
+	Bitboard rook_attack_masks[NSQUARES];
+	Bitboard bishop_attack_masks[NSQUARES];
+	int rook_attack_shifts[NSQUARES];
+	int bishop_attack_shifts[NSQUARES];
+	Bitboard squares_between_bb[NSQUARES][NSQUARES];
+	Bitboard line[NSQUARES][NSQUARES];
+	Bitboard pawn_attacks[NCOLORS][NSQUARES];
+	Bitboard pseudo_legal_attacks[NPIECE_TYPES][NSQUARES];
+
+	uint64_t zobrist_table[NPIECES][NSQUARES];
+	uint64_t side_key;
+	uint64_t castling_keys[16];
+	uint64_t en_passant_keys[8];
+	uint64_t cuckoo_keys[8192];
+	Move cuckoo_moves[8192];
+
+	char magic[8];
+	uint32_t version;
+	uint32_t size;
+};
+
+const uint32_t DATABASE_VERSION = 2;
+
+extern bool save_databases(const std::string& path);
+extern bool map_databases(const std::string& path);
+extern bool initialise_shared_databases(const std::string& path);
+extern const Databases& databases();
+extern void use_databases(const Databases& db);
+extern bool move_databases_to_large_pages();
+
+const size_t LARGE_PAGE_SIZE = 2 * 1024 * 1024;
+
+//The kind of pages backing memory from allocate_large_pages()
+enum LargePages {
+	HUGETLB_PAGES, TRANSPARENT_HUGE_PAGES, SMALL_PAGES
+};
+
+extern void* allocate_large_pages(size_t size, LargePages* pages = nullptr);
+extern void free_large_pages(void* p, size_t size);
+
+//A zero-initialised array in large pages, for hash tables. Random probes into a table of many megabytes miss the
+//TLB on almost every access when it is in 4 KB pages
+template<typename T>
+class LargePageArray {
+	static_assert(std::is_trivially_copyable<T>::value, "Entries are zero-initialised and copied as bytes");
+
+	T* entries;
+	size_t n;
+	LargePages pages;
+
+public:
+	LargePageArray(size_t n = 0) : entries(nullptr), n(0), pages(SMALL_PAGES) { resize(n); }
+	~LargePageArray() { free_large_pages(entries, n * sizeof(T)); }
+
+	LargePageArray(const LargePageArray&) = delete;
+	LargePageArray& operator=(const LargePageArray&) = delete;
+
+	//Reallocates the array with <count> zeroed entries. The array is empty if the allocation fails
+	void resize(size_t count) {
+		free_large_pages(entries, n * sizeof(T));
+		entries = count ? (T*) allocate_large_pages(count * sizeof(T), &pages) : nullptr;
+		n = entries ? count : 0;
+	}
+
+	void clear() { if (n) memset((void*) entries, 0, n * sizeof(T)); }
+
+	inline T& operator[](size_t i) { return entries[i]; }
+	inline const T& operator[](size_t i) const { return entries[i]; }
+	inline size_t size() const { return n; }
+	inline LargePages backing() const { return pages; }
+};
+
+//Returns the castling rights which remain in an entry bitboard, as an index into zobrist::castling_keys
+inline int castling_rights(Bitboard entry) {
+	return (entry & WHITE_OO_MASK ? 0 : 1) | (entry & WHITE_OOO_MASK ? 0 : 2) |
+		(entry & BLACK_OO_MASK ? 0 : 4) | (entry & BLACK_OOO_MASK ? 0 : 8);
+}
+
+//Hot-path instrumentation for the move generator. Compiling with SURGE_STATS defined counts how often each path 
+//through generate_legals(), play() and undo() is taken, and also defining SURGE_STATS_TIMERS measures the cycles 
+//spent in each of them. Counts are kept per thread and merged on demand with stats::merged(). Without SURGE_STATS,
+//SURGE_COUNT and SURGE_TIME expand to nothing, so the generated code is unchanged
+#ifdef SURGE_STATS
+#include <atomic>
+#include <mutex>
+#if defined(SURGE_STATS_TIMERS) && (defined(__x86_64__) || defined(__i386__))
+#include <x86intrin.h>
+#endif
+
+namespace stats {
+	enum Counter : int {
+		GENERATE_LEGALS, DOUBLE_CHECK, SINGLE_CHECK_PAWN_KNIGHT, SINGLE_CHECK_SLIDER, NO_CHECK,
+		PINNED_PIECES, PINNED_PAWNS, EP_PSEUDO_PIN_TESTS, EP_PSEUDO_PINNED,
+		//One counter for each move type, indexed by PLAY + flags and UNDO + flags
+		PLAY, UNDO = PLAY + 16,
+		NCOUNTERS = UNDO + 16
+	};
+
+	enum Timer : int {
+		GENERATE_LEGALS_TIME, PLAY_TIME, UNDO_TIME,
+		NTIMERS
+	};
+
+	extern const char* COUNTER_STR[NCOUNTERS];
+	extern const char* TIMER_STR[NTIMERS];
+
+	//The counters of one thread. Only the owning thread writes to them, so relaxed loads and stores suffice and
+	//compile to plain increments, while other threads can still read them safely when merging
+	struct ThreadStats {
+		std::atomic<uint64_t> counters[NCOUNTERS];
+		std::atomic<uint64_t> cycles[NTIMERS];
+
+		ThreadStats();
+		~ThreadStats();
+	};
+
+	//A merged copy of the counters of all threads
+	struct Snapshot {
+		uint64_t counters[NCOUNTERS];
+		uint64_t cycles[NTIMERS];
+	};
+
+	inline ThreadStats& local() {
+		thread_local ThreadStats s;
+		return s;
+	}
+
+	inline void add(std::atomic<uint64_t>& c, uint64_t n) {
+		c.store(c.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+	}
+
+	inline void count(int c) { add(local().counters[c], 1); }
+
+	inline uint64_t now() {
+#if defined(SURGE_STATS_TIMERS) && (defined(__x86_64__) || defined(__i386__))
+		return __rdtsc();
+#else
+		return 0;
+#endif
+	}
+
+	//Adds the cycles spent in its scope to a timer
+	class ScopedTimer {
+	public:
+		explicit ScopedTimer(Timer t) : t(t), start(now()) {}
+		~ScopedTimer() { add(local().cycles[t], now() - start); }
+	private:
+		Timer t;
+		uint64_t start;
+	};
+
+	extern Snapshot merged();
+	extern void reset();
+	extern std::ostream& operator<<(std::ostream& os, const Snapshot& s);
 }
 
+#define SURGE_COUNT(c) stats::count(c)
+#ifdef SURGE_STATS_TIMERS
+#define SURGE_TIME(t) stats::ScopedTimer surge_timer_(t)
+#else
+#define SURGE_TIME(t) ((void) 0)
+#endif
+#else
+#define SURGE_COUNT(c) ((void) 0)
+#define SURGE_TIME(t) ((void) 0)
+#endif
+
 //Stores position information which cannot be recovered on undo-ing a move
 struct UndoInfo {
 	//The bitboard of squares on which pieces have either moved from, or have been moved to. Used for castling
@@ -397,11 +725,46 @@ struct UndoInfo {
 	//double pushed on the previous move
 	Square epsq;
 
-	constexpr UndoInfo() : entry(0), captured(NO_PIECE), epsq(NO_SQUARE) {}
+	//The number of plies since the last capture or pawn move, used for the 50-move rule
+	int halfmove;
+
+	//The zobrist hash of the position, used for repetition detection
+	uint64_t hash;
+
+	constexpr UndoInfo() : entry(0), captured(NO_PIECE), epsq(NO_SQUARE), halfmove(0), hash(0) {}
 	
-	//This preserves the entry bitboard across moves
-	UndoInfo(const UndoInfo& prev) : 
-		entry(prev.entry), captured(NO_PIECE), epsq(NO_SQUARE) {}
+	//Returns the information for the next ply. This preserves the entry bitboard and advances the halfmove clock
+	//across moves. (This is not done by the copy constructor, so that copies of a Position are exact)
+	constexpr UndoInfo next() const {
+		return UndoInfo(entry, halfmove + 1);
+	}
+
+private:
+	constexpr UndoInfo(Bitboard entry, int halfmove) :
+		entry(entry), captured(NO_PIECE), epsq(NO_SQUARE), halfmove(halfmove), hash(0) {}
+};
+
+//The number of plies of history a Position can hold. Every copy of a Position carries the whole history, so this
+//is kept small by default. Tools which play long games, such as random playouts, define SURGE_MAX_GAME_PLY before
+//including surge.h
+#ifndef SURGE_MAX_GAME_PLY
+#define SURGE_MAX_GAME_PLY 256
+#endif
+const int MAX_GAME_PLY = SURGE_MAX_GAME_PLY;
+
+//A position packed into 32 bytes, for storing large numbers of positions. The pieces on the occupied squares are 
+//listed from a1 to h8, two to a byte
+struct PackedPosition {
+	Bitboard occupied;
+	uint8_t pieces[16];
+	uint8_t turn;
+	//The castling rights, as returned by castling_rights()
+	uint8_t castling;
+	uint8_t epsq;
+	//The halfmove clock, up to 255
+	uint8_t halfmove;
+	uint16_t fullmove;
+	uint16_t reserved;
 };
 
 class Position {
@@ -417,13 +780,26 @@ private:
 	
 	//The current game ply (depth), incremented after each move 
 	int game_ply;
+
+	//The game ply of the position the Position was constructed from, counting from 2 (White's first move), so 
+	//that the fullmove number is (game_ply + start_ply) / 2
+	int start_ply;
 	
 	//The zobrist hash of the position, which can be incrementally updated and rolled back after each
 	//make/unmake
 	uint64_t hash;
+
+	//The zobrist hash of the pawns alone, which only changes when a pawn moves, is captured or promotes. It keys 
+	//caches of pawn structure evaluation
+	uint64_t pawn_hash;
+
+	//The number of pieces of each kind, and a zobrist key of these counts which identifies the material on the 
+	//board. The key XORs zobrist_table[pc][i] for the i-th piece of each kind, so it does not depend on the squares
+	uint8_t piece_count[NPIECES];
+	uint64_t material_hash;
 public:
 	//The history of non-recoverable information
-	UndoInfo history[256];
+	UndoInfo history[MAX_GAME_PLY];
 	
 	//The bitboard of enemy pieces that are currently attacking the king, updated whenever generate_moves()
 	//is called
@@ -437,8 +813,8 @@ public:
 //gk adapted order of initialization
 //gk	Position() : piece_bb{ 0 }, side_to_play(WHITE), game_ply(0), board{}, 
 //gk		hash(0), pinned(0), checkers(0) {
-	Position() : piece_bb{ 0 }, board{}, side_to_play(WHITE), game_ply(0),
-		hash(0), checkers(0), pinned(0) {
+	Position() : piece_bb{ 0 }, board{}, side_to_play(WHITE), game_ply(0), start_ply(2),
+		hash(0), pawn_hash(0), piece_count{}, material_hash(0), checkers(0), pinned(0) {
 		
 		//Sets all squares on the board as empty
 		for (int i = 0; i < 64; i++) board[i] = NO_PIECE;
@@ -457,13 +833,15 @@ public:
     }
 
     std::istringstream ss(fen.substr(fen.find(' ')));
-    unsigned char token;
+    std::string side, castling, ep;
+    int halfmove = 0, fullmove = 1;
 
-    ss >> token;
-    side_to_play = token == 'w' ? WHITE : BLACK;
+    ss >> side >> castling >> ep >> halfmove >> fullmove;
+    side_to_play = side == "w" ? WHITE : BLACK;
+    start_ply = 2 * fullmove + side_to_play;
 
     history[game_ply].entry = ALL_CASTLING_MASK;
-    while (ss >> token && !isspace(token)) {
+    for (char token : castling) {
       switch (token) {
       case 'K':
         history[game_ply].entry &= ~WHITE_OO_MASK;
@@ -479,6 +857,22 @@ public:
         break;
       }
     }
+
+    //The en passant square is only kept if one of our pawns can capture on it, so that positions which only
+    //differ by an unusable en passant square have the same hash
+    if (ep.size() == 2) {
+      Square s = create_square(File(ep[0] - 'a'), Rank(ep[1] - '1'));
+      if (PAWN_ATTACKS[~side_to_play][s] & bitboard_of(side_to_play, PAWN)) {
+        history[game_ply].epsq = s;
+        hash ^= zobrist::en_passant_keys[file_of(s)];
+      }
+    }
+
+    if (side_to_play == BLACK) hash ^= zobrist::side_key;
+    hash ^= zobrist::castling_keys[castling_rights(history[game_ply].entry)];
+
+    history[game_ply].halfmove = halfmove;
+    history[game_ply].hash = hash;
   }
 	//Places a piece on a particular square and updates the hash. Placing a piece on a square that is 
 	//already occupied is an error
@@ -486,11 +880,15 @@ public:
 		board[s] = pc;
 		piece_bb[pc] |= SQUARE_BB[s];
 		hash ^= zobrist::zobrist_table[pc][s];
+		if (type_of(pc) == PAWN) pawn_hash ^= zobrist::zobrist_table[pc][s];
+		material_hash ^= zobrist::zobrist_table[pc][piece_count[pc]++];
 	}
 
 	//Removes a piece from a particular square and updates the hash. 
 	inline void remove_piece(Square s) {
 		hash ^= zobrist::zobrist_table[board[s]][s];
+		if (type_of(board[s]) == PAWN) pawn_hash ^= zobrist::zobrist_table[board[s]][s];
+		material_hash ^= zobrist::zobrist_table[board[s]][--piece_count[board[s]]];
 		piece_bb[board[s]] &= ~SQUARE_BB[s];
 		board[s] = NO_PIECE;
 	}
@@ -500,6 +898,8 @@ public:
 
 	friend std::ostream& operator<<(std::ostream& os, const Position& p);
 	std::string fen() const;
+	PackedPosition pack() const;
+	void unpack(const PackedPosition& packed);
 
 	inline bool operator==(const Position& other) const { return hash == other.hash; }
 
@@ -509,6 +909,20 @@ public:
 	inline Color turn() const { return side_to_play; }
 	inline int ply() const { return game_ply; }
 	inline uint64_t get_hash() const { return hash; }
+	inline uint64_t get_pawn_hash() const { return pawn_hash; }
+	inline uint64_t get_material_hash() const { return material_hash; }
+	inline int count(Piece pc) const { return piece_count[pc]; }
+	inline int count(Color c, PieceType pt) const { return piece_count[make_piece(c, pt)]; }
+	uint64_t hash_after(Move m) const;
+	inline int halfmove_clock() const { return history[game_ply].halfmove; }
+
+	//Returns true if 100 plies have passed since the last capture or pawn move. Note that checkmate takes 
+	//precedence over the 50-move rule
+	inline bool is_fifty_move_draw() const { return history[game_ply].halfmove >= 100; }
+
+	bool is_repetition(int count = 1) const;
+	bool has_game_cycle(int ply) const;
+	bool insufficient_material() const;
 
 	template<Color C> inline Bitboard diagonal_sliders() const;
 	template<Color C> inline Bitboard orthogonal_sliders() const;
@@ -524,6 +938,20 @@ public:
 
 	template<Color Us>
 	Move *generate_legals(Move* list);
+
+	template<Color Us, typename Visitor>
+	bool generate_legals(Visitor& v);
+
+	template<Color Us> bool has_legal_move();
+
+	template<Color Us> bool is_pseudo_legal(Move m) const;
+	template<Color Us> bool is_legal(Move m);
+
+private:
+	template<Color Us>
+	inline void update_checkers_and_pinned(Square our_king, Bitboard us_bb, Bitboard them_bb, Bitboard all);
+
+	template<Color Us> inline bool king_has_escape(Square our_king, Bitboard all) const;
 };
 
 //Returns the bitboard of all bishops and queens of a given color
@@ -593,13 +1021,29 @@ Bitboard Position::blockers_to(Square s, Bitboard occ) const {
 //Plays a move in the position
 template<Color C>
 void Position::play(const Move m) {
+	SURGE_TIME(stats::PLAY_TIME);
 	side_to_play = ~side_to_play;
 	++game_ply;
-	history[game_ply] = UndoInfo(history[game_ply - 1]);
+	history[game_ply] = history[game_ply - 1].next();
+	hash ^= zobrist::side_key;
+
+	//The previous en passant square is no longer available
+	if (history[game_ply - 1].epsq != NO_SQUARE)
+		hash ^= zobrist::en_passant_keys[file_of(history[game_ply - 1].epsq)];
 
 	MoveFlags type = m.flags();
 	history[game_ply].entry |= SQUARE_BB[m.to()] | SQUARE_BB[m.from()];
 
+	//Update the castling rights if the king or a rook has moved, or a rook has been captured, for the first time
+	if ((history[game_ply].entry ^ history[game_ply - 1].entry) & ALL_CASTLING_MASK)
+		hash ^= zobrist::castling_keys[castling_rights(history[game_ply - 1].entry)] ^
+			zobrist::castling_keys[castling_rights(history[game_ply].entry)];
+
+	//Captures and pawn moves reset the halfmove clock
+	if (m.is_capture() || type_of(board[m.from()]) == PAWN)
+		history[game_ply].halfmove = 0;
+
+	SURGE_COUNT(stats::PLAY + type);
 	switch (type) {
 	case QUIET:
 		//The to square is guaranteed to be empty here
@@ -609,8 +1053,12 @@ void Position::play(const Move m) {
 		//The to square is guaranteed to be empty here
 		move_piece_quiet(m.from(), m.to());
 			
-		//This is the square behind the pawn that was double-pushed
-		history[game_ply].epsq = m.from() + relative_dir<C>(NORTH);
+		//This is the square behind the pawn that was double-pushed. It is only recorded if an enemy pawn 
+		//can capture on it
+		if (pawn_attacks<C>(m.from() + relative_dir<C>(NORTH)) & bitboard_of(~C, PAWN)) {
+			history[game_ply].epsq = m.from() + relative_dir<C>(NORTH);
+			hash ^= zobrist::en_passant_keys[file_of(m.from())];
+		}
 		break;
 	case OO:
 		if (C == WHITE) {
@@ -684,12 +1132,16 @@ void Position::play(const Move m) {
 		
 		break;
 	}
+
+	history[game_ply].hash = hash;
 }
 
 //Undos a move in the current position, rolling it back to the previous position
 template<Color C>
 void Position::undo(const Move m) {
+	SURGE_TIME(stats::UNDO_TIME);
 	MoveFlags type = m.flags();
+	SURGE_COUNT(stats::UNDO + type);
 	switch (type) {
 	case QUIET:
 		move_piece_quiet(m.to(), m.from());
@@ -742,11 +1194,96 @@ void Position::undo(const Move m) {
 
 	side_to_play = ~side_to_play;
 	--game_ply;
+
+	//The side, castling and en passant keys are restored along with the rest of the hash
+	hash = history[game_ply].hash;
 }
 
-//Generates all legal moves in a position for the given side. Advances the move pointer and returns it.
+//Returns the hash the position would have after a move, without playing it, so that hash table entries can be 
+//prefetched and children deduplicated before play(). It is the same as get_hash() after play()
+inline uint64_t Position::hash_after(const Move m) const {
+	const Square from = m.from(), to = m.to();
+	const MoveFlags type = m.flags();
+	const Piece pc = board[from];
+	uint64_t h = hash ^ zobrist::side_key;
+
+	if (history[game_ply].epsq != NO_SQUARE)
+		h ^= zobrist::en_passant_keys[file_of(history[game_ply].epsq)];
+
+	const Bitboard entry = history[game_ply].entry;
+	const Bitboard next = entry | SQUARE_BB[from] | SQUARE_BB[to];
+	if ((entry ^ next) & ALL_CASTLING_MASK)
+		h ^= zobrist::castling_keys[castling_rights(entry)] ^ zobrist::castling_keys[castling_rights(next)];
+
+	if (type == OO || type == OOO) {
+		//The king and rook squares are fixed, relative to the first rank of the side to move
+		const int rank = side_to_play == WHITE ? 0 : 56;
+		const Piece rook = make_piece(side_to_play, ROOK);
+		return h ^ zobrist::zobrist_table[pc][e1 + rank] ^ zobrist::zobrist_table[rook][(type == OO ? f1 : d1) + rank] ^
+			zobrist::zobrist_table[pc][(type == OO ? g1 : c1) + rank] ^ 
+			zobrist::zobrist_table[rook][(type == OO ? h1 : a1) + rank];
+	}
+
+	if (type == EN_PASSANT) {
+		const Square captured = create_square(file_of(to), rank_of(from));
+		h ^= zobrist::zobrist_table[board[captured]][captured];
+	} else if (m.is_capture()) {
+		h ^= zobrist::zobrist_table[board[to]][to];
+	}
+
+	h ^= zobrist::zobrist_table[pc][from] ^
+		zobrist::zobrist_table[m.is_promotion() ? make_piece(side_to_play, m.promotion_type()) : pc][to];
+
+	//As in play(), the en passant square is only recorded if an enemy pawn can capture on it
+	if (type == DOUBLE_PUSH) {
+		const Square ep = Square((from + to) / 2);
+		if (PAWN_ATTACKS[side_to_play][ep] & bitboard_of(~side_to_play, PAWN))
+			h ^= zobrist::en_passant_keys[file_of(ep)];
+	}
+
+	return h;
+}
+
+//Updates the bitboard of enemy pieces attacking our king, and the bitboard of our pieces pinned to it
 template<Color Us>
-Move* Position::generate_legals(Move* list) {
+inline void Position::update_checkers_and_pinned(Square our_king, Bitboard us_bb, Bitboard them_bb, Bitboard all) {
+	constexpr Color Them = ~Us;
+	Bitboard b1;
+	Square s;
+
+	//Checkers of each piece type are identified by:
+	//1. Projecting attacks FROM the king square
+	//2. Intersecting this bitboard with the enemy bitboard of that piece type
+	//gk additional parentheses
+	checkers = (attacks<KNIGHT>(our_king, all) & bitboard_of(Them, KNIGHT))
+		| (pawn_attacks<Us>(our_king) & bitboard_of(Them, PAWN));
+	
+	//Here, we identify slider checkers and pinners simultaneously, and candidates for such pinners 
+	//and checkers are represented by the bitboard <candidates>
+	//gk additional parentheses
+	Bitboard candidates = (attacks<ROOK>(our_king, them_bb) & orthogonal_sliders<Them>())
+		| (attacks<BISHOP>(our_king, them_bb) & diagonal_sliders<Them>());
+
+	pinned = 0;
+	while (candidates) {
+		s = pop_lsb(&candidates);
+		b1 = SQUARES_BETWEEN_BB[our_king][s] & us_bb;
+		
+		//Do the squares in between the enemy slider and our king contain any of our pieces?
+		//If not, add the slider to the checker bitboard
+		if (b1 == 0) checkers ^= SQUARE_BB[s];
+		//If there is only one of our pieces between them, add our piece to the pinned bitboard 
+		//gk additional parentheses
+		else if ((b1 & (b1 - 1)) == 0) pinned ^= b1;
+	}
+}
+
+//Generates all legal moves in a position for the given side, passing them to the visitor as they are generated.
+//Returns false if the visitor stopped move generation early, and true otherwise
+template<Color Us, typename Visitor>
+bool Position::generate_legals(Visitor& v) {
+	SURGE_TIME(stats::GENERATE_LEGALS_TIME);
+	SURGE_COUNT(stats::GENERATE_LEGALS);
 	constexpr Color Them = ~Us;
 
 	const Bitboard us_bb = all_pieces<Us>();
@@ -773,21 +1310,15 @@ Move* Position::generate_legals(Move* list) {
 	b1 = bitboard_of(Them, KNIGHT); 
 	while (b1) danger |= attacks<KNIGHT>(pop_lsb(&b1), all);
 	
-	b1 = their_diag_sliders;
-	//all ^ SQUARE_BB[our_king] is written to prevent the king from moving to squares which are 'x-rayed'
-	//by enemy bishops and queens
-	while (b1) danger |= attacks<BISHOP>(pop_lsb(&b1), all ^ SQUARE_BB[our_king]);
-	
-	b1 = their_orth_sliders;
 	//all ^ SQUARE_BB[our_king] is written to prevent the king from moving to squares which are 'x-rayed'
-	//by enemy rooks and queens
-	while (b1) danger |= attacks<ROOK>(pop_lsb(&b1), all ^ SQUARE_BB[our_king]);
+	//by enemy sliders
+	danger |= slider_danger(their_diag_sliders, their_orth_sliders, all ^ SQUARE_BB[our_king]);
 
 	//The king can move to all of its surrounding squares, except ones that are attacked, and
 	//ones that have our own pieces on them
 	b1 = attacks<KING>(our_king, all) & ~(us_bb | danger);
-	list = make<QUIET>(our_king, b1 & ~them_bb, list);
-	list = make<CAPTURE>(our_king, b1 & them_bb, list);
+	if (!v.template visit<QUIET>(our_king, b1 & ~them_bb)) return false;
+	if (!v.template visit<CAPTURE>(our_king, b1 & them_bb)) return false;
 
 	//The capture mask filters destination squares to those that contain an enemy piece that is checking the 
 	//king and must be captured
@@ -800,31 +1331,7 @@ Move* Position::generate_legals(Move* list) {
 	//A general purpose square for storing destinations, etc.
 	Square s;
 
-	//Checkers of each piece type are identified by:
-	//1. Projecting attacks FROM the king square
-	//2. Intersecting this bitboard with the enemy bitboard of that piece type
-	//gk additional parentheses
-	checkers = (attacks<KNIGHT>(our_king, all) & bitboard_of(Them, KNIGHT))
-		| (pawn_attacks<Us>(our_king) & bitboard_of(Them, PAWN));
-	
-	//Here, we identify slider checkers and pinners simultaneously, and candidates for such pinners 
-	//and checkers are represented by the bitboard <candidates>
-	//gk additional parentheses
-	Bitboard candidates = (attacks<ROOK>(our_king, them_bb) & their_orth_sliders)
-		| (attacks<BISHOP>(our_king, them_bb) & their_diag_sliders);
-
-	pinned = 0;
-	while (candidates) {
-		s = pop_lsb(&candidates);
-		b1 = SQUARES_BETWEEN_BB[our_king][s] & us_bb;
-		
-		//Do the squares in between the enemy slider and our king contain any of our pieces?
-		//If not, add the slider to the checker bitboard
-		if (b1 == 0) checkers ^= SQUARE_BB[s];
-		//If there is only one of our pieces between them, add our piece to the pinned bitboard 
-		//gk additional parentheses
-		else if ((b1 & (b1 - 1)) == 0) pinned ^= b1;
-	}
+	update_checkers_and_pinned<Us>(our_king, us_bb, them_bb, all);
 
 	//This makes it easier to mask pieces
 	const Bitboard not_pinned = ~pinned;
@@ -832,7 +1339,8 @@ Move* Position::generate_legals(Move* list) {
 	switch (sparse_pop_count(checkers)) {
 	case 2:
 		//If there is a double check, the only legal moves are king moves out of check
-		return list;
+		SURGE_COUNT(stats::DOUBLE_CHECK);
+		return true;
 	case 1: {
 		//It's a single check!
 		
@@ -845,26 +1353,30 @@ Move* Position::generate_legals(Move* list) {
 			if (checkers == shift<relative_dir<Us>(SOUTH)>(SQUARE_BB[history[game_ply].epsq])) {
 				//b1 contains our pawns that can capture the checker e.p.
 				b1 = pawn_attacks<Them>(history[game_ply].epsq) & bitboard_of(Us, PAWN) & not_pinned;
-				while (b1) *list++ = Move(pop_lsb(&b1), history[game_ply].epsq, EN_PASSANT);
+				while (b1)
+					if (!v.visit(Move(pop_lsb(&b1), history[game_ply].epsq, EN_PASSANT))) return false;
 			}
 			//FALL THROUGH INTENTIONAL
 		case make_piece(Them, KNIGHT):
 			//If the checker is either a pawn or a knight, the only legal moves are to capture
 			//the checker. Only non-pinned pieces can capture it
+			SURGE_COUNT(stats::SINGLE_CHECK_PAWN_KNIGHT);
 			b1 = attackers_from<Us>(checker_square, all) & not_pinned;
 			while (b1) {
 				s = pop_lsb(&b1);
 				if (type_of(board[s]) == PAWN && rank_of(s) == relative_rank<Us>(RANK7)) {
-					*list++ = Move(s, checker_square, PC_QUEEN);
-					*list++ = Move(s, checker_square, PC_ROOK);
-					*list++ = Move(s, checker_square, PC_BISHOP);
-					*list++ = Move(s, checker_square, PC_KNIGHT);
+					if (!v.visit(Move(s, checker_square, PC_QUEEN))) return false;
+					if (!v.visit(Move(s, checker_square, PC_ROOK))) return false;
+					if (!v.visit(Move(s, checker_square, PC_BISHOP))) return false;
+					if (!v.visit(Move(s, checker_square, PC_KNIGHT))) return false;
 				}
-				else *list++ = Move(s, checker_square, CAPTURE);
+				else if (!v.visit(Move(s, checker_square, CAPTURE))) return false;
 			}
 
-			return list;
+			return true;
 		default:
+			SURGE_COUNT(stats::SINGLE_CHECK_SLIDER);
+
 			//We must capture the checking piece
 			capture_mask = checkers;
 			
@@ -877,6 +1389,8 @@ Move* Position::generate_legals(Move* list) {
 	}
 
 	default:
+		SURGE_COUNT(stats::NO_CHECK);
+
 		//We can capture any enemy piece
 		capture_mask = them_bb;
 		
@@ -907,17 +1421,20 @@ Move* Position::generate_legals(Move* list) {
 				Here, if white plays exd5 e.p., the black rook on a5 attacks the white king on h5 
 				*/
 				
+				SURGE_COUNT(stats::EP_PSEUDO_PIN_TESTS);
 				if ((sliding_attacks(our_king, all ^ SQUARE_BB[s]
 					^ shift<relative_dir<Us>(SOUTH)>(SQUARE_BB[history[game_ply].epsq]),
 					MASK_RANK[rank_of(our_king)]) &
-					their_orth_sliders) == 0)
-						*list++ = Move(s, history[game_ply].epsq, EN_PASSANT);
+					their_orth_sliders) == 0) {
+						if (!v.visit(Move(s, history[game_ply].epsq, EN_PASSANT))) return false;
+				}
+				else SURGE_COUNT(stats::EP_PSEUDO_PINNED);
 			}
 			
 			//Pinned pawns can only capture e.p. if they are pinned diagonally and the e.p. square is in line with the king 
 			b1 = b2 & pinned & LINE[history[game_ply].epsq][our_king];
 			if (b1) {
-				*list++ = Move(bsf(b1), history[game_ply].epsq, EN_PASSANT);
+				if (!v.visit(Move(bsf(b1), history[game_ply].epsq, EN_PASSANT))) return false;
 			}
 		}
 
@@ -926,46 +1443,48 @@ Move* Position::generate_legals(Move* list) {
 		//2. No piece is attacking between the the rook and the king
 		//3. The king is not in check
 		if (!((history[game_ply].entry & oo_mask<Us>()) | ((all | danger) & oo_blockers_mask<Us>())))
-			*list++ = Us == WHITE ? Move(e1, h1, OO) : Move(e8, h8, OO);
+			if (!v.visit(Us == WHITE ? Move(e1, h1, OO) : Move(e8, h8, OO))) return false;
 		if (!((history[game_ply].entry & ooo_mask<Us>()) |
 			((all | (danger & ~ignore_ooo_danger<Us>())) & ooo_blockers_mask<Us>())))
-			*list++ = Us == WHITE ? Move(e1, c1, OOO) : Move(e8, c8, OOO);
+			if (!v.visit(Us == WHITE ? Move(e1, c1, OOO) : Move(e8, c8, OOO))) return false;
 
 		//For each pinned rook, bishop or queen...
 		b1 = ~(not_pinned | bitboard_of(Us, KNIGHT));
 		while (b1) {
 			s = pop_lsb(&b1);
+			SURGE_COUNT(stats::PINNED_PIECES);
 			
 			//...only include attacks that are aligned with our king, since pinned pieces
 			//are constrained to move in this direction only
 			b2 = attacks(type_of(board[s]), s, all) & LINE[our_king][s];
-			list = make<QUIET>(s, b2 & quiet_mask, list);
-			list = make<CAPTURE>(s, b2 & capture_mask, list);
+			if (!v.template visit<QUIET>(s, b2 & quiet_mask)) return false;
+			if (!v.template visit<CAPTURE>(s, b2 & capture_mask)) return false;
 		}
 
 		//For each pinned pawn...
 		b1 = ~not_pinned & bitboard_of(Us, PAWN);
 		while (b1) {
 			s = pop_lsb(&b1);
+			SURGE_COUNT(stats::PINNED_PAWNS);
 
 			if (rank_of(s) == relative_rank<Us>(RANK7)) {
 				//Quiet promotions are impossible since the square in front of the pawn will
 				//either be occupied by the king or the pinner, or doing so would leave our king
 				//in check
 				b2 = pawn_attacks<Us>(s) & capture_mask & LINE[our_king][s];
-				list = make<PROMOTION_CAPTURES>(s, b2, list);
+				if (!v.template visit<PROMOTION_CAPTURES>(s, b2)) return false;
 			}
 			else {
 				b2 = pawn_attacks<Us>(s) & them_bb & LINE[s][our_king];
-				list = make<CAPTURE>(s, b2, list);
+				if (!v.template visit<CAPTURE>(s, b2)) return false;
 				
 				//Single pawn pushes
 				b2 = shift<relative_dir<Us>(NORTH)>(SQUARE_BB[s]) & ~all & LINE[our_king][s];
 				//Double pawn pushes (only pawns on rank 3/6 are eligible)
 				b3 = shift<relative_dir<Us>(NORTH)>(b2 &
 					MASK_RANK[relative_rank<Us>(RANK3)]) & ~all & LINE[our_king][s];
-				list = make<QUIET>(s, b2, list);
-				list = make<DOUBLE_PUSH>(s, b3, list);
+				if (!v.template visit<QUIET>(s, b2)) return false;
+				if (!v.template visit<DOUBLE_PUSH>(s, b3)) return false;
 			}
 		}
 		
@@ -979,8 +1498,8 @@ Move* Position::generate_legals(Move* list) {
 	while (b1) {
 		s = pop_lsb(&b1);
 		b2 = attacks<KNIGHT>(s, all);
-		list = make<QUIET>(s, b2 & quiet_mask, list);
-		list = make<CAPTURE>(s, b2 & capture_mask, list);
+		if (!v.template visit<QUIET>(s, b2 & quiet_mask)) return false;
+		if (!v.template visit<CAPTURE>(s, b2 & capture_mask)) return false;
 	}
 
 	//Non-pinned bishops and queens
@@ -988,8 +1507,8 @@ Move* Position::generate_legals(Move* list) {
 	while (b1) {
 		s = pop_lsb(&b1);
 		b2 = attacks<BISHOP>(s, all);
-		list = make<QUIET>(s, b2 & quiet_mask, list);
-		list = make<CAPTURE>(s, b2 & capture_mask, list);
+		if (!v.template visit<QUIET>(s, b2 & quiet_mask)) return false;
+		if (!v.template visit<CAPTURE>(s, b2 & capture_mask)) return false;
 	}
 
 	//Non-pinned rooks and queens
@@ -997,8 +1516,8 @@ Move* Position::generate_legals(Move* list) {
 	while (b1) {
 		s = pop_lsb(&b1);
 		b2 = attacks<ROOK>(s, all);
-		list = make<QUIET>(s, b2 & quiet_mask, list);
-		list = make<CAPTURE>(s, b2 & capture_mask, list);
+		if (!v.template visit<QUIET>(s, b2 & quiet_mask)) return false;
+		if (!v.template visit<CAPTURE>(s, b2 & capture_mask)) return false;
 	}
 
 	//b1 contains non-pinned pawns which are not on the last rank
@@ -1016,12 +1535,12 @@ Move* Position::generate_legals(Move* list) {
 
 	while (b2) {
 		s = pop_lsb(&b2);
-		*list++ = Move(s - relative_dir<Us>(NORTH), s, QUIET);
+		if (!v.visit(Move(s - relative_dir<Us>(NORTH), s, QUIET))) return false;
 	}
 
 	while (b3) {
 		s = pop_lsb(&b3);
-		*list++ = Move(s - relative_dir<Us>(NORTH_NORTH), s, DOUBLE_PUSH);
+		if (!v.visit(Move(s - relative_dir<Us>(NORTH_NORTH), s, DOUBLE_PUSH))) return false;
 	}
 
 	//Pawn captures
@@ -1030,12 +1549,12 @@ Move* Position::generate_legals(Move* list) {
 
 	while (b2) {
 		s = pop_lsb(&b2);
-		*list++ = Move(s - relative_dir<Us>(NORTH_WEST), s, CAPTURE);
+		if (!v.visit(Move(s - relative_dir<Us>(NORTH_WEST), s, CAPTURE))) return false;
 	}
 
 	while (b3) {
 		s = pop_lsb(&b3);
-		*list++ = Move(s - relative_dir<Us>(NORTH_EAST), s, CAPTURE);
+		if (!v.visit(Move(s - relative_dir<Us>(NORTH_EAST), s, CAPTURE))) return false;
 	}
 
 	//b1 now contains non-pinned pawns which ARE on the last rank (about to promote)
@@ -1045,11 +1564,7 @@ Move* Position::generate_legals(Move* list) {
 		b2 = shift<relative_dir<Us>(NORTH)>(b1) & quiet_mask;
 		while (b2) {
 			s = pop_lsb(&b2);
-			//One move is added for each promotion piece
-			*list++ = Move(s - relative_dir<Us>(NORTH), s, PR_KNIGHT);
-			*list++ = Move(s - relative_dir<Us>(NORTH), s, PR_BISHOP);
-			*list++ = Move(s - relative_dir<Us>(NORTH), s, PR_ROOK);
-			*list++ = Move(s - relative_dir<Us>(NORTH), s, PR_QUEEN);
+			if (!v.template visit<PROMOTIONS>(s - relative_dir<Us>(NORTH), SQUARE_BB[s])) return false;
 		}
 
 		//Promotion captures
@@ -1058,24 +1573,256 @@ Move* Position::generate_legals(Move* list) {
 
 		while (b2) {
 			s = pop_lsb(&b2);
-			//One move is added for each promotion piece
-			*list++ = Move(s - relative_dir<Us>(NORTH_WEST), s, PC_KNIGHT);
-			*list++ = Move(s - relative_dir<Us>(NORTH_WEST), s, PC_BISHOP);
-			*list++ = Move(s - relative_dir<Us>(NORTH_WEST), s, PC_ROOK);
-			*list++ = Move(s - relative_dir<Us>(NORTH_WEST), s, PC_QUEEN);
+			if (!v.template visit<PROMOTION_CAPTURES>(s - relative_dir<Us>(NORTH_WEST), SQUARE_BB[s])) return false;
 		}
 
 		while (b3) {
 			s = pop_lsb(&b3);
-			//One move is added for each promotion piece
-			*list++ = Move(s - relative_dir<Us>(NORTH_EAST), s, PC_KNIGHT);
-			*list++ = Move(s - relative_dir<Us>(NORTH_EAST), s, PC_BISHOP);
-			*list++ = Move(s - relative_dir<Us>(NORTH_EAST), s, PC_ROOK);
-			*list++ = Move(s - relative_dir<Us>(NORTH_EAST), s, PC_QUEEN);
+			if (!v.template visit<PROMOTION_CAPTURES>(s - relative_dir<Us>(NORTH_EAST), SQUARE_BB[s])) return false;
 		}
 	}
 
-	return list;
+	return true;
+}
+
+//Generates all legal moves in a position for the given side. Advances the move pointer and returns it.
+template<Color Us>
+inline Move* Position::generate_legals(Move* list) {
+	MoveWriter writer(list);
+	generate_legals<Us>(writer);
+	return writer.list;
+}
+
+//Returns true if our king can step to a square that is not attacked. Each square is tested on its own instead of
+//building the full danger bitboard, and the king is taken off the board so that it cannot hide behind itself from
+//a slider
+template<Color Us>
+inline bool Position::king_has_escape(Square our_king, Bitboard all) const {
+	constexpr Color Them = ~Us;
+	Bitboard b = attacks<KING>(our_king, all) & ~all_pieces<Us>()
+		& ~attacks<KING>(bsf(bitboard_of(Them, KING)), all) & ~pawn_attacks<Them>(bitboard_of(Them, PAWN));
+	const Bitboard occ = all ^ SQUARE_BB[our_king];
+	while (b)
+		if (!attackers_from<Them>(pop_lsb(&b), occ)) return true;
+	return false;
+}
+
+//Returns true if the side has at least one legal move, without generating them all. This does the same check and
+//pin analysis as generate_legals(), but stops at the first legal move, trying the cheapest candidates first: when in
+//check, king escapes, and otherwise unpinned pieces, whose pseudo-legal moves are all legal. Castling is never
+//needed, since whenever castling is legal, so is the king's step towards the rook. Like generate_legals(), it 
+//updates the checkers and pinned bitboards
+template<Color Us>
+bool Position::has_legal_move() {
+	constexpr Color Them = ~Us;
+
+	const Bitboard us_bb = all_pieces<Us>();
+	const Bitboard them_bb = all_pieces<Them>();
+	const Bitboard all = us_bb | them_bb;
+	const Square our_king = bsf(bitboard_of(Us, KING));
+	const Square epsq = history[game_ply].epsq;
+
+	Bitboard b1, b2;
+	Square s;
+
+	update_checkers_and_pinned<Us>(our_king, us_bb, them_bb, all);
+	const Bitboard not_pinned = ~pinned;
+
+	//Squares that resolve a check, or any square not occupied by our pieces
+	Bitboard capture_mask, quiet_mask;
+
+	switch (sparse_pop_count(checkers)) {
+	case 2:
+		return king_has_escape<Us>(our_king, all);
+	case 1: {
+		if (king_has_escape<Us>(our_king, all)) return true;
+
+		const Square checker_square = bsf(checkers);
+		capture_mask = checkers;
+		quiet_mask = type_of(board[checker_square]) == PAWN || type_of(board[checker_square]) == KNIGHT ? 0 :
+			SQUARES_BETWEEN_BB[our_king][checker_square];
+
+		//A pawn which just double pushed to give check can be captured e.p.
+		if (checkers == shift<relative_dir<Us>(SOUTH)>(SQUARE_BB[epsq]) &&
+			(pawn_attacks<Them>(epsq) & bitboard_of(Us, PAWN) & not_pinned)) return true;
+		break;
+	}
+	default:
+		capture_mask = them_bb;
+		quiet_mask = ~all;
+		break;
+	}
+
+	//Any move of an unpinned piece to a target square is legal
+	const Bitboard targets = capture_mask | quiet_mask;
+
+	b1 = bitboard_of(Us, KNIGHT) & not_pinned;
+	while (b1)
+		if (attacks<KNIGHT>(pop_lsb(&b1), all) & targets) return true;
+
+	b1 = diagonal_sliders<Us>() & not_pinned;
+	while (b1)
+		if (attacks<BISHOP>(pop_lsb(&b1), all) & targets) return true;
+
+	b1 = orthogonal_sliders<Us>() & not_pinned;
+	while (b1)
+		if (attacks<ROOK>(pop_lsb(&b1), all) & targets) return true;
+
+	//Pawn pushes, double pushes and captures, including promotions
+	b1 = bitboard_of(Us, PAWN) & not_pinned;
+	b2 = shift<relative_dir<Us>(NORTH)>(b1) & ~all;
+	if (b2 & quiet_mask) return true;
+	if (shift<relative_dir<Us>(NORTH)>(b2 & MASK_RANK[relative_rank<Us>(RANK3)]) & quiet_mask) return true;
+	if (pawn_attacks<Us>(b1) & capture_mask) return true;
+
+	//Pinned pieces can never resolve a check
+	if (checkers) return false;
+
+	if (king_has_escape<Us>(our_king, all)) return true;
+
+	//Pinned pieces other than knights can move along the line of the pin
+	b1 = pinned & ~bitboard_of(Us, KNIGHT) & ~bitboard_of(Us, PAWN);
+	while (b1) {
+		s = pop_lsb(&b1);
+		if (attacks(type_of(board[s]), s, all) & ~us_bb & LINE[our_king][s]) return true;
+	}
+
+	b1 = pinned & bitboard_of(Us, PAWN);
+	while (b1) {
+		s = pop_lsb(&b1);
+		if ((shift<relative_dir<Us>(NORTH)>(SQUARE_BB[s]) & ~all) & LINE[our_king][s]) return true;
+		if (pawn_attacks<Us>(s) & them_bb & LINE[our_king][s]) return true;
+	}
+
+	//En passant, with the same pseudo-pin test as generate_legals()
+	if (epsq != NO_SQUARE) {
+		b2 = pawn_attacks<Them>(epsq) & bitboard_of(Us, PAWN);
+		b1 = b2 & not_pinned;
+		while (b1) {
+			s = pop_lsb(&b1);
+			if ((sliding_attacks(our_king, all ^ SQUARE_BB[s]
+				^ shift<relative_dir<Us>(SOUTH)>(SQUARE_BB[epsq]),
+				MASK_RANK[rank_of(our_king)]) & orthogonal_sliders<Them>()) == 0) return true;
+		}
+
+		if (b2 & pinned & LINE[epsq][our_king]) return true;
+	}
+
+	return false;
+}
+
+//Returns true if the move (including its flags) could be generated in this position, ignoring whether it 
+//leaves our king in check. Used to validate moves that come from outside the move generator, such as 
+//transposition table moves, killer moves and book moves
+template<Color Us>
+bool Position::is_pseudo_legal(const Move m) const {
+	constexpr Color Them = ~Us;
+
+	const Square from = m.from(), to = m.to();
+	const Piece pc = board[from];
+
+	if (pc == NO_PIECE || color_of(pc) != Us) return false;
+
+	const Bitboard them_bb = all_pieces<Them>();
+	const Bitboard all = all_pieces<Us>() | them_bb;
+
+	switch (m.flags()) {
+	case QUIET:
+		//Pawns on the 7th rank may only push with a promotion flag
+		if (type_of(pc) == PAWN)
+			return rank_of(from) != relative_rank<Us>(RANK7) && to == from + relative_dir<Us>(NORTH) &&
+				!(all & SQUARE_BB[to]);
+		return attacks(type_of(pc), from, all) & ~all & SQUARE_BB[to];
+	case DOUBLE_PUSH:
+		return type_of(pc) == PAWN && rank_of(from) == relative_rank<Us>(RANK2) &&
+			to == from + relative_dir<Us>(NORTH_NORTH) &&
+			!(all & (SQUARE_BB[from + relative_dir<Us>(NORTH)] | SQUARE_BB[to]));
+	case OO:
+		//Castling moves are encoded as (king square, rook square)
+		return from == (Us == WHITE ? e1 : e8) && to == (Us == WHITE ? h1 : h8) &&
+			!((history[game_ply].entry & oo_mask<Us>()) | (all & oo_blockers_mask<Us>()));
+	case OOO:
+		return from == (Us == WHITE ? e1 : e8) && to == (Us == WHITE ? c1 : c8) &&
+			!((history[game_ply].entry & ooo_mask<Us>()) | (all & ooo_blockers_mask<Us>()));
+	case CAPTURE:
+		//Pawns on the 7th rank may only capture with a promotion flag
+		if (type_of(pc) == PAWN)
+			return rank_of(from) != relative_rank<Us>(RANK7) && (pawn_attacks<Us>(from) & them_bb & SQUARE_BB[to]);
+		return attacks(type_of(pc), from, all) & them_bb & SQUARE_BB[to];
+	case EN_PASSANT:
+		return type_of(pc) == PAWN && to == history[game_ply].epsq && (pawn_attacks<Us>(from) & SQUARE_BB[to]);
+	case PR_KNIGHT:
+	case PR_BISHOP:
+	case PR_ROOK:
+	case PR_QUEEN:
+		return type_of(pc) == PAWN && rank_of(from) == relative_rank<Us>(RANK7) &&
+			to == from + relative_dir<Us>(NORTH) && !(all & SQUARE_BB[to]);
+	case PC_KNIGHT:
+	case PC_BISHOP:
+	case PC_ROOK:
+	case PC_QUEEN:
+		return type_of(pc) == PAWN && rank_of(from) == relative_rank<Us>(RANK7) &&
+			(pawn_attacks<Us>(from) & them_bb & SQUARE_BB[to]);
+	default:
+		return false;
+	}
+}
+
+//Returns true if a pseudo-legal move does not leave our king in check. The checkers and pinned bitboards are
+//updated in the same way as in generate_legals(), so only the moving piece needs to be examined
+template<Color Us>
+bool Position::is_legal(const Move m) {
+	constexpr Color Them = ~Us;
+
+	const Bitboard us_bb = all_pieces<Us>();
+	const Bitboard them_bb = all_pieces<Them>();
+	const Bitboard all = us_bb | them_bb;
+
+	const Square our_king = bsf(bitboard_of(Us, KING));
+	const Square from = m.from(), to = m.to();
+
+	update_checkers_and_pinned<Us>(our_king, us_bb, them_bb, all);
+
+	if (from == our_king) {
+		if (m.flags() == OO || m.flags() == OOO) {
+			//We cannot castle out of check, or through a square that is attacked. On the queenside, the
+			//square next to the rook may be attacked
+			if (checkers) return false;
+
+			Bitboard path = m.flags() == OO ? oo_blockers_mask<Us>() :
+				ooo_blockers_mask<Us>() & ~ignore_ooo_danger<Us>();
+			while (path) {
+				Square s = pop_lsb(&path);
+				if (attackers_from<Them>(s, all) | (attacks<KING>(s, all) & bitboard_of(Them, KING)))
+					return false;
+			}
+			return true;
+		}
+
+		//The king may not move to an attacked square. It is removed from the occupancy so that squares 
+		//'x-rayed' by enemy sliders through the king are also seen as attacked
+		return !(attackers_from<Them>(to, all ^ SQUARE_BB[from]) |
+			(attacks<KING>(to, all) & bitboard_of(Them, KING)));
+	}
+
+	if (m.flags() == EN_PASSANT) {
+		//Two pieces leave their squares at once, which can reveal an attack on our king along the rank 
+		//(the 'pseudo-pinned' case) or a diagonal, so we simply look for attackers after the capture
+		const Square captured = to + relative_dir<Us>(SOUTH);
+		const Bitboard occ = all ^ SQUARE_BB[from] ^ SQUARE_BB[to] ^ SQUARE_BB[captured];
+		return !(attackers_from<Them>(our_king, occ) & ~SQUARE_BB[captured]);
+	}
+
+	if (checkers) {
+		//If there is a double check, the only legal moves are king moves out of check
+		if (checkers & (checkers - 1)) return false;
+		
+		//Otherwise, we must capture the checking piece or block it
+		if (!((checkers | SQUARES_BETWEEN_BB[our_king][bsf(checkers)]) & SQUARE_BB[to])) return false;
+	}
+
+	//Pinned pieces can only move along the line between the pinner and our king
+	return !(pinned & SQUARE_BB[from]) || (LINE[our_king][from] & SQUARE_BB[to]);
 }
 
 //A convenience class for interfacing with legal moves, rather than using the low-level
@@ -1093,9 +1840,459 @@ private:
 	Move *last;
 };
 
+//Scores captures by MVV-LVA (most valuable victim, least valuable attacker). Captures are always scored above
+//quiet moves, which have a score of 0 before history scores are added
+const int CAPTURE_SCORE = 1 << 20;
+const int PROMOTION_SCORE = 1 << 19;
+
+template<Color Us>
+class ScoredMoveList;
+
+//Iterates over a ScoredMoveList, selecting the best remaining move each time it is advanced
+template<Color Us>
+class ScoredMoveIterator {
+public:
+	ScoredMoveIterator(ScoredMoveList<Us>* l, size_t i) : l(l), i(i) {}
+
+	inline Move operator*() const { return l->list[i]; }
+	inline ScoredMoveIterator& operator++() { l->select(++i); return *this; }
+	inline bool operator!=(const ScoredMoveIterator& other) const { return i != other.i; }
+private:
+	ScoredMoveList<Us>* l;
+	size_t i;
+};
+
+//A move list which stores an ordering score for each move. Instead of sorting the whole list up front, the
+//highest scoring remaining move is selected as the list is iterated over, so nodes that cut off after
+//one or two moves do not pay for ordering the rest. Moves and scores are kept in separate arrays so that
+//generate_legals() can write directly into the move array, and the worst case of 218 moves fits on the stack
+template<Color Us>
+class ScoredMoveList {
+public:
+	explicit ScoredMoveList(Position& p) : last(p.generate_legals<Us>(list)) {
+		for (size_t i = 0; i < size(); i++) scores[i] = 0;
+	}
+
+	//Adds a score from an arbitrary scoring function of the form int f(Move) to each move
+	template<typename F>
+	void score(F f) {
+		for (size_t i = 0; i < size(); i++) scores[i] += f(list[i]);
+	}
+
+	//Scores captures by MVV-LVA, and promotions by the promoted piece
+	void score_mvv_lva(const Position& p) {
+		for (size_t i = 0; i < size(); i++) {
+			Move m = list[i];
+			if (m.is_promotion())
+				scores[i] += PROMOTION_SCORE + m.promotion_type();
+			if (m.is_capture()) {
+				PieceType victim = m.flags() == EN_PASSANT ? PAWN : type_of(p.at(m.to()));
+				PieceType attacker = type_of(p.at(m.from()));
+				scores[i] += CAPTURE_SCORE + victim * NPIECE_TYPES + (KING - attacker);
+			}
+		}
+	}
+
+	//Adds history heuristic scores, indexed by [from][to], to quiet moves
+	void score_history(const int history[NSQUARES][NSQUARES]) {
+		for (size_t i = 0; i < size(); i++)
+			if (!list[i].is_capture()) scores[i] += history[list[i].from()][list[i].to()];
+	}
+
+	ScoredMoveIterator<Us> begin() { select(0); return ScoredMoveIterator<Us>(this, 0); }
+	ScoredMoveIterator<Us> end() { return ScoredMoveIterator<Us>(this, size()); }
+	size_t size() const { return last - list; }
+
+	//Returns the score of the i-th move. Only moves which have already been selected are in order
+	int score_of(size_t i) const { return scores[i]; }
+private:
+	friend class ScoredMoveIterator<Us>;
+
+	//Swaps the best scoring move in [i, size()) into position i
+	inline void select(size_t i) {
+		if (i >= size()) return;
+		size_t best = i;
+		for (size_t j = i + 1; j < size(); j++)
+			if (scores[j] > scores[best]) best = j;
+		std::swap(list[i], list[best]);
+		std::swap(scores[i], scores[best]);
+	}
+
+	Move list[218];
+	int scores[218];
+	Move *last;
+};
+
+//The number of move mask planes: every move, with promotions as queen promotions, then knight, bishop and rook 
+//underpromotions
+const int POLICY_PLANES = 4;
+
+//The number of input planes written by write_planes(): 6 piece planes (pawn to king) for the side to move and 6 
+//for the opponent, 4 castling planes (our short and long, their short and long) and the en passant square
+const int INPUT_PLANES = 17;
+
+//A move visitor that ORs the destination squares of legal moves into one bitboard per plane and origin square, 
+//which is the legal-move mask of a from-to policy. Batches are added with a single OR. Castling moves keep their
+//encoding: O-O goes to the rook square (h1/h8), and O-O-O to the king's destination (c1/c8)
+struct MoveMaskWriter {
+	Bitboard (*masks)[NSQUARES];
+
+	explicit MoveMaskWriter(Bitboard (*masks)[NSQUARES]) : masks(masks) {}
+
+	inline bool visit(Move m) {
+		const int plane = m.is_promotion() && m.promotion_type() != QUEEN ? m.promotion_type() : 0;
+		masks[plane][m.from()] |= SQUARE_BB[m.to()];
+		return true;
+	}
+
+	template<MoveFlags F>
+	inline bool visit(Square from, Bitboard to) {
+		masks[0][from] |= to;
+		if (F == PROMOTIONS || F == PROMOTION_CAPTURES)
+			for (int plane = 1; plane < POLICY_PLANES; plane++) masks[plane][from] |= to;
+		return true;
+	}
+};
+
+//Mirrors a bitboard vertically, so that the first rank becomes the eighth
+constexpr Bitboard flip_vertical(Bitboard b) {
+	return (b << 56) | ((b << 40) & 0x00ff000000000000) | ((b << 24) & 0x0000ff0000000000) |
+		((b << 8) & 0x000000ff00000000) | ((b >> 8) & 0x00000000ff000000) | ((b >> 24) & 0x0000000000ff0000) |
+		((b >> 40) & 0x000000000000ff00) | (b >> 56);
+}
+
+//Fills the move masks of a position. If relative is set and Black is to move, the board is mirrored so that 
+//the side to move always plays up the board
+inline void legal_move_masks(Position& p, Bitboard masks[POLICY_PLANES][NSQUARES], bool relative = true) {
+	memset(masks, 0, sizeof(Bitboard) * POLICY_PLANES * NSQUARES);
+	MoveMaskWriter writer(masks);
+
+	if (p.turn() == WHITE) {
+		p.generate_legals<WHITE>(writer);
+		return;
+	}
+
+	p.generate_legals<BLACK>(writer);
+	if (relative)
+		for (int plane = 0; plane < POLICY_PLANES; plane++)
+			for (int s = 0; s < 32; s++) {
+				Bitboard b = masks[plane][s];
+				masks[plane][s] = flip_vertical(masks[plane][s ^ 56]);
+				masks[plane][s ^ 56] = flip_vertical(b);
+			}
+}
+
+//Expands move masks into POLICY_PLANES x 64 x 64 values (plane, from, to) of 0 or 1
+template<typename T>
+void write_move_masks(const Bitboard masks[POLICY_PLANES][NSQUARES], T* out) {
+	std::fill(out, out + POLICY_PLANES * NSQUARES * NSQUARES, T(0));
+	for (int plane = 0; plane < POLICY_PLANES; plane++)
+		for (int from = 0; from < NSQUARES; from++)
+			for (Bitboard b = masks[plane][from]; b; )
+				out[(plane * NSQUARES + from) * NSQUARES + pop_lsb(&b)] = T(1);
+}
+
+//Writes the INPUT_PLANES x 64 input planes of a position as values of 0 or 1, with the same orientation as
+//legal_move_masks()
+template<typename T>
+void write_planes(const Position& p, T* out, bool relative = true) {
+	std::fill(out, out + INPUT_PLANES * NSQUARES, T(0));
+	const Color us = relative ? p.turn() : WHITE;
+	const int flip = relative && us == BLACK ? 56 : 0;
+
+	for (int side = 0; side < 2; side++)
+		for (int pt = PAWN; pt <= KING; pt++)
+			for (Bitboard b = p.bitboard_of(side ? ~us : us, PieceType(pt)); b; )
+				out[(side * 6 + pt) * NSQUARES + (pop_lsb(&b) ^ flip)] = T(1);
+
+	const UndoInfo& state = p.history[p.ply()];
+	const int rights = castling_rights(state.entry);
+	const int ours = us == WHITE ? rights : rights >> 2, theirs = us == WHITE ? rights >> 2 : rights;
+	const int castling[4] = { ours & 1, ours & 2, theirs & 1, theirs & 2 };
+	for (int i = 0; i < 4; i++)
+		if (castling[i]) std::fill(out + (12 + i) * NSQUARES, out + (13 + i) * NSQUARES, T(1));
+
+	if (state.epsq != NO_SQUARE) out[16 * NSQUARES + (state.epsq ^ flip)] = T(1);
+}
+
+//Writes the input planes and move masks of many positions into two contiguous tensors, of INPUT_PLANES x 64 
+//values and POLICY_PLANES x 64 bitboards per position
+template<typename T>
+void write_batch(Position* positions, size_t n, T* planes, Bitboard* masks, bool relative = true) {
+	for (size_t i = 0; i < n; i++) {
+		write_planes(positions[i], planes + i * INPUT_PLANES * NSQUARES, relative);
+		legal_move_masks(positions[i], (Bitboard (*)[NSQUARES]) (masks + i * POLICY_PLANES * NSQUARES), relative);
+	}
+}
+
+//Computes the perft of the position for a given depth, using bulk-counting
+//According to the https://www.chessprogramming.org/Perft site:
+//Perft is a debugging function to walk the move generation tree of strictly legal moves to count 
+//all the leaf nodes of a certain depth, which can be compared to predetermined values and used to isolate bugs
+template<Color Us>
+unsigned long long perft(Position& p, unsigned int depth) {
+	//gk int nmoves;
+	unsigned long long nodes = 0;
+
+	//At the last ply, moves are only counted, so they do not need to be stored
+	if (depth == 1) {
+		MoveCounter counter;
+		p.generate_legals<Us>(counter);
+		return (unsigned long long) counter.count;
+	}
+
+	MoveList<Us> list(p);
+
+	for (Move move : list) {
+		p.play<Us>(move);
+		nodes += perft<~Us>(p, depth - 1);
+		p.undo<Us>(move);
+	}
+
+	return nodes;
+}
+
+//A variant of perft, listing all moves and for each move, the perft of the decremented depth
+//It is used solely for debugging
+template<Color Us>
+void perftdiv(Position& p, unsigned int depth) {
+	unsigned long long nodes = 0, pf;
+
+	MoveList<Us> list(p);
+
+	for (Move move : list) {
+		std::cout << move;
+
+		p.play<Us>(move);
+		pf = perft<~Us>(p, depth - 1);
+		std::cout << ": " << pf << " moves\n";
+		nodes += pf;
+		p.undo<Us>(move);
+	}
+
+	std::cout << "\nTotal: " << nodes << " moves\n";
+}
+
+//The standard breakdown of the leaves of a perft tree. Checks counts every checking move once; discovered checks
+//are those given only by a piece other than the one that moved, and double checks those given by two pieces
+struct PerftStats {
+	unsigned long long nodes = 0, captures = 0, en_passants = 0, castles = 0, promotions = 0;
+	unsigned long long checks = 0, discovered_checks = 0, double_checks = 0, checkmates = 0;
+
+	PerftStats& operator+=(const PerftStats& s) {
+		nodes += s.nodes; captures += s.captures; en_passants += s.en_passants; castles += s.castles;
+		promotions += s.promotions; checks += s.checks; discovered_checks += s.discovered_checks;
+		double_checks += s.double_checks; checkmates += s.checkmates;
+		return *this;
+	}
+};
+
+extern std::ostream& operator<<(std::ostream& os, const PerftStats& s);
+
+//Classifies the leaf moves of a perft tree as they are generated, mostly without playing them. Checks by ordinary
+//moves are found from the squares each piece type would check from and the pieces which would discover a check. 
+//En passant, castling and promotions, which change the board in other ways, and checking moves, which need the 
+//reply generated to spot checkmate, are kept aside and played once generation has finished
+template<Color Us>
+struct LeafStatsVisitor {
+	const Position& p;
+	PerftStats& stats;
+	Square their_king;
+	Bitboard check_squares[NPIECE_TYPES];
+	Bitboard discoverers;
+
+	//Moves to be played after generation, and whether each is already known to give check
+	Move deferred[218];
+	size_t ndeferred = 0;
+
+	LeafStatsVisitor(const Position& p, PerftStats& stats) : p(p), stats(stats) {
+		constexpr Color Them = ~Us;
+		const Bitboard all = p.all_pieces<WHITE>() | p.all_pieces<BLACK>();
+		their_king = bsf(p.bitboard_of(Them, KING));
+
+		check_squares[PAWN] = pawn_attacks<Them>(their_king);
+		check_squares[KNIGHT] = attacks<KNIGHT>(their_king, all);
+		check_squares[BISHOP] = attacks<BISHOP>(their_king, all);
+		check_squares[ROOK] = attacks<ROOK>(their_king, all);
+		check_squares[QUEEN] = check_squares[BISHOP] | check_squares[ROOK];
+		check_squares[KING] = 0;
+
+		//Our pieces which are the only piece between one of our sliders and their king
+		discoverers = 0;
+		Bitboard snipers = (attacks<ROOK>(their_king, 0) & p.orthogonal_sliders<Us>()) |
+			(attacks<BISHOP>(their_king, 0) & p.diagonal_sliders<Us>());
+		while (snipers) {
+			const Bitboard b = SQUARES_BETWEEN_BB[their_king][pop_lsb(&snipers)] & all;
+			if (b && !(b & (b - 1)) && (b & p.all_pieces<Us>())) discoverers |= b;
+		}
+	}
+
+	template<MoveFlags F>
+	inline bool visit(Square from, Bitboard to) {
+		if (F == PROMOTIONS || F == PROMOTION_CAPTURES) return visit_each<F>(*this, from, to);
+
+		const unsigned long long n = pop_count(to);
+		stats.nodes += n;
+		if (F == CAPTURE) stats.captures += n;
+
+		const Bitboard direct = to & check_squares[type_of(p.at(from))];
+		const Bitboard discovered = discoverers & SQUARE_BB[from] ? to & ~LINE[from][their_king] : 0;
+		Bitboard checking = direct | discovered;
+		if (checking) {
+			stats.checks += pop_count(checking);
+			stats.discovered_checks += pop_count(discovered & ~direct);
+			stats.double_checks += pop_count(direct & discovered);
+			while (checking) deferred[ndeferred++] = Move(from, pop_lsb(&checking), F);
+		}
+		return true;
+	}
+
+	inline bool visit(Move m) {
+		const MoveFlags f = m.flags();
+		//A double push keeps its flag, so that a checking one is replayed with its en passant square
+		const Bitboard to = SQUARE_BB[m.to()];
+		if (f == QUIET) return visit<QUIET>(m.from(), to);
+		if (f == DOUBLE_PUSH) return visit<DOUBLE_PUSH>(m.from(), to);
+		if (f == CAPTURE) return visit<CAPTURE>(m.from(), to);
+
+		stats.nodes++;
+		deferred[ndeferred++] = m;
+		return true;
+	}
+
+	//Plays the moves kept aside, classifying the special moves and looking for checkmates
+	void finish(Position& pos) {
+		constexpr Color Them = ~Us;
+		for (size_t i = 0; i < ndeferred; i++) {
+			const Move m = deferred[i];
+			const bool special = m.flags() == EN_PASSANT || m.flags() == OO || m.flags() == OOO || m.is_promotion();
+			if (special) {
+				stats.captures += m.is_capture();
+				stats.en_passants += m.flags() == EN_PASSANT;
+				stats.castles += m.flags() == OO || m.flags() == OOO;
+				stats.promotions += m.is_promotion();
+			}
+
+			pos.play<Us>(m);
+			const Bitboard checkers = pos.attackers_from<Us>(their_king, pos.all_pieces<WHITE>() | pos.all_pieces<BLACK>());
+			if (special && checkers) {
+				//The rook gives the check after castling, and is counted as the moving piece
+				const Square moved = m.flags() == OO ? (Us == WHITE ? f1 : f8) :
+					m.flags() == OOO ? (Us == WHITE ? d1 : d8) : m.to();
+				stats.checks++;
+				const bool double_check = (checkers & (checkers - 1)) != 0;
+				stats.discovered_checks += !double_check && !(checkers & SQUARE_BB[moved]);
+				stats.double_checks += double_check;
+			}
+			if (checkers) stats.checkmates += !pos.has_legal_move<Them>();
+			pos.undo<Us>(m);
+		}
+	}
+};
+
+//Computes the perft of the position with the full breakdown of its leaves. Leaves are classified while the last 
+//ply is generated, so only special and checking moves are played there
+template<Color Us>
+void perft_stats(Position& p, unsigned int depth, PerftStats& stats) {
+	if (depth == 1) {
+		LeafStatsVisitor<Us> v(p, stats);
+		p.generate_legals<Us>(v);
+		v.finish(p);
+		return;
+	}
+
+	MoveList<Us> list(p);
+	for (Move move : list) {
+		p.play<Us>(move);
+		perft_stats<~Us>(p, depth - 1, stats);
+		p.undo<Us>(move);
+	}
+}
+
+enum GameResult : int {
+	WHITE_WINS, BLACK_WINS, DRAW
+};
+
+//How a game ended. A game reaching MAX_PLY_REACHED is adjudicated as a draw
+enum Termination : int {
+	CHECKMATE, STALEMATE, FIFTY_MOVE_RULE, THREEFOLD_REPETITION, INSUFFICIENT_MATERIAL, MAX_PLY_REACHED
+};
+
+struct Playout {
+	GameResult result;
+	Termination termination;
+	int plies;
+};
+
+//Picks a move uniformly at random from the legal moves
+struct UniformPolicy {
+	inline Move operator()(const Position&, const Move* moves, size_t n, PRNG& rng) const {
+		return moves[((rng.rand<uint64_t>() >> 32) * n) >> 32];
+	}
+};
+
+//Ends the game if the side to move is mated or the game is drawn, and otherwise plays the move chosen by the
+//policy. Returns false once the game is over
+template<Color Us, typename Policy>
+inline bool playout_move(Position& p, PRNG& rng, Policy& policy, int max_ply, Move& played, Playout& result) {
+	MoveList<Us> list(p);
+
+	if (list.size() == 0) {
+		result.result = p.checkers ? (Us == WHITE ? BLACK_WINS : WHITE_WINS) : DRAW;
+		result.termination = p.checkers ? CHECKMATE : STALEMATE;
+		return false;
+	}
+
+	result.result = DRAW;
+	if (p.is_fifty_move_draw()) result.termination = FIFTY_MOVE_RULE;
+	else if (p.is_repetition(2)) result.termination = THREEFOLD_REPETITION;
+	else if (p.insufficient_material()) result.termination = INSUFFICIENT_MATERIAL;
+	else if (p.ply() >= max_ply) result.termination = MAX_PLY_REACHED;
+	else {
+		played = policy(p, list.begin(), list.size(), rng);
+		p.play<Us>(played);
+		return true;
+	}
+	return false;
+}
+
+//Plays a game from the position to the end, choosing each move with the policy, and then restores the
+//position. Games that reach MAX_GAME_PLY plies of history are adjudicated as draws. Each thread should use
+//its own PRNG, since the generator is not thread-safe
+template<typename Policy = UniformPolicy>
+Playout playout(Position& p, PRNG& rng, Policy policy = Policy()) {
+	Move moves[MAX_GAME_PLY];
+	const int max_ply = MAX_GAME_PLY - 1;
+	Playout result;
+	int n = 0;
+
+	while (p.turn() == WHITE ? playout_move<WHITE>(p, rng, policy, max_ply, moves[n], result) :
+		playout_move<BLACK>(p, rng, policy, max_ply, moves[n], result)) n++;
+	result.plies = n;
+
+	while (n--) {
+		if (p.turn() == BLACK) p.undo<WHITE>(moves[n]);
+		else p.undo<BLACK>(moves[n]);
+	}
+	return result;
+}
+
+//The tables of this process, used unless a database file is mapped. They are aligned to and padded to whole 
+//large pages, so that initialise_all_databases() can ask for them to be backed by transparent huge pages
+struct alignas(LARGE_PAGE_SIZE) LargePageDatabases : Databases {};
+static LargePageDatabases local_databases;
+static const Databases* active_databases = &local_databases;
+static void advise_large_pages(void* p, size_t size);
+
 //Zobrist keys for each piece and each square
 //Used to incrementally update the hash key of a position
-uint64_t zobrist::zobrist_table[NPIECES][NSQUARES];
+const uint64_t (*zobrist::zobrist_table)[NSQUARES] = local_databases.zobrist_table;
+
+//Zobrist keys for the side to move, each combination of castling rights and each en passant file. The side key
+//is a copy, since it is a single value
+uint64_t zobrist::side_key;
+const uint64_t* zobrist::castling_keys = local_databases.castling_keys;
+const uint64_t* zobrist::en_passant_keys = local_databases.en_passant_keys;
 
 //Initializes the zobrist table with random 64-bit numbers
 void zobrist::initialise_zobrist_keys() {
@@ -1105,9 +2302,192 @@ void zobrist::initialise_zobrist_keys() {
 	//gk    for (int j = 0; j < NSQUARES; j++)
 	for (size_t i = 0; i < NPIECES; i++)
 		for (size_t j = 0; j < NSQUARES; j++)
-			zobrist::zobrist_table[i][j] = rng.rand<uint64_t>();
+			local_databases.zobrist_table[i][j] = rng.rand<uint64_t>();
+
+	zobrist::side_key = local_databases.side_key = rng.rand<uint64_t>();
+	for (size_t i = 0; i < 16; i++)
+		local_databases.castling_keys[i] = rng.rand<uint64_t>();
+	for (size_t i = 0; i < 8; i++)
+		local_databases.en_passant_keys[i] = rng.rand<uint64_t>();
+
+	initialise_cuckoo_tables();
+}
+
+const uint64_t* zobrist::cuckoo_keys = local_databases.cuckoo_keys;
+const Move* zobrist::cuckoo_moves = local_databases.cuckoo_moves;
+
+//Fills the cuckoo tables with the hash difference of every move a piece other than a pawn can make on an empty board,
+//which covers every reversible move. Both directions of a move change the hash in the same way, so each pair of
+//squares is entered once. This is the method published by Marcel van Kervinck for detecting upcoming repetitions
+void zobrist::initialise_cuckoo_tables() {
+	uint64_t* keys = local_databases.cuckoo_keys;
+	Move* moves = local_databases.cuckoo_moves;
+	const uint64_t (*table)[NSQUARES] = local_databases.zobrist_table;
+
+	std::fill(keys, keys + 8192, 0);
+	std::fill(moves, moves + 8192, Move());
+
+	for (Color c : { WHITE, BLACK })
+		for (PieceType pt : { KNIGHT, BISHOP, ROOK, QUEEN, KING }) {
+			const Piece pc = make_piece(c, pt);
+			for (Square from = a1; from <= h8; ++from) {
+				//The attack tables may not have been initialised yet, so slider attacks are computed directly
+				Bitboard to = pt == KNIGHT ? KNIGHT_ATTACKS[from] : pt == KING ? KING_ATTACKS[from] : 0;
+				if (pt == BISHOP || pt == QUEEN) to |= get_bishop_attacks_for_init(from, 0);
+				if (pt == ROOK || pt == QUEEN) to |= get_rook_attacks_for_init(from, 0);
+				to &= ~((SQUARE_BB[from] << 1) - 1);
+
+				while (to) {
+					const Square s = pop_lsb(&to);
+					uint64_t key = table[pc][from] ^ table[pc][s] ^ side_key;
+					Move m(from, s);
+
+					//Each entry that is displaced moves to its other slot, until one lands in an empty slot
+					for (int slot = cuckoo_h1(key); ; slot = slot == cuckoo_h1(key) ? cuckoo_h2(key) : cuckoo_h1(key)) {
+						std::swap(keys[slot], key);
+						std::swap(moves[slot], m);
+						if (m.to_from() == 0) break;
+					}
+				}
+			}
+		}
+}
+
+//Returns true if the current position has occurred at least <count> times before. Only positions since the 
+//last capture or pawn move are examined, since no earlier position can be repeated
+bool Position::is_repetition(int count) const {
+	const int end = std::max(0, game_ply - history[game_ply].halfmove);
+	int repetitions = 0;
+	
+	for (int i = game_ply - 4; i >= end; i -= 2)
+		if (history[i].hash == hash && ++repetitions >= count) return true;
+	return false;
+}
+
+//Returns true if neither side can possibly checkmate: king against king, a single minor piece against a bare
+//king, or only bishops which all stand on squares of the same color
+bool Position::insufficient_material() const {
+	if (piece_bb[WHITE_PAWN] | piece_bb[BLACK_PAWN] | orthogonal_sliders<WHITE>() | orthogonal_sliders<BLACK>())
+		return false;
+
+	const Bitboard bishops = piece_bb[WHITE_BISHOP] | piece_bb[BLACK_BISHOP];
+	const int knights = piece_count[WHITE_KNIGHT] + piece_count[BLACK_KNIGHT];
+	if (knights + piece_count[WHITE_BISHOP] + piece_count[BLACK_BISHOP] <= 1) return true;
+	if (knights) return false;
+
+	const Bitboard LIGHT_SQUARES = 0x55aa55aa55aa55aa;
+	return !(bishops & LIGHT_SQUARES) || !(bishops & ~LIGHT_SQUARES);
 }
 
+//Returns true if the side to move has a reversible move which leads to a position that has already occurred,
+//so that search can score the line as a draw before the repetition is actually played. ply is the distance 
+//from the root of the search; repetitions of positions at or before the root must already be a repetition
+//themselves to count, since the game has not actually been drawn there. The hash difference between this position
+//and each earlier one with the same side to move is looked up in the cuckoo tables (see
+//zobrist::initialise_cuckoo_tables()), which give the only move that could bridge it
+bool Position::has_game_cycle(int ply) const {
+	//Only positions since the last irreversible move can recur, and the nearest one is 3 plies back
+	const int reversible = std::min(history[game_ply].halfmove, game_ply);
+	const Bitboard occupied = all_pieces<WHITE>() | all_pieces<BLACK>();
+	Move m;
+
+	for (int back = 3; back <= reversible; back += 2) {
+		const int earlier = game_ply - back;
+		if (!zobrist::cuckoo_lookup(hash ^ history[earlier].hash, m)) continue;
+
+		//The move has to be playable: nothing in its way, and a piece of the side to move on one of its squares.
+		//The other square is then empty, since the hash differs only by the moving piece
+		const Square a = m.from(), b = m.to();
+		if (SQUARES_BETWEEN_BB[a][b] & occupied) continue;
+		if (ply > back) return true;
+		if (color_of(board[board[a] != NO_PIECE ? a : b]) != side_to_play) continue;
+
+		//At or before the root, the earlier position must have occurred once more
+		const int oldest = std::max(0, earlier - history[earlier].halfmove);
+		for (int i = earlier - 4; i >= oldest; i -= 2)
+			if (history[i].hash == history[earlier].hash) return true;
+	}
+	return false;
+}
+
+#ifdef SURGE_STATS
+const char* stats::COUNTER_STR[stats::NCOUNTERS] = {
+	"generate_legals", "double check", "single check (pawn/knight)", "single check (slider)", "no check",
+	"pinned pieces", "pinned pawns", "e.p. pseudo-pin tests", "e.p. pseudo-pinned",
+	"play quiet", "play double push", "play O-O", "play O-O-O",
+	"play promotion (N)", "play promotion (B)", "play promotion (R)", "play promotion (Q)",
+	"play capture", "play (unused 9)", "play e.p.", "play (unused 11)",
+	"play promotion capture (N)", "play promotion capture (B)", "play promotion capture (R)",
+	"play promotion capture (Q)",
+	"undo quiet", "undo double push", "undo O-O", "undo O-O-O",
+	"undo promotion (N)", "undo promotion (B)", "undo promotion (R)", "undo promotion (Q)",
+	"undo capture", "undo (unused 9)", "undo e.p.", "undo (unused 11)",
+	"undo promotion capture (N)", "undo promotion capture (B)", "undo promotion capture (R)",
+	"undo promotion capture (Q)",
+};
+
+const char* stats::TIMER_STR[stats::NTIMERS] = {
+	"generate_legals", "play", "undo"
+};
+
+//Every thread with counters registers itself, and the counts of threads that have exited are kept in <retired>
+std::mutex stats_mutex;
+std::vector<stats::ThreadStats*> stats_threads;
+stats::Snapshot stats_retired = {};
+
+stats::ThreadStats::ThreadStats() {
+	for (auto& c : counters) c = 0;
+	for (auto& c : cycles) c = 0;
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	stats_threads.push_back(this);
+}
+
+stats::ThreadStats::~ThreadStats() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	for (int i = 0; i < NCOUNTERS; i++) stats_retired.counters[i] += counters[i];
+	for (int i = 0; i < NTIMERS; i++) stats_retired.cycles[i] += cycles[i];
+	stats_threads.erase(std::find(stats_threads.begin(), stats_threads.end(), this));
+}
+
+//Returns the sum of the counters of all threads, including threads that have exited
+stats::Snapshot stats::merged() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	Snapshot s = stats_retired;
+	for (ThreadStats* t : stats_threads) {
+		for (int i = 0; i < NCOUNTERS; i++) s.counters[i] += t->counters[i].load(std::memory_order_relaxed);
+		for (int i = 0; i < NTIMERS; i++) s.cycles[i] += t->cycles[i].load(std::memory_order_relaxed);
+	}
+	return s;
+}
+
+//Resets the counters of all threads. Counts made by other threads while resetting may be lost
+void stats::reset() {
+	std::lock_guard<std::mutex> lock(stats_mutex);
+	stats_retired = {};
+	for (ThreadStats* t : stats_threads) {
+		for (auto& c : t->counters) c.store(0, std::memory_order_relaxed);
+		for (auto& c : t->cycles) c.store(0, std::memory_order_relaxed);
+	}
+}
+
+//Prints all non-zero counters, and the average number of cycles per call for each timer
+std::ostream& stats::operator<<(std::ostream& os, const Snapshot& s) {
+	for (int i = 0; i < NCOUNTERS; i++)
+		if (s.counters[i]) os << COUNTER_STR[i] << ": " << s.counters[i] << "\n";
+
+	uint64_t plays = 0, undos = 0;
+	for (int i = 0; i < 16; i++) {
+		plays += s.counters[PLAY + i];
+		undos += s.counters[UNDO + i];
+	}
+
+	const uint64_t calls[NTIMERS] = { s.counters[GENERATE_LEGALS], plays, undos };
+	for (int i = 0; i < NTIMERS; i++)
+		if (s.cycles[i] && calls[i]) os << TIMER_STR[i] << ": " << s.cycles[i] / calls[i] << " cycles/call\n";
+	return os;
+}
+#endif
+
 //Pretty-prints the position (including FEN and hash key)
 std::ostream& operator<< (std::ostream& os, const Position& p) {
 	const char* s = "   +---+---+---+---+---+---+---+---+\n";
@@ -1154,18 +2534,67 @@ std::string Position::fen() const {
 		<< (history[game_ply].entry & WHITE_OOO_MASK ? "" : "Q")
 		<< (history[game_ply].entry & BLACK_OO_MASK ? "" : "k")
 		<< (history[game_ply].entry & BLACK_OOO_MASK ? "" : "q")
-		<< (history[game_ply].entry & ALL_CASTLING_MASK ? "- " : "")
-		<< (history[game_ply].epsq == NO_SQUARE ? " -" : SQSTR[history[game_ply].epsq]);
+		<< (castling_rights(history[game_ply].entry) ? " " : "- ")
+		<< (history[game_ply].epsq == NO_SQUARE ? "-" : SQSTR[history[game_ply].epsq])
+		<< " " << history[game_ply].halfmove << " " << (game_ply + start_ply) / 2;
 
 	return fen.str();
 }
 
 	
 
+//Packs the current position. Only the history of the current ply is kept
+PackedPosition Position::pack() const {
+	PackedPosition packed = {};
+	packed.occupied = all_pieces<WHITE>() | all_pieces<BLACK>();
+	int i = 0;
+	for (Bitboard b = packed.occupied; b; i++)
+		packed.pieces[i / 2] |= board[pop_lsb(&b)] << (i & 1) * 4;
+
+	packed.turn = side_to_play;
+	packed.castling = castling_rights(history[game_ply].entry);
+	packed.epsq = history[game_ply].epsq;
+	packed.halfmove = std::min(history[game_ply].halfmove, 255);
+	packed.fullmove = (game_ply + start_ply) / 2;
+	return packed;
+}
+
+//Sets the position to a packed position, without a history. This reuses the position, which is much faster than 
+//constructing a new one
+void Position::unpack(const PackedPosition& packed) {
+	for (size_t i = 0; i < NPIECES; i++) piece_bb[i] = 0, piece_count[i] = 0;
+	for (size_t i = 0; i < NSQUARES; i++) board[i] = NO_PIECE;
+	hash = pawn_hash = material_hash = 0;
+
+	int i = 0;
+	for (Bitboard b = packed.occupied; b; i++)
+		put_piece(Piece((packed.pieces[i / 2] >> (i & 1) * 4) & 0xf), pop_lsb(&b));
+
+	side_to_play = Color(packed.turn);
+	game_ply = 0;
+	start_ply = 2 * packed.fullmove + side_to_play;
+
+	history[0] = UndoInfo();
+	history[0].entry = ALL_CASTLING_MASK & ~((packed.castling & 1 ? WHITE_OO_MASK : 0) |
+		(packed.castling & 2 ? WHITE_OOO_MASK : 0) | (packed.castling & 4 ? BLACK_OO_MASK : 0) |
+		(packed.castling & 8 ? BLACK_OOO_MASK : 0));
+	history[0].epsq = Square(packed.epsq);
+	history[0].halfmove = packed.halfmove;
+
+	if (history[0].epsq != NO_SQUARE) hash ^= zobrist::en_passant_keys[file_of(history[0].epsq)];
+	if (side_to_play == BLACK) hash ^= zobrist::side_key;
+	hash ^= zobrist::castling_keys[packed.castling];
+	history[0].hash = hash;
+}
+
 //Moves a piece to a (possibly empty) square on the board and updates the hash
 void Position::move_piece(Square from, Square to) {
 	hash ^= zobrist::zobrist_table[board[from]][from] ^ zobrist::zobrist_table[board[from]][to]
 		^ zobrist::zobrist_table[board[to]][to];
+	if (type_of(board[from]) == PAWN)
+		pawn_hash ^= zobrist::zobrist_table[board[from]][from] ^ zobrist::zobrist_table[board[from]][to];
+	if (type_of(board[to]) == PAWN) pawn_hash ^= zobrist::zobrist_table[board[to]][to];
+	if (board[to] != NO_PIECE) material_hash ^= zobrist::zobrist_table[board[to]][--piece_count[board[to]]];
 	Bitboard mask = SQUARE_BB[from] | SQUARE_BB[to];
 	piece_bb[board[from]] ^= mask;
 	piece_bb[board[to]] &= ~mask;
@@ -1176,6 +2605,8 @@ void Position::move_piece(Square from, Square to) {
 //Moves a piece to an empty square. Note that it is an error if the <to> square contains a piece
 void Position::move_piece_quiet(Square from, Square to) {
 	hash ^= zobrist::zobrist_table[board[from]][from] ^ zobrist::zobrist_table[board[from]][to];
+	if (type_of(board[from]) == PAWN)
+		pawn_hash ^= zobrist::zobrist_table[board[from]][from] ^ zobrist::zobrist_table[board[from]][to];
 	piece_bb[board[from]] ^= (SQUARE_BB[from] | SQUARE_BB[to]);
 	board[to] = board[from];
 	board[from] = NO_PIECE;
@@ -1327,6 +2758,28 @@ std::ostream& operator<<(std::ostream& os, const Move& m) {
 	return os;
 }
 
+//Returns the move in UCI notation, where castling is written as the king's move and the null move as 0000
+//For example: e5d6; a7a8q; e1g1
+std::string uci_move(Move m) {
+	if (m.to_from() == 0) return "0000";
+	Square to = m.to();
+	if (m.flags() == OO) to = m.from() + EAST + EAST;
+	else if (m.flags() == OOO) to = m.from() + WEST + WEST;
+	std::string s = std::string(SQSTR[m.from()]) + SQSTR[to];
+	if (m.is_promotion()) s += "nbrq"[m.promotion_type() - KNIGHT];
+	return s;
+}
+
+//Prints the perft breakdown as a table
+std::ostream& operator<<(std::ostream& os, const PerftStats& s) {
+	const char* names[] = { "Nodes", "Captures", "E.p.", "Castles", "Promotions", "Checks", "Discovered checks",
+		"Double checks", "Checkmates" };
+	const unsigned long long values[] = { s.nodes, s.captures, s.en_passants, s.castles, s.promotions, s.checks,
+		s.discovered_checks, s.double_checks, s.checkmates };
+	for (int i = 0; i < 9; i++) os << std::left << std::setw(20) << names[i] << std::right << values[i] << "\n";
+	return os;
+}
+
 #include <iostream>
 #include <cstring>	//gk memcpy() 
 
@@ -1438,9 +2891,9 @@ Bitboard get_rook_attacks_for_init(Square square, Bitboard occ) {
 		sliding_attacks(square, occ, MASK_RANK[rank_of(square)]);
 }
 
-Bitboard ROOK_ATTACK_MASKS[64];
-int ROOK_ATTACK_SHIFTS[64];
-Bitboard ROOK_ATTACKS[64][4096];
+const Bitboard* ROOK_ATTACK_MASKS = local_databases.rook_attack_masks;
+const int* ROOK_ATTACK_SHIFTS = local_databases.rook_attack_shifts;
+const Bitboard (*ROOK_ATTACKS)[4096] = local_databases.rook_attacks;
 
 const Bitboard ROOK_MAGICS[64] = {
 	0x0080001020400080, 0x0040001000200040, 0x0080081000200080, 0x0080040800100080,
@@ -1468,17 +2921,17 @@ void initialise_rook_attacks() {
 	for (Square sq = a1; sq <= h8; ++sq) {
 		edges = ((MASK_RANK[AFILE] | MASK_RANK[HFILE]) & ~MASK_RANK[rank_of(sq)]) |
 			((MASK_FILE[AFILE] | MASK_FILE[HFILE]) & ~MASK_FILE[file_of(sq)]);
-		ROOK_ATTACK_MASKS[sq] = (MASK_RANK[rank_of(sq)]
+		local_databases.rook_attack_masks[sq] = (MASK_RANK[rank_of(sq)]
 			^ MASK_FILE[file_of(sq)]) & ~edges;
-		ROOK_ATTACK_SHIFTS[sq] = 64 - pop_count(ROOK_ATTACK_MASKS[sq]);
+		local_databases.rook_attack_shifts[sq] = 64 - pop_count(local_databases.rook_attack_masks[sq]);
 
 		subset = 0;
 		do {
 			index = subset;
 			index = index * ROOK_MAGICS[sq];
-			index = index >> ROOK_ATTACK_SHIFTS[sq];
-			ROOK_ATTACKS[sq][index] = get_rook_attacks_for_init(sq, subset);
-			subset = (subset - ROOK_ATTACK_MASKS[sq]) & ROOK_ATTACK_MASKS[sq];
+			index = index >> local_databases.rook_attack_shifts[sq];
+			local_databases.rook_attacks[sq][index] = get_rook_attacks_for_init(sq, subset);
+			subset = (subset - local_databases.rook_attack_masks[sq]) & local_databases.rook_attack_masks[sq];
 		} while (subset);
 	}
 }
@@ -1505,9 +2958,9 @@ Bitboard get_bishop_attacks_for_init(Square square, Bitboard occ) {
 		sliding_attacks(square, occ, MASK_ANTI_DIAGONAL[anti_diagonal_of(square)]);
 }
 
-Bitboard BISHOP_ATTACK_MASKS[64];
-int BISHOP_ATTACK_SHIFTS[64];
-Bitboard BISHOP_ATTACKS[64][512];
+const Bitboard* BISHOP_ATTACK_MASKS = local_databases.bishop_attack_masks;
+const int* BISHOP_ATTACK_SHIFTS = local_databases.bishop_attack_shifts;
+const Bitboard (*BISHOP_ATTACKS)[512] = local_databases.bishop_attacks;
 
 const Bitboard BISHOP_MAGICS[64] = {
 	0x0002020202020200, 0x0002020202020000, 0x0004010202000000, 0x0004040080000000,
@@ -1535,17 +2988,17 @@ void initialise_bishop_attacks() {
 	for (Square sq = a1; sq <= h8; ++sq) {
 		edges = ((MASK_RANK[AFILE] | MASK_RANK[HFILE]) & ~MASK_RANK[rank_of(sq)]) |
 			((MASK_FILE[AFILE] | MASK_FILE[HFILE]) & ~MASK_FILE[file_of(sq)]);
-		BISHOP_ATTACK_MASKS[sq] = (MASK_DIAGONAL[diagonal_of(sq)]
+		local_databases.bishop_attack_masks[sq] = (MASK_DIAGONAL[diagonal_of(sq)]
 			^ MASK_ANTI_DIAGONAL[anti_diagonal_of(sq)]) & ~edges;
-		BISHOP_ATTACK_SHIFTS[sq] = 64 - pop_count(BISHOP_ATTACK_MASKS[sq]);
+		local_databases.bishop_attack_shifts[sq] = 64 - pop_count(local_databases.bishop_attack_masks[sq]);
 
 		subset = 0;
 		do {
 			index = subset;
 			index = index * BISHOP_MAGICS[sq];
-			index = index >> BISHOP_ATTACK_SHIFTS[sq];
-			BISHOP_ATTACKS[sq][index] = get_bishop_attacks_for_init(sq, subset);
-			subset = (subset - BISHOP_ATTACK_MASKS[sq]) & BISHOP_ATTACK_MASKS[sq];
+			index = index >> local_databases.bishop_attack_shifts[sq];
+			local_databases.bishop_attacks[sq][index] = get_bishop_attacks_for_init(sq, subset);
+			subset = (subset - local_databases.bishop_attack_masks[sq]) & local_databases.bishop_attack_masks[sq];
 		} while (subset);
 	}
 }
@@ -1565,7 +3018,7 @@ Bitboard get_xray_bishop_attacks(Square square, Bitboard occ, Bitboard blockers)
 	return attacks ^ get_bishop_attacks(square, occ ^ blockers);
 }
 
-Bitboard SQUARES_BETWEEN_BB[64][64];
+const Bitboard (*SQUARES_BETWEEN_BB)[NSQUARES] = local_databases.squares_between_bb;
 
 //Initializes the lookup table for the bitboard of squares in between two given squares (0 if the 
 //two squares are not aligned)
@@ -1575,15 +3028,15 @@ void initialise_squares_between() {
 		for (Square sq2 = a1; sq2 <= h8; ++sq2) {
 			sqs = SQUARE_BB[sq1] | SQUARE_BB[sq2];
 			if (file_of(sq1) == file_of(sq2) || rank_of(sq1) == rank_of(sq2))
-				SQUARES_BETWEEN_BB[sq1][sq2] =
+				local_databases.squares_between_bb[sq1][sq2] =
 				get_rook_attacks_for_init(sq1, sqs) & get_rook_attacks_for_init(sq2, sqs);
 			else if (diagonal_of(sq1) == diagonal_of(sq2) || anti_diagonal_of(sq1) == anti_diagonal_of(sq2))
-				SQUARES_BETWEEN_BB[sq1][sq2] =
+				local_databases.squares_between_bb[sq1][sq2] =
 				get_bishop_attacks_for_init(sq1, sqs) & get_bishop_attacks_for_init(sq2, sqs);
 		}
 }
 
-Bitboard LINE[64][64];
+const Bitboard (*LINE)[NSQUARES] = local_databases.line;
 
 //Initializes the lookup table for the bitboard of all squares along the line of two given squares (0 if the 
 //two squares are not aligned)
@@ -1591,41 +3044,217 @@ void initialise_line() {
 	for (Square sq1 = a1; sq1 <= h8; ++sq1)
 		for (Square sq2 = a1; sq2 <= h8; ++sq2) {
 			if (file_of(sq1) == file_of(sq2) || rank_of(sq1) == rank_of(sq2))
-				LINE[sq1][sq2] =
+				local_databases.line[sq1][sq2] =
 				//gk additional parentheses
 				(get_rook_attacks_for_init(sq1, 0) & get_rook_attacks_for_init(sq2, 0))
 				| SQUARE_BB[sq1] | SQUARE_BB[sq2];
 			else if (diagonal_of(sq1) == diagonal_of(sq2) || anti_diagonal_of(sq1) == anti_diagonal_of(sq2))
-				LINE[sq1][sq2] =
+				local_databases.line[sq1][sq2] =
 				//gk additional parentheses
 				(get_bishop_attacks_for_init(sq1, 0) & get_bishop_attacks_for_init(sq2, 0))
 				| SQUARE_BB[sq1] | SQUARE_BB[sq2];
 		}
 }
 
-Bitboard PAWN_ATTACKS[NCOLORS][NSQUARES];
-Bitboard PSEUDO_LEGAL_ATTACKS[NPIECE_TYPES][NSQUARES];
+const Bitboard (*PAWN_ATTACKS)[NSQUARES] = local_databases.pawn_attacks;
+const Bitboard (*PSEUDO_LEGAL_ATTACKS)[NSQUARES] = local_databases.pseudo_legal_attacks;
 
 //Initializes the table containg pseudolegal attacks of each piece for each square. This does not include blockers
 //for sliding pieces
 void initialise_pseudo_legal() {
-	memcpy(PAWN_ATTACKS[WHITE], WHITE_PAWN_ATTACKS, sizeof(WHITE_PAWN_ATTACKS));
-	memcpy(PAWN_ATTACKS[BLACK], BLACK_PAWN_ATTACKS, sizeof(BLACK_PAWN_ATTACKS));
-	memcpy(PSEUDO_LEGAL_ATTACKS[KNIGHT], KNIGHT_ATTACKS, sizeof(KNIGHT_ATTACKS));
-	memcpy(PSEUDO_LEGAL_ATTACKS[KING], KING_ATTACKS, sizeof(KING_ATTACKS));
+	memcpy(local_databases.pawn_attacks[WHITE], WHITE_PAWN_ATTACKS, sizeof(WHITE_PAWN_ATTACKS));
+	memcpy(local_databases.pawn_attacks[BLACK], BLACK_PAWN_ATTACKS, sizeof(BLACK_PAWN_ATTACKS));
+	memcpy(local_databases.pseudo_legal_attacks[KNIGHT], KNIGHT_ATTACKS, sizeof(KNIGHT_ATTACKS));
+	memcpy(local_databases.pseudo_legal_attacks[KING], KING_ATTACKS, sizeof(KING_ATTACKS));
 	for (Square s = a1; s <= h8; ++s) {
-		PSEUDO_LEGAL_ATTACKS[ROOK][s] = get_rook_attacks_for_init(s, 0);
-		PSEUDO_LEGAL_ATTACKS[BISHOP][s] = get_bishop_attacks_for_init(s, 0);
-		PSEUDO_LEGAL_ATTACKS[QUEEN][s] = PSEUDO_LEGAL_ATTACKS[ROOK][s] |
-			PSEUDO_LEGAL_ATTACKS[BISHOP][s];
+		local_databases.pseudo_legal_attacks[ROOK][s] = get_rook_attacks_for_init(s, 0);
+		local_databases.pseudo_legal_attacks[BISHOP][s] = get_bishop_attacks_for_init(s, 0);
+		local_databases.pseudo_legal_attacks[QUEEN][s] = local_databases.pseudo_legal_attacks[ROOK][s] |
+			local_databases.pseudo_legal_attacks[BISHOP][s];
 	}
 }
 
 //Initializes lookup tables for rook moves, bishop moves, in-between squares, aligned squares and pseudolegal moves
 void initialise_all_databases() {
+	advise_large_pages(&local_databases, sizeof(local_databases));
 	initialise_rook_attacks();
 	initialise_bishop_attacks();
 	initialise_squares_between();
 	initialise_line();
 	initialise_pseudo_legal();
 }
+
+#include <cstdio>
+#include <cstdlib>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#endif
+
+//Asks for a range of memory to be backed by transparent huge pages, where the kernel supports them
+static void advise_large_pages(void* p, size_t size) {
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	madvise(p, size, MADV_HUGEPAGE);
+#else
+	(void) p, (void) size;
+#endif
+}
+
+//Allocates zeroed memory in 2 MB pages. Explicit huge pages from the hugetlbfs pool are used if any are reserved
+//(vm.nr_hugepages), then 2 MB-aligned memory advised for transparent huge pages, and otherwise ordinary pages.
+//The size is rounded up to a whole number of large pages. Returns nullptr if no memory could be allocated
+void* allocate_large_pages(size_t size, LargePages* pages) {
+	size = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+	if (pages) *pages = SMALL_PAGES;
+
+#if defined(__unix__) || defined(__APPLE__)
+#ifdef MAP_HUGETLB
+	void* p = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (p != MAP_FAILED) {
+		if (pages) *pages = HUGETLB_PAGES;
+		return p;
+	}
+#endif
+
+	//Transparent huge pages are only used for 2 MB-aligned ranges, so an extra page is mapped and the
+	//unaligned ends are trimmed off
+	char* q = (char*) mmap(nullptr, size + LARGE_PAGE_SIZE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+		-1, 0);
+	if (q == (char*) MAP_FAILED) return nullptr;
+
+	char* aligned = (char*) ((uintptr_t(q) + LARGE_PAGE_SIZE - 1) & ~uintptr_t(LARGE_PAGE_SIZE - 1));
+	if (aligned != q) munmap(q, aligned - q);
+	if (q + LARGE_PAGE_SIZE != aligned) munmap(aligned + size, q + LARGE_PAGE_SIZE - aligned);
+
+#if defined(__linux__) && defined(MADV_HUGEPAGE)
+	if (madvise(aligned, size, MADV_HUGEPAGE) == 0 && pages) *pages = TRANSPARENT_HUGE_PAGES;
+#endif
+	return aligned;
+#else
+	return calloc(1, size);
+#endif
+}
+
+//Frees memory from allocate_large_pages(), given the size that was requested
+void free_large_pages(void* p, size_t size) {
+	if (!p) return;
+	size = (size + LARGE_PAGE_SIZE - 1) & ~(LARGE_PAGE_SIZE - 1);
+#if defined(__unix__) || defined(__APPLE__)
+	munmap(p, size);
+#else
+	(void) size;
+	free(p);
+#endif
+}
+
+static const char DATABASE_MAGIC[8] = "SURGEDB";
+
+//Returns the tables currently in use
+const Databases& databases() {
+	return *active_databases;
+}
+
+//Points every table at a set of databases, which must stay valid for as long as it is used
+void use_databases(const Databases& db) {
+	active_databases = &db;
+	ROOK_ATTACK_MASKS = db.rook_attack_masks;
+	ROOK_ATTACK_SHIFTS = db.rook_attack_shifts;
+	ROOK_ATTACKS = db.rook_attacks;
+	BISHOP_ATTACK_MASKS = db.bishop_attack_masks;
+	BISHOP_ATTACK_SHIFTS = db.bishop_attack_shifts;
+	BISHOP_ATTACKS = db.bishop_attacks;
+	SQUARES_BETWEEN_BB = db.squares_between_bb;
+	LINE = db.line;
+	PAWN_ATTACKS = db.pawn_attacks;
+	PSEUDO_LEGAL_ATTACKS = db.pseudo_legal_attacks;
+
+	zobrist::zobrist_table = db.zobrist_table;
+	zobrist::side_key = db.side_key;
+	zobrist::castling_keys = db.castling_keys;
+	zobrist::en_passant_keys = db.en_passant_keys;
+	zobrist::cuckoo_keys = db.cuckoo_keys;
+	zobrist::cuckoo_moves = db.cuckoo_moves;
+}
+
+//Writes the tables of this process to a database file. Both initialise_all_databases() and 
+//zobrist::initialise_zobrist_keys() must have been called first. The file is written under a temporary name and
+//renamed, so that other processes never map a partially written file
+bool save_databases(const std::string& path) {
+	memcpy(local_databases.magic, DATABASE_MAGIC, sizeof(DATABASE_MAGIC));
+	local_databases.version = DATABASE_VERSION;
+	local_databases.size = sizeof(Databases);
+
+#if defined(__unix__) || defined(__APPLE__)
+	const std::string tmp = path + "." + std::to_string(getpid()) + ".tmp";
+#else
+	const std::string tmp = path + ".tmp";
+#endif
+	FILE* f = fopen(tmp.c_str(), "wb");
+	if (!f) return false;
+
+	bool ok = fwrite(&local_databases, sizeof(Databases), 1, f) == 1;
+	ok = fclose(f) == 0 && ok;
+	ok = ok && rename(tmp.c_str(), path.c_str()) == 0;
+	if (!ok) remove(tmp.c_str());
+	return ok;
+}
+
+//Maps a database file read-only and uses its tables from then on, instead of initialising them. The pages of 
+//the file are shared by every process that maps it. Returns false, leaving the tables unchanged, if the file 
+//does not exist or was written by a different version or build
+bool map_databases(const std::string& path) {
+#if defined(__unix__) || defined(__APPLE__)
+	int fd = open(path.c_str(), O_RDONLY);
+	if (fd < 0) return false;
+
+	struct stat st;
+	void* p = MAP_FAILED;
+	if (fstat(fd, &st) == 0 && st.st_size == sizeof(Databases))
+		p = mmap(nullptr, sizeof(Databases), PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if (p == MAP_FAILED) return false;
+
+	//Only has an effect for files in tmpfs with shmem_enabled set to advise
+	advise_large_pages(p, sizeof(Databases));
+
+	const Databases* db = (const Databases*) p;
+	if (memcmp(db->magic, DATABASE_MAGIC, sizeof(DATABASE_MAGIC)) != 0 || db->version != DATABASE_VERSION ||
+		db->size != sizeof(Databases)) {
+		munmap(p, sizeof(Databases));
+		return false;
+	}
+
+	//The mapping is kept for the lifetime of the process
+	use_databases(*db);
+	return true;
+#else
+	(void) path;
+	return false;
+#endif
+}
+
+//Initializes all tables by mapping a database file, creating the file first if it is missing or out of date. 
+//Replaces the calls to initialise_all_databases() and zobrist::initialise_zobrist_keys(). Returns false if the
+//file could not be written or mapped, in which case the tables of this process are used
+bool initialise_shared_databases(const std::string& path) {
+	if (map_databases(path)) return true;
+
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+	return save_databases(path) && map_databases(path);
+}
+
+//Copies the tables into explicit huge pages if any are reserved, or otherwise into transparent huge pages, and 
+//uses the copy from then on. Call after the tables are initialised or mapped. The static tables are already
+//advised for transparent huge pages, so this mostly matters for explicit huge pages and mapped database files.
+//Returns false if the copy could not be allocated
+bool move_databases_to_large_pages() {
+	void* p = allocate_large_pages(sizeof(Databases));
+	if (!p) return false;
+
+	memcpy(p, &databases(), sizeof(Databases));
+	use_databases(*(const Databases*) p);
+	return true;
+}
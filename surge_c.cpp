@@ -0,0 +1,236 @@
+#include <mutex>
+#include "surge.h"
+#include "surge_c.h"
+
+static_assert(sizeof(Move) == sizeof(surge_move), "Moves are passed as 16-bit integers");
+static_assert(SURGE_INPUT_PLANES == INPUT_PLANES && SURGE_POLICY_PLANES == POLICY_PLANES,
+	"The encoding sizes must match surge.h");
+
+struct surge_position {
+	Position p;
+
+	explicit surge_position(const std::string& fen) : p(fen) {}
+};
+
+namespace {
+
+std::once_flag initialised;
+
+//Returns true if a FEN counter is a number of at most 6 digits
+bool valid_counter(const std::string& s) {
+	return !s.empty() && s.size() <= 6 && s.find_first_not_of("0123456789") == std::string::npos;
+}
+
+//Checks the fields of a FEN that the Position constructor relies on, so that a malformed FEN cannot place pieces
+//outside the board or look up an en passant square off the board. The castling, en passant and counter fields may
+//be left out, as the constructor allows, but must be well-formed when present
+bool valid_fen(const char* fen) {
+	if (!fen) return false;
+	std::istringstream ss(fen);
+	std::string board, side, castling, ep, halfmove, fullmove;
+	if (!(ss >> board >> side) || (side != "w" && side != "b")) return false;
+
+	if (ss >> castling && castling != "-") {
+		if (castling.size() > 4) return false;
+		for (size_t i = 0; i < castling.size(); i++)
+			if (std::string("KQkq").find(castling[i]) == std::string::npos ||
+				castling.find(castling[i], i + 1) != std::string::npos) return false;
+	}
+
+	//The en passant square is behind a pawn which has just double pushed, on the 6th rank if white is to move
+	if (ss >> ep && ep != "-" &&
+		(ep.size() != 2 || ep[0] < 'a' || ep[0] > 'h' || ep[1] != (side == "w" ? '6' : '3'))) return false;
+
+	if (ss >> halfmove && !valid_counter(halfmove)) return false;
+	if (ss >> fullmove && !valid_counter(fullmove)) return false;
+
+	int squares = 0, ranks = 1, kings[2] = {};
+	for (char ch : board) {
+		if (ch == '/') {
+			if (squares != 8 * ranks++) return false;
+		} else if (ch >= '1' && ch <= '8') {
+			squares += ch - '0';
+		} else {
+			size_t pc = PIECE_STR.find(ch);
+			if (pc == std::string::npos || ch == '~' || ch == '>' || ch == '.') return false;
+			if (type_of(Piece(pc)) == KING) kings[color_of(Piece(pc))]++;
+			squares++;
+		}
+		if (squares > 8 * ranks) return false;
+	}
+	return ranks == 8 && squares == 64 && kings[WHITE] == 1 && kings[BLACK] == 1;
+}
+
+template<Color Us>
+size_t legal_moves(Position& p, Move* moves) {
+	return p.generate_legals<Us>(moves) - moves;
+}
+
+size_t legal_moves(Position& p, Move* moves) {
+	return p.turn() == WHITE ? legal_moves<WHITE>(p, moves) : legal_moves<BLACK>(p, moves);
+}
+
+//Finds a move among the legal moves, so that moves from the caller are never played blindly
+bool is_legal(Position& p, Move m) {
+	Move list[SURGE_MAX_MOVES];
+	const size_t n = legal_moves(p, list);
+	for (size_t i = 0; i < n; i++)
+		if (list[i].to_from() == m.to_from()) return true;
+	return false;
+}
+
+void play(Position& p, Move m) {
+	if (p.turn() == WHITE) p.play<WHITE>(m);
+	else p.play<BLACK>(m);
+}
+
+}
+
+int surge_api_version(void) {
+	return SURGE_C_API_VERSION;
+}
+
+void surge_init(void) {
+	std::call_once(initialised, [] {
+		initialise_all_databases();
+		zobrist::initialise_zobrist_keys();
+	});
+}
+
+surge_position* surge_new(const char* fen) {
+	surge_init();
+	return valid_fen(fen) ? new surge_position(fen) : nullptr;
+}
+
+surge_position* surge_copy(const surge_position* p) {
+	return new surge_position(*p);
+}
+
+void surge_free(surge_position* p) {
+	delete p;
+}
+
+size_t surge_fen(const surge_position* p, char* buf, size_t size) {
+	const std::string fen = p->p.fen();
+	if (size > 0) {
+		const size_t n = std::min(fen.size(), size - 1);
+		memcpy(buf, fen.data(), n);
+		buf[n] = '\0';
+	}
+	return fen.size();
+}
+
+int surge_turn(const surge_position* p) {
+	return p->p.turn();
+}
+
+uint64_t surge_hash(const surge_position* p) {
+	return p->p.get_hash();
+}
+
+int surge_in_check(const surge_position* p) {
+	return p->p.turn() == WHITE ? p->p.in_check<WHITE>() : p->p.in_check<BLACK>();
+}
+
+size_t surge_legal_moves(surge_position* p, surge_move* moves) {
+	return legal_moves(p->p, (Move*) moves);
+}
+
+int surge_play(surge_position* p, surge_move m) {
+	if (p->p.ply() >= MAX_GAME_PLY - 1 || !is_legal(p->p, Move(m))) return 0;
+	play(p->p, Move(m));
+	return 1;
+}
+
+int surge_undo(surge_position* p, surge_move m) {
+	if (p->p.ply() == 0) return 0;
+	if (p->p.turn() == WHITE) p->p.undo<BLACK>(Move(m));
+	else p->p.undo<WHITE>(Move(m));
+	return 1;
+}
+
+void surge_move_uci(surge_move move, char* buf) {
+	const std::string uci = uci_move(Move(move));
+	memcpy(buf, uci.c_str(), uci.size() + 1);
+}
+
+int surge_parse_uci(surge_position* p, const char* uci, surge_move* m) {
+	Move list[SURGE_MAX_MOVES];
+	const size_t n = legal_moves(p->p, list);
+	char buf[6];
+	for (size_t i = 0; i < n; i++) {
+		surge_move_uci(list[i].to_from(), buf);
+		if (strcmp(buf, uci) == 0) {
+			*m = list[i].to_from();
+			return 1;
+		}
+	}
+	return 0;
+}
+
+uint64_t surge_perft(surge_position* p, int depth) {
+	if (depth <= 0) return 1;
+	return p->p.turn() == WHITE ? perft<WHITE>(p->p, depth) : perft<BLACK>(p->p, depth);
+}
+
+size_t surge_new_batch(const char* const* fens, size_t n, surge_position** out) {
+	size_t created = 0;
+	for (size_t i = 0; i < n; i++) {
+		out[i] = surge_new(fens[i]);
+		created += out[i] != nullptr;
+	}
+	return created;
+}
+
+void surge_free_batch(surge_position* const* positions, size_t n) {
+	for (size_t i = 0; i < n; i++) delete positions[i];
+}
+
+size_t surge_legal_moves_batch(surge_position* const* positions, size_t n, surge_move* moves, size_t capacity,
+	uint32_t* offsets) {
+	Move list[SURGE_MAX_MOVES];
+	offsets[0] = 0;
+	for (size_t i = 0; i < n; i++) {
+		//Moves are generated directly into the caller's buffer when it has room for the worst case
+		const size_t used = offsets[i];
+		size_t count;
+		if (capacity - used >= SURGE_MAX_MOVES) {
+			count = legal_moves(positions[i]->p, (Move*) moves + used);
+		} else {
+			count = legal_moves(positions[i]->p, list);
+			if (count > capacity - used) return i;
+			memcpy(moves + used, list, count * sizeof(Move));
+		}
+		offsets[i + 1] = uint32_t(used + count);
+	}
+	return n;
+}
+
+size_t surge_play_moves(surge_position* p, const surge_move* moves, size_t n) {
+	for (size_t i = 0; i < n; i++)
+		if (!surge_play(p, moves[i])) return i;
+	return n;
+}
+
+size_t surge_play_uci(surge_position* p, const char* moves) {
+	std::istringstream ss(moves);
+	std::string uci;
+	size_t played = 0;
+	surge_move m;
+	while (ss >> uci) {
+		if (!surge_parse_uci(p, uci.c_str(), &m) || !surge_play(p, m)) break;
+		played++;
+	}
+	return played;
+}
+
+void surge_perft_batch(surge_position* const* positions, size_t n, int depth, uint64_t* out) {
+	for (size_t i = 0; i < n; i++) out[i] = surge_perft(positions[i], depth);
+}
+
+void surge_encode_batch(surge_position* const* positions, size_t n, float* planes, uint64_t* masks) {
+	for (size_t i = 0; i < n; i++) {
+		if (planes) write_planes(positions[i]->p, planes + i * INPUT_PLANES * NSQUARES);
+		if (masks) legal_move_masks(positions[i]->p, (Bitboard (*)[NSQUARES]) (masks + i * POLICY_PLANES * NSQUARES));
+	}
+}
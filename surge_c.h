@@ -0,0 +1,104 @@
+#pragma once
+
+//A C interface to surge, for Python (ctypes, cffi) and other languages with a C foreign function interface.
+//Positions are opaque handles, the side to move is taken from the position, and the batch functions work on many
+//positions per call and write into buffers owned by the caller, so that the cost of crossing the boundary is
+//shared by many moves.
+//
+//Moves use the same 16-bit encoding as the C++ Move class: the destination square in bits 0-5, the origin square
+//in bits 6-11 and the move flags in bits 12-15. Squares are numbered from a1 = 0 to h8 = 63. Castling moves go
+//from the king's square and are told apart by their flags: O-O (flags 2) goes to the rook's square, e1-h1 or
+//e8-h8, and O-O-O (flags 3) goes to the king's destination, e1-c1 or e8-c8.
+//
+//Build as a shared library:
+//	g++ -std=c++17 -O3 -march=native -fPIC -fvisibility=hidden -shared surge_c.cpp -o libsurge.so
+
+#include <stddef.h>
+#include <stdint.h>
+
+#if defined(_WIN32)
+#define SURGE_API __declspec(dllexport)
+#else
+#define SURGE_API __attribute__((visibility("default")))
+#endif
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//Incremented whenever a function changes in a way that is not backwards compatible
+#define SURGE_C_API_VERSION 1
+
+//The largest number of legal moves in any position
+#define SURGE_MAX_MOVES 218
+
+//The number of values per position written by surge_encode_batch(): input planes of 64 squares, and move mask
+//bitboards for each plane and origin square
+#define SURGE_INPUT_PLANES 17
+#define SURGE_POLICY_PLANES 4
+
+typedef struct surge_position surge_position;
+typedef uint16_t surge_move;
+
+SURGE_API int surge_api_version(void);
+
+//Initialises the lookup tables and Zobrist keys. Other functions call it as needed, and it is safe to call from
+//several threads
+SURGE_API void surge_init(void);
+
+//Returns a new position, or NULL if the FEN is malformed
+SURGE_API surge_position* surge_new(const char* fen);
+SURGE_API surge_position* surge_copy(const surge_position* p);
+SURGE_API void surge_free(surge_position* p);
+
+//Writes the FEN of a position to buf, like snprintf, and returns its length
+SURGE_API size_t surge_fen(const surge_position* p, char* buf, size_t size);
+
+//Returns 0 if White is to move and 1 if Black is to move
+SURGE_API int surge_turn(const surge_position* p);
+SURGE_API uint64_t surge_hash(const surge_position* p);
+SURGE_API int surge_in_check(const surge_position* p);
+
+//Writes the legal moves to moves, which must have room for SURGE_MAX_MOVES, and returns how many there are
+SURGE_API size_t surge_legal_moves(surge_position* p, surge_move* moves);
+
+//Plays a move if it is legal, and returns 1 if it was played and 0 otherwise
+SURGE_API int surge_play(surge_position* p, surge_move m);
+
+//Takes back the last move, which must be passed. Only moves played since the position was created can be undone
+SURGE_API int surge_undo(surge_position* p, surge_move m);
+
+//Converts between moves and UCI strings such as "e2e4", "e1g1" or "a7a8q". surge_parse_uci returns 0 if the
+//string is not a legal move in the position. The null move (0) is written as "0000". buf must have room for 6
+//characters
+SURGE_API int surge_parse_uci(surge_position* p, const char* uci, surge_move* m);
+SURGE_API void surge_move_uci(surge_move m, char* buf);
+
+SURGE_API uint64_t surge_perft(surge_position* p, int depth);
+
+//Creates a position for each of n FENs. Malformed FENs give NULL. Returns the number of positions created
+SURGE_API size_t surge_new_batch(const char* const* fens, size_t n, surge_position** out);
+SURGE_API void surge_free_batch(surge_position* const* positions, size_t n);
+
+//Writes the legal moves of n positions one after another into moves, which has room for capacity moves. The moves
+//of position i are moves[offsets[i]] to moves[offsets[i + 1] - 1], so offsets must have room for n + 1 values.
+//Returns the number of positions whose moves were written, which is less than n if moves is full
+SURGE_API size_t surge_legal_moves_batch(surge_position* const* positions, size_t n, surge_move* moves,
+	size_t capacity, uint32_t* offsets);
+
+//Plays a sequence of moves, stopping at the first illegal one, and returns the number of moves played
+SURGE_API size_t surge_play_moves(surge_position* p, const surge_move* moves, size_t n);
+
+//Plays a sequence of UCI moves separated by spaces, stopping at the first illegal one, and returns the number of
+//moves played
+SURGE_API size_t surge_play_uci(surge_position* p, const char* moves);
+
+SURGE_API void surge_perft_batch(surge_position* const* positions, size_t n, int depth, uint64_t* out);
+
+//Writes n * SURGE_INPUT_PLANES * 64 input values and n * SURGE_POLICY_PLANES * 64 move mask bitboards, from the
+//point of view of the side to move. Either buffer may be NULL
+SURGE_API void surge_encode_batch(surge_position* const* positions, size_t n, float* planes, uint64_t* masks);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,610 @@
+#include <iostream>
+#include <iomanip>
+#include <fstream>
+#include <chrono>
+#include <thread>
+#include <atomic>
+#include <memory>
+#include "tablebase.h"
+
+//Generates endgame tablebases by retrograde analysis, and benchmarks probing them.
+//
+//Generation starts by playing every legal move from every position of the table. Moves which capture or promote
+//lead to smaller tables that are generated first, and are looked up directly; the other moves are counted.
+//Positions are then resolved in order of the number of plies to mate. Starting from checkmates, the predecessors
+//of each position resolved at ply n are found by generating unmoves: a predecessor of a loss is a win at ply
+//n + 1, and a predecessor of a win is lost once all of its counted moves lead to wins. Positions that are never
+//resolved are draws. Each ply is processed by several threads, which update positions with atomic operations.
+//
+//Usage:
+//	tablebase generate <dir> <material>... [-t threads]   Generates tables such as KQvK or KRPvKR, and the
+//	                                                       smaller tables they depend on
+//	tablebase probe <dir> <fen>                            Prints the value of a position and its best line
+//	tablebase bench <dir> [probes per table]               Measures probes/s on random positions
+
+using namespace tablebase;
+
+//The state of a position during generation, packed into 32 bits so that it can be updated atomically:
+//	bits 0-1    UNKNOWN, RESOLVED, INVALID or STALEMATED
+//	bits 2-11   the ply of a resolved position
+//	bits 12-19  the number of counted moves that have not been found to lose, or CANNOT_LOSE
+//	bits 20-29  the earliest ply at which the position can be lost, after its capturing and promoting moves
+enum State : uint32_t {
+	UNKNOWN, RESOLVED, INVALID, STALEMATED
+};
+
+const uint32_t CANNOT_LOSE = 255;
+const int MAX_TB_PLY = 1023;
+
+inline State state_of(uint32_t e) { return State(e & 3); }
+inline int ply_of(uint32_t e) { return (e >> 2) & 1023; }
+inline uint32_t count_of(uint32_t e) { return (e >> 12) & 255; }
+inline int loss_ply_of(uint32_t e) { return (e >> 20) & 1023; }
+
+inline uint32_t make_entry(State s, int ply, uint32_t count, int loss_ply) {
+	return s | uint32_t(ply) << 2 | count << 12 | uint32_t(loss_ply) << 20;
+}
+
+//A list of (ply, index) pairs found by one thread
+typedef std::vector<std::pair<int, uint64_t>> Found;
+
+//Runs f(thread, begin, end) over [0, n) split between threads
+template<typename F>
+void parallel_for(int threads, uint64_t n, F f) {
+	std::vector<std::thread> workers;
+	for (int t = 0; t < threads; t++)
+		workers.emplace_back(f, t, n * t / threads, n * (t + 1) / threads);
+	for (std::thread& w : workers) w.join();
+}
+
+class Generator {
+public:
+	Generator(const std::string& dir, int threads) : dir(dir), threads(threads) {}
+
+	const std::vector<uint16_t>& table(const Material& m);
+
+private:
+	std::string dir;
+	int threads;
+
+	//The values of every table generated or read so far, for looking up the results of captures and promotions
+	std::map<std::string, std::vector<uint16_t>> tables;
+
+	void generate(const Material& m, std::vector<uint16_t>& values);
+	uint16_t lookup(const Position& p) const;
+	bool read(const Material& m, std::vector<uint16_t>& values);
+	void write(const Material& m, const std::vector<uint16_t>& values, Kind kind, const std::string& path);
+
+	template<Color Us>
+	void classify(Position& p, uint64_t index, std::atomic<uint32_t>* entries, Found& found) const;
+	void propagate(const Material& m, uint64_t index, int ply, std::atomic<uint32_t>* entries, Found& found) const;
+};
+
+//Returns the value of a position from the tables in memory, for the side to move
+uint16_t Generator::lookup(const Position& p) const {
+	Material m;
+	bool flipped;
+	material_of(p, m, flipped);
+	if (m.n == 2) return 0;
+
+	Square sq[MAX_PIECES];
+	squares_of(p, m, flipped, sq);
+	return tables.at(m.name())[encode(m, sq, flipped ? ~p.turn() : p.turn())];
+}
+
+//Sets up the starting state of a valid position: checkmates are lost at ply 0, and captures and promotions are
+//looked up. A capture or promotion to a lost position is a win, which is queued at its ply since a quicker
+//win may still be found
+template<Color Us>
+void Generator::classify(Position& p, uint64_t index, std::atomic<uint32_t>* entries, Found& found) const {
+	MoveList<Us> list(p);
+
+	if (list.size() == 0) {
+		entries[index] = p.checkers ? make_entry(RESOLVED, 0, 0, 0) : make_entry(STALEMATED, 0, 0, 0);
+		if (p.checkers) found.push_back({ 0, index });
+		return;
+	}
+
+	uint32_t count = 0;
+	bool can_lose = true;
+	int win_ply = MAX_TB_PLY + 1, loss_ply = 0;
+
+	for (Move m : list) {
+		if (!m.is_capture() && !m.is_promotion()) {
+			count++;
+			continue;
+		}
+
+		p.play<Us>(m);
+		uint16_t value = lookup(p);
+		p.undo<Us>(m);
+
+		//The value is for the opponent
+		int plies = value - 1;
+		if (value == 0) can_lose = false;
+		else if (plies % 2 == 0) {
+			can_lose = false;
+			win_ply = std::min(win_ply, plies + 1);
+		} else loss_ply = std::max(loss_ply, plies + 1);
+	}
+
+	if (win_ply <= MAX_TB_PLY) found.push_back({ win_ply, index });
+
+	if (count == 0 && can_lose) {
+		entries[index] = make_entry(RESOLVED, loss_ply, 0, 0);
+		found.push_back({ loss_ply, index });
+	} else {
+		entries[index] = make_entry(UNKNOWN, 0, can_lose ? count : CANNOT_LOSE, loss_ply);
+	}
+}
+
+//Updates the predecessors of a position resolved at <ply>. Every placement of the pieces with this index is
+//unmoved, but only predecessors whose placement is reduced already are updated, so each move of a predecessor
+//is counted exactly once
+void Generator::propagate(const Material& m, uint64_t index, int ply, std::atomic<uint32_t>* entries,
+	Found& found) const {
+	Square sq[MAX_PIECES], variants[8][MAX_PIECES];
+	Color stm;
+	decode(m, index, sq, stm);
+	const Color mover = ~stm;
+
+	int nvariants = 0;
+	for (int x = 0; x < symmetries(m); x++) {
+		Square* v = variants[nvariants];
+		for (int i = 0; i < m.n; i++) v[i] = transform(sq[i], x);
+		sort_groups(m, v);
+
+		//With the white king on the diagonal, a reflected placement can have an index of its own
+		bool duplicate = encode(m, v, stm) != index;
+		for (int j = 0; j < nvariants && !duplicate; j++)
+			duplicate = std::equal(v, v + m.n, variants[j]);
+		if (!duplicate) nvariants++;
+	}
+
+	for (int j = 0; j < nvariants; j++) {
+		const Square* v = variants[j];
+		Bitboard occ = 0;
+		for (int i = 0; i < m.n; i++) occ |= SQUARE_BB[v[i]];
+
+		for (int i = 0; i < m.n; i++) {
+			if (color_of(m.slots[i]) != mover) continue;
+			const PieceType pt = type_of(m.slots[i]);
+
+			Bitboard from;
+			if (pt == PAWN) {
+				const Direction up = mover == WHITE ? NORTH : SOUTH;
+				const Rank rank = mover == WHITE ? rank_of(v[i]) : Rank(RANK8 - rank_of(v[i]));
+				const Square back = v[i] - up;
+				from = 0;
+				if (rank >= RANK3 && !(occ & SQUARE_BB[back])) {
+					from |= SQUARE_BB[back];
+					if (rank == RANK4 && !(occ & SQUARE_BB[back - up])) from |= SQUARE_BB[back - up];
+				}
+			} else {
+				from = attacks(pt, v[i], occ) & ~occ;
+			}
+
+			while (from) {
+				Square y[MAX_PIECES];
+				std::copy(v, v + m.n, y);
+				y[i] = pop_lsb(&from);
+				if (king_index(y[0], m.pawns) < 0) continue;
+				sort_groups(m, y);
+				const uint64_t pred = index_of(m, y, mover);
+
+				uint32_t e = entries[pred].load(std::memory_order_relaxed), next;
+				do {
+					if (state_of(e) != UNKNOWN) break;
+					int resolved = -1;
+					if (ply % 2 == 0) {
+						resolved = ply + 1;
+						next = make_entry(RESOLVED, resolved, 0, 0);
+					} else {
+						uint32_t count = count_of(e);
+						if (count == CANNOT_LOSE) break;
+						if (--count == 0) {
+							resolved = std::max(ply + 1, loss_ply_of(e));
+							next = make_entry(RESOLVED, resolved, 0, 0);
+						} else next = make_entry(UNKNOWN, 0, count, loss_ply_of(e));
+					}
+
+					if (entries[pred].compare_exchange_weak(e, next, std::memory_order_relaxed)) {
+						if (resolved >= 0) found.push_back({ resolved, pred });
+						break;
+					}
+				} while (true);
+			}
+		}
+	}
+}
+
+void Generator::generate(const Material& m, std::vector<uint16_t>& values) {
+	const uint64_t size = m.size();
+	std::unique_ptr<std::atomic<uint32_t>[]> entries(new std::atomic<uint32_t>[size]);
+	std::vector<Found> found(threads);
+	std::vector<std::vector<uint64_t>> queued(MAX_TB_PLY + 2);
+
+	auto begin = std::chrono::steady_clock::now();
+
+	parallel_for(threads, size, [&](int t, uint64_t first, uint64_t last) {
+		Position base[NCOLORS] = { Position("8/8/8/8/8/8/8/8 w - - 0 1"), Position("8/8/8/8/8/8/8/8 b - - 0 1") };
+		Square sq[MAX_PIECES];
+		Color stm;
+
+		for (uint64_t index = first; index < last; index++) {
+			entries[index] = make_entry(INVALID, 0, 0, 0);
+			if (!decode(m, index, sq, stm)) continue;
+
+			Bitboard occ = 0;
+			bool valid = true;
+			for (int i = 0; i < m.n; i++) {
+				valid &= !(occ & SQUARE_BB[sq[i]]);
+				valid &= type_of(m.slots[i]) != PAWN || (rank_of(sq[i]) != RANK1 && rank_of(sq[i]) != RANK8);
+				occ |= SQUARE_BB[sq[i]];
+			}
+			const int bk = 1 + int(m.pieces[WHITE].size());
+			if (!valid || (KING_ATTACKS[sq[0]] & SQUARE_BB[sq[bk]])) continue;
+
+			Position& p = base[stm];
+			for (int i = 0; i < m.n; i++) p.put_piece(m.slots[i], sq[i]);
+
+			//The side that is not to move may not be in check
+			if (stm == WHITE ? !p.in_check<BLACK>() : !p.in_check<WHITE>()) {
+				if (stm == WHITE) classify<WHITE>(p, index, entries.get(), found[t]);
+				else classify<BLACK>(p, index, entries.get(), found[t]);
+			}
+
+			for (int i = 0; i < m.n; i++) p.remove_piece(sq[i]);
+		}
+	});
+
+	auto merge = [&]() {
+		for (Found& f : found) {
+			for (auto& x : f) queued[x.first].push_back(x.second);
+			f.clear();
+		}
+	};
+	merge();
+
+	double init_seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+
+	int longest = 0;
+	for (int ply = 0; ply <= MAX_TB_PLY; ply++) {
+		//Wins through captures and promotions were queued before they were known to be the quickest, so they
+		//only count if the position has not been resolved yet. Positions resolved by propagate() were queued
+		//exactly once, when they were resolved
+		std::vector<uint64_t> list;
+		for (uint64_t index : queued[ply]) {
+			uint32_t e = entries[index];
+			if (state_of(e) == RESOLVED && ply_of(e) == ply) list.push_back(index);
+			else if (state_of(e) == UNKNOWN && ply % 2 == 1 &&
+				entries[index].compare_exchange_strong(e, make_entry(RESOLVED, ply, 0, 0)))
+				list.push_back(index);
+		}
+		std::sort(list.begin(), list.end());
+		list.erase(std::unique(list.begin(), list.end()), list.end());
+		std::vector<uint64_t>().swap(queued[ply]);
+
+		if (list.empty()) {
+			bool more = false;
+			for (int p = ply + 1; p <= MAX_TB_PLY && !more; p++) more = !queued[p].empty();
+			if (!more) break;
+			continue;
+		}
+		longest = ply;
+
+		parallel_for(threads, list.size(), [&](int t, uint64_t first, uint64_t last) {
+			for (uint64_t i = first; i < last; i++) propagate(m, list[i], ply, entries.get(), found[t]);
+		});
+		merge();
+	}
+
+	//Invalid positions are never probed, so they repeat the previous value to make longer runs
+	values.resize(size);
+	uint64_t results[3] = {};
+	uint16_t previous = 0;
+	for (uint64_t i = 0; i < size; i++) {
+		uint32_t e = entries[i];
+		if (state_of(e) == INVALID) {
+			values[i] = previous;
+			continue;
+		}
+		values[i] = previous = state_of(e) == RESOLVED ? uint16_t(ply_of(e) + 1) : 0;
+		results[state_of(e) != RESOLVED ? 0 : ply_of(e) % 2 ? 1 : 2]++;
+	}
+
+	double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+	std::cout << m.name() << ": " << results[0] + results[1] + results[2] << " positions, "
+		<< results[1] << " wins, " << results[2] << " losses, " << results[0] << " draws, longest mate "
+		<< longest << " plies, " << std::fixed << std::setprecision(2) << seconds << "s ("
+		<< init_seconds << "s setup)" << std::endl;
+}
+
+//Writes a table file, under a temporary name which is renamed when the file is complete
+void Generator::write(const Material& m, const std::vector<uint16_t>& values, Kind kind, const std::string& path) {
+	FileHeader h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, "SURGETB", 8);
+	h.version = FILE_VERSION;
+	h.kind = kind;
+	strncpy(h.material, m.name().c_str(), sizeof(h.material) - 1);
+	h.positions = values.size();
+	h.block_size = 1024;
+
+	//WDL tables store 0 for a draw, 1 for a win and 2 for a loss
+	auto value_of = [kind](uint16_t v) -> uint16_t {
+		return kind == DTM || v == 0 ? v : (v - 1) % 2 ? 1 : 2;
+	};
+
+	std::map<uint16_t, uint8_t> symbol;
+	for (uint16_t v : values) {
+		v = value_of(v);
+		if (symbol.count(v)) continue;
+		if (symbol.size() == 256) {
+			std::cerr << m.name() << " has more than 256 distinct values\n";
+			exit(1);
+		}
+		h.symbols[h.nsymbols] = v;
+		symbol[v] = uint8_t(h.nsymbols++);
+	}
+
+	std::vector<uint64_t> offsets;
+	std::vector<uint8_t> data;
+	for (uint64_t i = 0; i < values.size(); ) {
+		offsets.push_back(data.size());
+		uint64_t end = std::min<uint64_t>(i + h.block_size, values.size());
+		while (i < end) {
+			uint16_t v = value_of(values[i]);
+			uint32_t length = 0;
+			while (i < end && value_of(values[i]) == v) i++, length++;
+			data.push_back(symbol[v]);
+			do {
+				data.push_back(uint8_t((length & 127) | (length > 127 ? 128 : 0)));
+				length >>= 7;
+			} while (length);
+		}
+	}
+	offsets.push_back(data.size());
+
+	const std::string tmp = path + ".tmp";
+	{
+		std::ofstream out(tmp, std::ios::binary);
+		out.write((const char*) &h, sizeof(h));
+		out.write((const char*) offsets.data(), offsets.size() * sizeof(uint64_t));
+		out.write((const char*) data.data(), data.size());
+		if (!out) {
+			std::cerr << "Failed to write " << tmp << "\n";
+			exit(1);
+		}
+	}
+	rename(tmp.c_str(), path.c_str());
+	std::cout << "  " << path << ": " << sizeof(h) + offsets.size() * sizeof(uint64_t) + data.size()
+		<< " bytes" << std::endl;
+}
+
+//Reads the values of a table that was generated earlier
+bool Generator::read(const Material& m, std::vector<uint16_t>& values) {
+	std::ifstream in(dir + "/" + m.name() + KIND_EXTENSION[DTM], std::ios::binary);
+	std::vector<char> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+	const FileHeader* h = (const FileHeader*) file.data();
+
+	if (file.size() < sizeof(FileHeader) || memcmp(h->magic, "SURGETB", 8) != 0 ||
+		h->version != FILE_VERSION || h->kind != DTM || h->positions != m.size()) return false;
+
+	values.resize(m.size());
+	for (uint64_t i = 0; i < m.size(); i++) values[i] = read_value(h, i);
+	return true;
+}
+
+//Returns the values of a table, reading or generating it and every table it depends on first
+const std::vector<uint16_t>& Generator::table(const Material& m) {
+	auto it = tables.find(m.name());
+	if (it != tables.end()) return it->second;
+
+	//Every capture and promotion leads to a smaller table, which has to be complete before generating
+	for (Color c : { WHITE, BLACK }) {
+		const std::string& pieces = m.pieces[c];
+		for (size_t i = 0; i < pieces.size(); i++) {
+			std::string rest = pieces.substr(0, i) + pieces.substr(i + 1);
+			std::vector<std::string> sides = { rest };
+			if (pieces[i] == 'P')
+				for (char promoted : std::string("QRBN")) sides.push_back(rest + promoted);
+
+			for (const std::string& side : sides) {
+				Material smaller;
+				bool flipped;
+				smaller.set(c == WHITE ? side : m.pieces[WHITE], c == BLACK ? side : m.pieces[BLACK], flipped);
+				if (smaller.n > 2) table(smaller);
+			}
+		}
+	}
+
+	std::vector<uint16_t>& values = tables[m.name()];
+	if (read(m, values)) return values;
+
+	generate(m, values);
+	write(m, values, DTM, dir + "/" + m.name() + KIND_EXTENSION[DTM]);
+	write(m, values, WDL, dir + "/" + m.name() + KIND_EXTENSION[WDL]);
+	return values;
+}
+
+//Plays a move for whichever side is to move
+void play_move(Position& p, Move m) {
+	if (p.turn() == WHITE) p.play<WHITE>(m);
+	else p.play<BLACK>(m);
+}
+
+void undo_move(Position& p, Move m) {
+	if (p.turn() == BLACK) p.undo<WHITE>(m);
+	else p.undo<BLACK>(m);
+}
+
+//Returns the move that keeps the best value: the quickest win, or the slowest loss
+Move best_move(Position& p, const Tablebases& tb, const std::vector<Move>& moves) {
+	Move best;
+	int best_score = -1000000;
+	for (Move m : moves) {
+		play_move(p, m);
+		int wdl, plies;
+		if (tb.probe_dtm(p, wdl, plies)) {
+			int score = wdl < 0 ? 10000 - plies : wdl > 0 ? -10000 + plies : 0;
+			if (score > best_score) {
+				best_score = score;
+				best = m;
+			}
+		}
+		undo_move(p, m);
+	}
+	return best;
+}
+
+std::vector<Move> legal_moves(Position& p) {
+	Move list[218];
+	Move* last = p.turn() == WHITE ? p.generate_legals<WHITE>(list) : p.generate_legals<BLACK>(list);
+	return std::vector<Move>(list, last);
+}
+
+int probe(const std::string& dir, const std::string& fen) {
+	Tablebases tb;
+	tb.load(dir);
+
+	Position p(fen);
+	int wdl, plies;
+	if (!tb.probe_dtm(p, wdl, plies)) {
+		std::cerr << "The position is not in the tablebases\n";
+		return 1;
+	}
+	std::cout << (wdl > 0 ? "Win" : wdl < 0 ? "Loss" : "Draw");
+	if (wdl) std::cout << ", mate in " << plies << " plies";
+	std::cout << "\n";
+
+	//Follows the best moves to mate, while the line stays inside the tables
+	std::vector<Move> line;
+	for (int i = 0; wdl && i < plies; i++) {
+		std::vector<Move> moves = legal_moves(p);
+		Move m = best_move(p, tb, moves);
+		if (m == Move()) break;
+		line.push_back(m);
+		play_move(p, m);
+	}
+	for (Move m : line) std::cout << m << " ";
+	std::cout << "\n";
+	return 0;
+}
+
+//Probes random legal positions from every table that is loaded
+int bench(const std::string& dir, uint64_t probes) {
+	Tablebases tb;
+	if (tb.load(dir) == 0) {
+		std::cerr << "No tables in " << dir << "\n";
+		return 1;
+	}
+
+	DIR* d = opendir(dir.c_str());
+	std::vector<Material> materials;
+	while (dirent* e = readdir(d)) {
+		std::string file = e->d_name;
+		Material m;
+		if (file.size() > 4 && file.compare(file.size() - 4, 4, KIND_EXTENSION[DTM]) == 0 &&
+			m.parse(file.substr(0, file.size() - 4)) && tb.has(m.name(), WDL)) materials.push_back(m);
+	}
+	closedir(d);
+
+	PRNG rng(7);
+	Position base[NCOLORS] = { Position("8/8/8/8/8/8/8/8 w - - 0 1"), Position("8/8/8/8/8/8/8/8 b - - 0 1") };
+	uint64_t total = 0, checksum = 0;
+	double total_seconds = 0;
+
+	for (const Material& m : materials) {
+		//Legal placements are collected first, so that only probing is timed
+		std::vector<uint64_t> indices;
+		while (indices.size() < std::min<uint64_t>(probes, 100000)) {
+			uint64_t index = rng.rand<uint64_t>() % m.size();
+			Square sq[MAX_PIECES];
+			Color stm;
+			Bitboard occ = 0;
+			bool valid = decode(m, index, sq, stm);
+			for (int i = 0; i < m.n; i++) {
+				valid &= !(occ & SQUARE_BB[sq[i]]);
+				valid &= type_of(m.slots[i]) != PAWN || (rank_of(sq[i]) != RANK1 && rank_of(sq[i]) != RANK8);
+				occ |= SQUARE_BB[sq[i]];
+			}
+			if (!valid) continue;
+
+			Position& p = base[stm];
+			for (int i = 0; i < m.n; i++) p.put_piece(m.slots[i], sq[i]);
+			valid = stm == WHITE ? !p.in_check<BLACK>() : !p.in_check<WHITE>();
+			valid &= !(KING_ATTACKS[sq[0]] & p.bitboard_of(BLACK, KING));
+			for (int i = 0; i < m.n; i++) p.remove_piece(sq[i]);
+			if (valid) indices.push_back(index);
+		}
+
+		for (Kind kind : { WDL, DTM }) {
+			uint64_t n = 0;
+			auto begin = std::chrono::steady_clock::now();
+			while (n < probes) {
+				for (uint64_t index : indices) {
+					Square sq[MAX_PIECES];
+					Color stm;
+					decode(m, index, sq, stm);
+					Position& p = base[stm];
+					for (int i = 0; i < m.n; i++) p.put_piece(m.slots[i], sq[i]);
+
+					int wdl = 0, plies = 0;
+					if (kind == WDL) tb.probe_wdl(p, wdl);
+					else tb.probe_dtm(p, wdl, plies);
+					checksum += wdl + plies;
+
+					for (int i = 0; i < m.n; i++) p.remove_piece(sq[i]);
+				}
+				n += indices.size();
+			}
+			double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count();
+			total += n;
+			total_seconds += seconds;
+			std::cout << std::setw(10) << std::left << m.name() << KIND_EXTENSION[kind] + 1 << " "
+				<< (uint64_t) (n / seconds) << " probes/s\n";
+		}
+	}
+
+	std::cout << "\nTotal: " << (uint64_t) (total / total_seconds) << " probes/s (checksum " << checksum << ")\n";
+	return 0;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	const std::string command = argc > 1 ? argv[1] : "";
+
+	if (command == "generate" && argc > 3) {
+		int threads = int(std::thread::hardware_concurrency());
+		std::vector<Material> materials;
+		for (int i = 3; i < argc; i++) {
+			Material m;
+			if (std::string(argv[i]) == "-t" && i + 1 < argc) threads = std::stoi(argv[++i]);
+			else if (m.parse(argv[i])) materials.push_back(m);
+			else {
+				std::cerr << "Not a material with at most " << MAX_PIECES << " pieces: " << argv[i] << "\n";
+				return 1;
+			}
+		}
+
+		mkdir(argv[2], 0755);
+		Generator generator(argv[2], std::max(threads, 1));
+		auto begin = std::chrono::steady_clock::now();
+		for (const Material& m : materials) generator.table(m);
+		std::cout << "Total time: " << std::chrono::duration<double>(std::chrono::steady_clock::now() - begin).count()
+			<< "s\n";
+		return 0;
+	}
+
+	if (command == "probe" && argc > 3) return probe(argv[2], argv[3]);
+	if (command == "bench" && argc > 2) return bench(argv[2], argc > 3 ? std::stoull(argv[3]) : 1000000);
+
+	std::cerr << "Usage: tablebase generate <dir> <material>... [-t threads]\n"
+		<< "       tablebase probe <dir> <fen>\n"
+		<< "       tablebase bench <dir> [probes per table]\n";
+	return 1;
+}
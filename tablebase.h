@@ -0,0 +1,349 @@
+#pragma once
+
+#include <map>
+#include <string>
+#include <vector>
+#include <cstring>
+#include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "surge.h"
+
+//Endgame tablebases for up to 5 pieces, generated by tablebase.cpp, and a prober that maps the files read-only
+//so that they can be probed during search.
+//
+//Each material combination, such as KRPvKR, has one table which is indexed by the squares of its pieces and the
+//side to move. The stronger side is always stored as White; positions where Black has the stronger material
+//are probed with the colors swapped. Without pawns, the board is reduced by its 8 symmetries so that the white
+//king is on the a1-d1-d4 triangle, and with pawns by the left-right mirror so that it is on files a-d.
+//
+//A table stores a value for every index: 0 for a draw, or 1 + the number of plies to mate with best play. An odd
+//number of plies is a win for the side to move and an even number a loss, 0 plies being checkmate. Positions
+//with castling rights or an en passant square are not in the tables. Positions right after a double push are
+//stored as if en passant were not possible, which only matters in pawn endgames where the capture is legal.
+namespace tablebase {
+
+const int MAX_PIECES = 5;
+
+//The order of the non-king pieces of each side in a material name, strongest first
+const std::string PIECE_ORDER = "QRBNP";
+
+inline PieceType piece_type_of(char c) {
+	return PieceType(PIECE_STR.find(c));
+}
+
+//Returns true if the pieces of one side are at least as strong as those of the other. The side with more
+//pieces is stronger, and otherwise the side with the stronger piece at the first difference
+inline bool stronger(const std::string& a, const std::string& b) {
+	if (a.size() != b.size()) return a.size() > b.size();
+	for (size_t i = 0; i < a.size(); i++)
+		if (a[i] != b[i]) return PIECE_ORDER.find(a[i]) < PIECE_ORDER.find(b[i]);
+	return true;
+}
+
+//A material combination. The squares of a position are given in slot order: the white king, the other white
+//pieces, the black king and the other black pieces, each side in PIECE_ORDER
+struct Material {
+	std::string pieces[NCOLORS];
+	Piece slots[MAX_PIECES];
+	int n = 0;
+	bool pawns = false;
+
+	//Sets the non-king pieces of each side, swapping the sides if Black is stronger. Returns false if there
+	//are too many pieces. flipped is set if the sides were swapped
+	bool set(std::string white, std::string black, bool& flipped) {
+		auto by_order = [](char a, char b) { return PIECE_ORDER.find(a) < PIECE_ORDER.find(b); };
+		std::sort(white.begin(), white.end(), by_order);
+		std::sort(black.begin(), black.end(), by_order);
+		if (white.size() + black.size() + 2 > MAX_PIECES) return false;
+
+		flipped = !stronger(white, black);
+		pieces[WHITE] = flipped ? black : white;
+		pieces[BLACK] = flipped ? white : black;
+
+		n = 0;
+		for (Color c : { WHITE, BLACK }) {
+			slots[n++] = make_piece(c, KING);
+			for (char ch : pieces[c]) slots[n++] = make_piece(c, piece_type_of(ch));
+		}
+		pawns = (pieces[WHITE] + pieces[BLACK]).find('P') != std::string::npos;
+		return true;
+	}
+
+	//Parses a name such as KRPvKR
+	bool parse(const std::string& name) {
+		size_t v = name.find('v');
+		if (v == std::string::npos || name[0] != 'K' || v + 1 >= name.size() || name[v + 1] != 'K') return false;
+		std::string white = name.substr(1, v - 1), black = name.substr(v + 2);
+		for (char c : white + black)
+			if (PIECE_ORDER.find(c) == std::string::npos) return false;
+		bool flipped;
+		return set(white, black, flipped);
+	}
+
+	std::string name() const { return "K" + pieces[WHITE] + "vK" + pieces[BLACK]; }
+
+	inline int king_squares() const { return pawns ? 32 : 10; }
+
+	//The number of indices of the table
+	inline uint64_t size() const {
+		uint64_t s = 2 * king_squares();
+		for (int i = 1; i < n; i++) s *= 64;
+		return s;
+	}
+};
+
+//Returns the material of a position, with the sides swapped if Black is stronger. Returns false if there are
+//too many pieces
+inline bool material_of(const Position& p, Material& m, bool& flipped) {
+	std::string pieces[NCOLORS];
+	for (Color c : { WHITE, BLACK })
+		for (char ch : PIECE_ORDER)
+			for (int i = pop_count(p.bitboard_of(c, piece_type_of(ch))); i > 0; i--) pieces[c] += ch;
+	return m.set(pieces[WHITE], pieces[BLACK], flipped);
+}
+
+//Applies one of the 8 symmetries of the board to a square. Bit 0 mirrors the files, bit 1 the ranks and bit 2
+//the main diagonal. Only the first two symmetries keep pawns moving in the same direction
+inline Square transform(Square s, int t) {
+	int f = file_of(s), r = rank_of(s);
+	if (t & 1) f = 7 - f;
+	if (t & 2) r = 7 - r;
+	if (t & 4) std::swap(f, r);
+	return create_square(File(f), Rank(r));
+}
+
+inline int symmetries(const Material& m) { return m.pawns ? 2 : 8; }
+
+//Returns the index of the white king square, or -1 if the king is outside the reduced board
+inline int king_index(Square s, bool pawns) {
+	const int f = file_of(s), r = rank_of(s);
+	if (pawns) return f < 4 ? r * 4 + f : -1;
+	if (f > 3 || r > f) return -1;
+	return 4 * r - r * (r - 1) / 2 + f - r;
+}
+
+inline Square king_square(int index, bool pawns) {
+	if (pawns) return create_square(File(index % 4), Rank(index / 4));
+	int r = 0;
+	while (index >= 4 - r) index -= 4 - r++;
+	return create_square(File(r + index), Rank(r));
+}
+
+//Sorts the squares of identical pieces, so that every position has a single index
+inline void sort_groups(const Material& m, Square sq[]) {
+	for (int i = 1; i < m.n; i++)
+		for (int j = i; j > 0 && m.slots[j - 1] == m.slots[j] && sq[j - 1] > sq[j]; j--)
+			std::swap(sq[j - 1], sq[j]);
+}
+
+//Returns the index of squares which are already reduced and sorted
+inline uint64_t index_of(const Material& m, const Square sq[], Color stm) {
+	uint64_t index = uint64_t(stm) * m.king_squares() + king_index(sq[0], m.pawns);
+	for (int i = 1; i < m.n; i++) index = index * 64 + sq[i];
+	return index;
+}
+
+//Returns the index of any placement of the pieces. The first symmetry that brings the white king onto the
+//reduced board is applied, so a position which is already reduced keeps its squares
+inline uint64_t encode(const Material& m, const Square sq[], Color stm) {
+	Square t[MAX_PIECES];
+	for (int x = 0; x < symmetries(m); x++) {
+		if (king_index(transform(sq[0], x), m.pawns) < 0) continue;
+		for (int i = 0; i < m.n; i++) t[i] = transform(sq[i], x);
+		break;
+	}
+	sort_groups(m, t);
+	return index_of(m, t, stm);
+}
+
+//Returns the squares and side to move of an index. Returns false if identical pieces are not in sorted order,
+//since only the sorted placement of a position is used
+inline bool decode(const Material& m, uint64_t index, Square sq[], Color& stm) {
+	for (int i = m.n - 1; i > 0; i--) {
+		sq[i] = Square(index % 64);
+		index /= 64;
+	}
+	sq[0] = king_square(int(index % m.king_squares()), m.pawns);
+	stm = Color(index / m.king_squares());
+
+	for (int i = 1; i < m.n; i++)
+		if (m.slots[i - 1] == m.slots[i] && sq[i - 1] >= sq[i]) return false;
+	return true;
+}
+
+//Returns the squares of the pieces of a position in slot order, with the colors swapped if flipped is set
+inline void squares_of(const Position& p, const Material& m, bool flipped, Square sq[]) {
+	for (int i = 0; i < m.n; ) {
+		Piece pc = m.slots[i];
+		Bitboard b = p.bitboard_of(flipped ? ~color_of(pc) : color_of(pc), type_of(pc));
+		while (b) {
+			Square s = pop_lsb(&b);
+			sq[i++] = flipped ? Square(s ^ 56) : s;
+		}
+	}
+}
+
+enum Kind : uint32_t {
+	WDL, DTM
+};
+
+const char* const KIND_EXTENSION[2] = { ".wdl", ".dtm" };
+const uint32_t FILE_VERSION = 1;
+
+//A table file is this header, the offsets of the blocks (one more than the number of blocks, relative to the end
+//of the offsets) and the blocks. Each block holds block_size values, compressed as runs of a symbol byte
+//followed by the length of the run as a little-endian base-128 varint. Symbols index the symbols array
+struct FileHeader {
+	char magic[8];
+	uint32_t version;
+	uint32_t kind;
+	char material[16];
+	uint64_t positions;
+	uint32_t block_size;
+	uint32_t nsymbols;
+	uint16_t symbols[256];
+};
+
+inline uint64_t blocks_of(const FileHeader* h) {
+	return (h->positions + h->block_size - 1) / h->block_size;
+}
+
+//Reads the value of one index from a table file
+inline uint16_t read_value(const FileHeader* h, uint64_t index) {
+	const uint64_t* offsets = (const uint64_t*) (h + 1);
+	const uint8_t* p = (const uint8_t*) (offsets + blocks_of(h) + 1) + offsets[index / h->block_size];
+	uint32_t pos = uint32_t(index % h->block_size);
+
+	while (true) {
+		uint8_t symbol = *p++;
+		uint32_t length = 0;
+		for (int shift = 0; ; shift += 7) {
+			uint8_t b = *p++;
+			length |= uint32_t(b & 127) << shift;
+			if (!(b & 128)) break;
+		}
+		if (pos < length) return h->symbols[symbol];
+		pos -= length;
+	}
+}
+
+//The WDL and DTM tables found in a directory, mapped read-only. Probing is thread-safe
+class Tablebases {
+	struct Table {
+		const FileHeader* header;
+		size_t size;
+	};
+
+	std::map<std::string, Table> tables[2];
+	int largest = 0;
+
+public:
+	Tablebases() {}
+	Tablebases(const Tablebases&) = delete;
+	Tablebases& operator=(const Tablebases&) = delete;
+
+	~Tablebases() {
+		for (auto& kind : tables)
+			for (auto& t : kind) munmap((void*) t.second.header, t.second.size);
+	}
+
+	//Maps every table file in a directory. Returns the number of files mapped
+	int load(const std::string& dir) {
+		DIR* d = opendir(dir.c_str());
+		if (!d) return 0;
+
+		int loaded = 0;
+		while (dirent* e = readdir(d)) {
+			std::string file = e->d_name;
+			for (Kind kind : { WDL, DTM }) {
+				std::string ext = KIND_EXTENSION[kind];
+				if (file.size() <= ext.size() || file.compare(file.size() - ext.size(), ext.size(), ext) != 0)
+					continue;
+				Material m;
+				if (m.parse(file.substr(0, file.size() - ext.size())) && map(dir + "/" + file, kind, m)) {
+					largest = std::max(largest, m.n);
+					loaded++;
+				}
+			}
+		}
+		closedir(d);
+		return loaded;
+	}
+
+	//The largest number of pieces of any table that is loaded
+	inline int max_pieces() const { return largest; }
+
+	inline bool has(const std::string& name, Kind kind) const { return tables[kind].count(name) != 0; }
+
+	//Probes for a win (1), draw (0) or loss (-1) for the side to move. Returns false if the position is not in
+	//a loaded table
+	bool probe_wdl(const Position& p, int& wdl) const {
+		uint16_t value;
+		if (!probe(p, WDL, value)) return false;
+		wdl = value == 1 ? 1 : value == 2 ? -1 : 0;
+		return true;
+	}
+
+	//Probes for a win (1), draw (0) or loss (-1) for the side to move, and the number of plies to mate with best
+	//play. Returns false if the position is not in a loaded table
+	bool probe_dtm(const Position& p, int& wdl, int& plies) const {
+		uint16_t value;
+		if (!probe(p, DTM, value)) return false;
+		plies = value ? value - 1 : 0;
+		wdl = value == 0 ? 0 : plies % 2 ? 1 : -1;
+		return true;
+	}
+
+private:
+	bool map(const std::string& path, Kind kind, const Material& m) {
+		int fd = open(path.c_str(), O_RDONLY);
+		if (fd < 0) return false;
+
+		struct stat st;
+		void* p = MAP_FAILED;
+		if (fstat(fd, &st) == 0 && size_t(st.st_size) >= sizeof(FileHeader))
+			p = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (p == MAP_FAILED) return false;
+
+		const FileHeader* h = (const FileHeader*) p;
+		if (memcmp(h->magic, "SURGETB", 8) != 0 || h->version != FILE_VERSION || h->kind != kind ||
+			m.name() != h->material || h->positions != m.size()) {
+			munmap(p, st.st_size);
+			return false;
+		}
+
+		madvise(p, st.st_size, MADV_RANDOM);
+		tables[kind][m.name()] = { h, size_t(st.st_size) };
+		return true;
+	}
+
+	bool probe(const Position& p, Kind kind, uint16_t& value) const {
+		const UndoInfo& state = p.history[p.ply()];
+		if (state.epsq != NO_SQUARE || castling_rights(state.entry) != 0) return false;
+		if (pop_count(p.all_pieces<WHITE>() | p.all_pieces<BLACK>()) > largest) return false;
+
+		Material m;
+		bool flipped;
+		if (!material_of(p, m, flipped)) return false;
+
+		//Bare kings are always a draw and have no table
+		if (m.n == 2) {
+			value = 0;
+			return true;
+		}
+
+		auto it = tables[kind].find(m.name());
+		if (it == tables[kind].end()) return false;
+
+		Square sq[MAX_PIECES];
+		squares_of(p, m, flipped, sq);
+		value = read_value(it->second.header, encode(m, sq, flipped ? ~p.turn() : p.turn()));
+		return true;
+	}
+};
+
+}
@@ -0,0 +1,305 @@
+#include <iostream>
+#include <iomanip>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "surge.h"
+
+//Counts the distinct positions reachable at each depth from a position, breadth first. Each depth is expanded by
+//several threads, which sort and deduplicate children in buffers of bounded size and write them to disk as sorted
+//runs. The runs are then merged in parallel, each thread taking one range of hashes, and the unique positions
+//become the frontier of the next depth. Positions are identified by their Zobrist hash, leaving out an en passant
+//square which cannot be captured legally. At the last depth only the hashes are kept, computed with hash_after()
+//without playing the moves, except for double pushes.
+//
+//Usage:
+//	unique <depth> [threads] [memory in MB] [directory] [fen]
+
+//A position of the frontier, with the hash it is sorted and deduplicated by
+struct Record {
+	uint64_t hash;
+	PackedPosition position;
+};
+
+inline uint64_t key_of(const Record& r) { return r.hash; }
+inline uint64_t key_of(uint64_t hash) { return hash; }
+
+//A sorted file of records mapped read-only
+template<typename T>
+struct MappedRun {
+	const T* data = nullptr;
+	size_t size = 0;
+
+	explicit MappedRun(const std::string& path) {
+		int fd = open(path.c_str(), O_RDONLY);
+		struct stat st;
+		if (fd < 0 || fstat(fd, &st) != 0) {
+			std::cerr << "Failed to open " << path << "\n";
+			exit(1);
+		}
+
+		size = st.st_size / sizeof(T);
+		if (size > 0) {
+			void* p = mmap(nullptr, size * sizeof(T), PROT_READ, MAP_SHARED, fd, 0);
+			if (p == MAP_FAILED) {
+				std::cerr << "Failed to map " << path << "\n";
+				exit(1);
+			}
+			madvise(p, size * sizeof(T), MADV_SEQUENTIAL);
+			data = (const T*) p;
+		}
+		close(fd);
+	}
+
+	~MappedRun() { if (data) munmap((void*) data, size * sizeof(T)); }
+	MappedRun(const MappedRun&) = delete;
+	MappedRun& operator=(const MappedRun&) = delete;
+};
+
+void write_file(const std::string& path, const void* data, size_t bytes) {
+	FILE* f = fopen(path.c_str(), "wb");
+	if (!f || fwrite(data, 1, bytes, f) != bytes || fclose(f) != 0) {
+		std::cerr << "Failed to write " << path << "\n";
+		exit(1);
+	}
+}
+
+//The state shared by the threads expanding one depth
+template<typename T>
+struct Expansion {
+	const std::vector<std::unique_ptr<MappedRun<Record>>>& frontier;
+	std::string dir;
+	int depth;
+	size_t buffer_size;
+
+	//The chunks of the frontier, as (run, first record), and the next one to be expanded
+	std::vector<std::pair<size_t, size_t>> chunks;
+	std::atomic<size_t> next_chunk{ 0 };
+	std::mutex mutex;
+	std::vector<std::string> runs;
+	std::atomic<uint64_t> children{ 0 };
+
+	Expansion(const std::vector<std::unique_ptr<MappedRun<Record>>>& frontier, const std::string& dir, int depth,
+		size_t buffer_size) : frontier(frontier), dir(dir), depth(depth), buffer_size(buffer_size) {}
+};
+
+const size_t CHUNK_SIZE = 1024;
+
+//Returns the hash a position is deduplicated by. The position only records an en passant square if an enemy pawn
+//attacks it, but the capture may still leave the king in check. Since such a square changes nothing, it is taken out
+//of the hash
+template<Color Us>
+uint64_t unique_hash(Position& p) {
+	const Square epsq = p.history[p.ply()].epsq;
+	if (epsq == NO_SQUARE) return p.get_hash();
+
+	MoveList<Us> list(p);
+	for (Move m : list)
+		if (m.flags() == EN_PASSANT) return p.get_hash();
+	return p.get_hash() ^ zobrist::en_passant_keys[file_of(epsq)];
+}
+
+//Only a double push can leave an en passant square, so other moves are hashed without being played
+template<Color Us>
+inline void add_child(Position& p, Move m, std::vector<uint64_t>& out) {
+	if (m.flags() != DOUBLE_PUSH) {
+		out.push_back(p.hash_after(m));
+		return;
+	}
+	p.play<Us>(m);
+	out.push_back(unique_hash<~Us>(p));
+	p.undo<Us>(m);
+}
+
+template<Color Us>
+inline void add_child(Position& p, Move m, std::vector<Record>& out) {
+	p.play<Us>(m);
+	out.push_back({ unique_hash<~Us>(p), p.pack() });
+	p.undo<Us>(m);
+}
+
+template<Color Us, typename T>
+inline size_t add_children(Position& p, std::vector<T>& out) {
+	MoveList<Us> list(p);
+	for (Move m : list) add_child<Us>(p, m, out);
+	return list.size();
+}
+
+//Sorts and deduplicates a buffer of children and writes it as a run
+template<typename T>
+void flush(Expansion<T>& e, std::vector<T>& buffer, int thread, int& count) {
+	if (buffer.empty()) return;
+	std::sort(buffer.begin(), buffer.end(), [](const T& a, const T& b) { return key_of(a) < key_of(b); });
+	auto last = std::unique(buffer.begin(), buffer.end(),
+		[](const T& a, const T& b) { return key_of(a) == key_of(b); });
+
+	const std::string path = e.dir + "/unique." + std::to_string(e.depth) + ".run" + std::to_string(thread) +
+		"." + std::to_string(count++);
+	write_file(path, buffer.data(), (last - buffer.begin()) * sizeof(T));
+	buffer.clear();
+
+	std::lock_guard<std::mutex> lock(e.mutex);
+	e.runs.push_back(path);
+}
+
+template<typename T>
+void expand(Expansion<T>& e, int thread) {
+	std::unique_ptr<Position> p(new Position());
+	std::vector<T> buffer;
+	buffer.reserve(e.buffer_size + 256);
+	uint64_t children = 0;
+	int count = 0;
+
+	for (size_t chunk; (chunk = e.next_chunk++) < e.chunks.size(); ) {
+		const MappedRun<Record>& r = *e.frontier[e.chunks[chunk].first];
+		const size_t begin = e.chunks[chunk].second, end = std::min(begin + CHUNK_SIZE, r.size);
+		for (size_t i = begin; i < end; i++) {
+			p->unpack(r.data[i].position);
+			children += p->turn() == WHITE ? add_children<WHITE>(*p, buffer) : add_children<BLACK>(*p, buffer);
+			if (buffer.size() >= e.buffer_size) flush(e, buffer, thread, count);
+		}
+	}
+
+	flush(e, buffer, thread, count);
+	e.children += children;
+}
+
+//Merges the part of the runs whose hashes are in [lo, hi], dropping duplicates. The unique records are written to
+//<out> unless it is empty
+template<typename T>
+uint64_t merge(const std::vector<std::unique_ptr<MappedRun<T>>>& runs, uint64_t lo, uint64_t hi,
+	const std::string& out) {
+	typedef std::pair<uint64_t, size_t> Head;
+	std::priority_queue<Head, std::vector<Head>, std::greater<Head>> heads;
+	std::vector<const T*> pos(runs.size()), end(runs.size());
+
+	auto less = [](const T& a, uint64_t key) { return key_of(a) < key; };
+	for (size_t i = 0; i < runs.size(); i++) {
+		const T* first = runs[i]->data, *last = runs[i]->data + runs[i]->size;
+		pos[i] = std::lower_bound(first, last, lo, less);
+		end[i] = hi == UINT64_MAX ? last : std::lower_bound(first, last, hi + 1, less);
+		if (pos[i] != end[i]) heads.push({ key_of(*pos[i]), i });
+	}
+
+	FILE* f = out.empty() ? nullptr : fopen(out.c_str(), "wb");
+	if (!out.empty() && !f) {
+		std::cerr << "Failed to write " << out << "\n";
+		exit(1);
+	}
+
+	std::vector<T> buffer;
+	uint64_t unique = 0, last_key = 0;
+	while (!heads.empty()) {
+		Head h = heads.top();
+		heads.pop();
+		if (unique == 0 || h.first != last_key) {
+			last_key = h.first;
+			unique++;
+			if (f) {
+				buffer.push_back(*pos[h.second]);
+				if (buffer.size() == 4096) {
+					fwrite(buffer.data(), sizeof(T), buffer.size(), f);
+					buffer.clear();
+				}
+			}
+		}
+		if (++pos[h.second] != end[h.second]) heads.push({ key_of(*pos[h.second]), h.second });
+	}
+
+	if (f && ((!buffer.empty() && fwrite(buffer.data(), sizeof(T), buffer.size(), f) != buffer.size()) ||
+		fclose(f) != 0)) {
+		std::cerr << "Failed to write " << out << "\n";
+		exit(1);
+	}
+	return unique;
+}
+
+//Expands the frontier by one ply and returns the number of unique children. Unless this is the last depth, the
+//frontier is replaced by the unique children
+template<typename T>
+uint64_t next_depth(std::vector<std::unique_ptr<MappedRun<Record>>>& frontier, std::vector<std::string>& files,
+	const std::string& dir, int depth, int threads, size_t memory) {
+	using namespace std::chrono;
+	auto begin = steady_clock::now();
+
+	Expansion<T> e(frontier, dir, depth, std::max<size_t>(memory / threads / sizeof(T), CHUNK_SIZE));
+	for (size_t run = 0; run < frontier.size(); run++)
+		for (size_t i = 0; i < frontier[run]->size; i += CHUNK_SIZE) e.chunks.emplace_back(run, i);
+	std::vector<std::thread> workers;
+	for (int i = 0; i < threads; i++) workers.emplace_back(expand<T>, std::ref(e), i);
+	for (std::thread& t : workers) t.join();
+	workers.clear();
+
+	auto expanded = steady_clock::now();
+	frontier.clear();
+	for (const std::string& file : files) unlink(file.c_str());
+	files.clear();
+
+	//Hashes are uniformly distributed, so equal ranges give each thread about the same amount of work
+	std::vector<std::unique_ptr<MappedRun<T>>> runs;
+	for (const std::string& run : e.runs) runs.emplace_back(new MappedRun<T>(run));
+	std::vector<uint64_t> unique(threads);
+	for (int i = 0; i < threads; i++) {
+		const uint64_t lo = UINT64_MAX / threads * i, hi = i == threads - 1 ? UINT64_MAX : lo + UINT64_MAX / threads - 1;
+		const std::string out = std::is_same<T, Record>::value ?
+			dir + "/unique." + std::to_string(depth) + "." + std::to_string(i) : "";
+		if (!out.empty()) files.push_back(out);
+		workers.emplace_back([&runs, &unique, i, lo, hi, out] { unique[i] = merge(runs, lo, hi, out); });
+	}
+	for (std::thread& t : workers) t.join();
+	runs.clear();
+	for (const std::string& run : e.runs) unlink(run.c_str());
+	for (const std::string& file : files) frontier.emplace_back(new MappedRun<Record>(file));
+
+	uint64_t total = 0;
+	for (uint64_t u : unique) total += u;
+
+	auto merged = steady_clock::now();
+	double expand_time = duration<double>(expanded - begin).count();
+	double merge_time = duration<double>(merged - expanded).count();
+	std::cout << std::setw(5) << depth << std::setw(16) << e.children << std::setw(16) << total
+		<< std::setw(8) << e.runs.size() << std::fixed << std::setprecision(2)
+		<< std::setw(10) << expand_time << std::setw(10) << merge_time
+		<< std::setw(12) << e.children / (expand_time + merge_time) / 1e6 << std::endl;
+	return total;
+}
+
+int main(int argc, char* argv[]) {
+	//Make sure to initialise all databases before using the library!
+	initialise_all_databases();
+	zobrist::initialise_zobrist_keys();
+
+	if (argc < 2) {
+		std::cerr << "Usage: unique <depth> [threads] [memory in MB] [directory] [fen]\n";
+		return 1;
+	}
+
+	const int depth = std::stoi(argv[1]);
+	const int threads = std::max(argc > 2 ? std::stoi(argv[2]) : int(std::thread::hardware_concurrency()), 1);
+	const size_t memory = (argc > 3 ? std::stoull(argv[3]) : 1024) << 20;
+	const std::string dir = argc > 4 ? argv[4] : ".";
+	const std::string fen = argc > 5 ? argv[5] : DEFAULT_FEN;
+
+	std::unique_ptr<Position> root(new Position(fen));
+	std::vector<std::string> files = { dir + "/unique.0.0" };
+	Record r = { root->turn() == WHITE ? unique_hash<WHITE>(*root) : unique_hash<BLACK>(*root), root->pack() };
+	write_file(files[0], &r, sizeof(r));
+	std::vector<std::unique_ptr<MappedRun<Record>>> frontier;
+	frontier.emplace_back(new MappedRun<Record>(files[0]));
+
+	std::cout << "depth        children          unique    runs    expand     merge  Mchildren/s\n";
+	for (int d = 1; d <= depth; d++) {
+		if (d < depth) next_depth<Record>(frontier, files, dir, d, threads, memory);
+		else next_depth<uint64_t>(frontier, files, dir, d, threads, memory);
+	}
+
+	frontier.clear();
+	for (const std::string& file : files) unlink(file.c_str());
+	return 0;
+}